@@ -0,0 +1,244 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "baud.h"
+
+// must match the clock setup in main.c
+#ifndef F_CPU
+#define F_CPU 10000000UL
+#endif
+
+// The preamble byte 0x55, along with the start and stop bits, is a square
+// wave on the bus with a period of two bit times. TCB1 is used in frequency
+// measurement mode, which captures the timer count on each falling edge and
+// then restarts the count. This measures full periods of the square wave so
+// any rise/fall time distortion of the optocouplers is cancelled out.
+//
+// With a 10 MHz timer clock, the USART BAUD register value (4 * Fclk / Fbaud)
+// is the same as twice the measured period:
+//
+// period = 2 * Fclk / Fbaud
+// BAUDREG = 4 * Fclk / Fbaud = 2 * period
+
+// limits of measurable periods
+// the lower limit keeps BAUD register >= 64 as required by the USART
+// the upper limit keeps the sum of periods from overflowing 16 bits
+// bps = 2 * Fclk / period, so at 10 MHz with the default BAUD_LOCK_CNT of 8
+// (PERIOD_MAX 8191) this is 20000000 / 8191 = 2442 up to
+// 20000000 / 32 = 625000 bps
+#define PERIOD_MIN 32
+#define PERIOD_MAX (65535U / BAUD_LOCK_CNT)
+
+static volatile bool locked = false;
+
+// data rate to go back to, for fallback. this is the rate that was in use
+// before the last baud_set(), which may have been found by autobaud
+static uint16_t restore_baudreg;
+
+// receive errors in a row, see baud_rx_error()
+static volatile uint8_t errcnt;
+
+// state of the current run of periods
+static uint8_t runcnt;
+static uint16_t runref;
+static uint16_t runsum;
+
+// TCB1 capture interrupt handler
+// called at the end of each signal period while searching
+ISR(TCB1_INT_vect)
+{
+    // reading the capture value clears the interrupt flag
+    uint16_t period = TCB1.CCMP;
+    uint16_t tol = runref >> 3;
+
+    // if period matches the first of the run within 1/8 then add to run
+    if (runcnt && (period >= (runref - tol)) && (period <= (runref + tol)))
+    {
+        runsum += period;
+        ++runcnt;
+    }
+    // otherwise, if in range start a new run with this period
+    else if ((period >= PERIOD_MIN) && (period <= PERIOD_MAX))
+    {
+        runref = period;
+        runsum = period;
+        runcnt = 1;
+    }
+    // out of range, not a preamble
+    else
+    {
+        runcnt = 0;
+    }
+
+    // enough consistent periods, program the USART from the average
+    // and stop searching
+    if (runcnt == BAUD_LOCK_CNT)
+    {
+        USART0.BAUD = (runsum + (BAUD_LOCK_CNT / 4)) / (BAUD_LOCK_CNT / 2);
+        TCB1.CTRLA = 0;
+        TCB1.INTCTRL = 0;
+        locked = true;
+    }
+}
+
+// stop searching and program the USART data rate
+static void baud_lock(uint16_t baudreg)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        TCB1.CTRLA = 0;
+        TCB1.INTCTRL = 0;
+        USART0.BAUD = baudreg;
+        locked = true;
+    }
+}
+
+//////////
+//
+// See header file for public function API descriptions.
+//
+//////////
+
+// set up hardware and start searching
+void baud_init(uint16_t baudreg)
+{
+    restore_baudreg = baudreg;
+    USART0.BAUD = baudreg;
+
+    // route the serial pin (PA1) to TCB1 through async event channel 0
+    EVSYS.ASYNCCH0 = EVSYS_ASYNCCH0_PORTA_PIN1_gc;
+    EVSYS.ASYNCUSER11 = EVSYS_ASYNCUSER11_ASYNCCH0_gc;
+
+    // frequency measurement mode, capture on falling edge (start bit)
+    TCB1.CTRLB = TCB_CNTMODE_FRQ_gc;
+    TCB1.EVCTRL = TCB_CAPTEI_bm | TCB_EDGE_bm | TCB_FILTER_bm;
+
+    baud_search();
+}
+
+// start measuring the data rate
+// if keep is set and there is already a data rate, the USART keeps
+// receiving at that rate until the measurement is done
+static void baud_measure(bool keep)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        locked = keep && locked;
+        errcnt = 0;
+        runcnt = 0;
+        runref = 0;
+        // first capture after enable is not a full period, but it will
+        // not match the run that follows
+        TCB1.CNT = 0;
+        TCB1.INTFLAGS = TCB_CAPT_bm;
+        TCB1.INTCTRL = TCB_CAPT_bm;
+        TCB1.CTRLA = TCB_CLKSEL_CLKDIV1_gc | TCB_ENABLE_bm;
+    }
+}
+
+// start searching for data rate
+void baud_search(void)
+{
+    baud_measure(false);
+}
+
+// measure the data rate again, but keep using the current one
+void baud_recheck(void)
+{
+    baud_measure(true);
+}
+
+// set specific data rate
+bool baud_set(uint32_t bps)
+{
+    // BAUDREG = (4 * Fclk) / Fbaud, which must be at least 64
+    if ((bps == 0) || (bps > ((4UL * F_CPU) / 64UL)))
+    {
+        return false;
+    }
+    uint32_t baudreg = ((4UL * F_CPU) + (bps / 2)) / bps;
+    if (baudreg > 65535UL)
+    {
+        return false;
+    }
+    // keep the rate that works now, in case the new one does not
+    restore_baudreg = USART0.BAUD;
+    baud_lock(baudreg);
+    return true;
+}
+
+// go back to the data rate from before baud_set()
+void baud_restore(void)
+{
+    baud_lock(restore_baudreg);
+}
+
+// a packet is starting, so stop any recheck that is still measuring
+void baud_rx_sync(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (locked)
+        {
+            TCB1.CTRLA = 0;
+            TCB1.INTCTRL = 0;
+        }
+    }
+}
+
+// count a receive error, and search again if there are too many in a row
+void baud_rx_error(void)
+{
+    bool search = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (locked && (++errcnt >= BAUD_ERR_CNT))
+        {
+            search = true;
+        }
+    }
+    if (search)
+    {
+        baud_search();
+    }
+}
+
+// valid packet, the data rate is good
+void baud_rx_good(void)
+{
+    errcnt = 0;
+}
+
+// determine if data rate is locked
+bool baud_is_locked(void)
+{
+    return locked;
+}
@@ -0,0 +1,165 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __BAUD_H__
+#define __BAUD_H__
+
+/** @addtogroup baud Autobaud
+ *
+ * @{
+ */
+
+/**
+ * Number of consecutive, consistent preamble periods needed to lock.
+ *
+ * Each period is two bit times of the 0x55 preamble, so the default of 8
+ * needs a little less than 2 preamble bytes. It should be a power of 2, and
+ * at least 4.
+ */
+#ifndef BAUD_LOCK_CNT
+#define BAUD_LOCK_CNT 8
+#endif
+
+/**
+ * Number of receive errors in a row that start a new data rate search.
+ *
+ * Framing errors and bad packet CRCs are counted, and a valid packet clears
+ * the count. If the bus is running at a rate that the node no longer
+ * decodes, this many errors make it search again instead of staying deaf
+ * while the bus is busy. Can be overridden at build time.
+ */
+#ifndef BAUD_ERR_CNT
+#define BAUD_ERR_CNT 8
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Initialize the autobaud module and start searching.
+ *
+ * @param baudreg is the USART BAUD register value to use until the first
+ *        lock, normally derived from the build time BAUDRATE
+ *
+ * Sets up the event system to route the serial pin to TCB1, which is used
+ * to measure the period of the preamble square wave. Should be called once
+ * after the USART is initialized.
+ */
+extern void baud_init(uint16_t baudreg);
+
+/**
+ * Start a new search for the serial data rate.
+ *
+ * While searching, the timer measures the bus signal and received bytes
+ * should be discarded. When a run of preamble periods is found, the USART
+ * data rate is programmed from the measurement and the module is locked. The
+ * USART keeps the previous data rate until then.
+ *
+ * This is meant to be called when the bus has been idle, such as before
+ * going to sleep, so that the controller can change the data rate between
+ * bursts of commands.
+ */
+extern void baud_search(void);
+
+/**
+ * Measure the serial data rate again, without dropping received bytes.
+ *
+ * This is like baud_search(), except that if the data rate is already
+ * locked it stays locked, and the USART keeps receiving at the current data
+ * rate while the next preamble is measured. When the measurement is done the
+ * USART is programmed from it, as for a search.
+ *
+ * This is meant to be called before going to sleep. If the controller does
+ * not change the data rate, the packet that wakes the node is received
+ * without waiting for the measurement. If it does, the bytes received at the
+ * old rate are garbage, so the packet needs enough preamble bytes for the
+ * measurement, the same as after baud_search().
+ */
+extern void baud_recheck(void);
+
+/**
+ * Set the serial data rate.
+ *
+ * @param bps is the new data rate in bits per second
+ *
+ * Programs the USART for the new data rate and stops any search that is in
+ * progress. The rate is used until the next baud_search() or baud_restore().
+ *
+ * @return true if the data rate was set, false if it is out of range for the
+ *         USART, in which case nothing is changed.
+ */
+extern bool baud_set(uint32_t bps);
+
+/**
+ * Restore the previous serial data rate.
+ *
+ * Programs the USART with the data rate that was in use before the last
+ * baud_set(), and stops any search that is in progress. That is the rate
+ * found by autobaud if there was a lock, or else the rate that was passed to
+ * baud_init(). This is used to recover when the bus does not work at a new
+ * data rate.
+ */
+extern void baud_restore(void);
+
+/**
+ * Tell the autobaud module that a packet sync byte was received.
+ *
+ * If a baud_recheck() measurement is still running, it is stopped and the
+ * current data rate is kept. The bytes after the sync byte are not preamble,
+ * and a run of them could otherwise be measured as the wrong data rate.
+ */
+extern void baud_rx_sync(void);
+
+/**
+ * Count a receive error, such as a framing error or a bad packet CRC.
+ *
+ * After \ref BAUD_ERR_CNT errors in a row, a new search is started with
+ * baud_search(). Errors are not counted while searching.
+ */
+extern void baud_rx_error(void);
+
+/**
+ * Tell the autobaud module that a valid packet was received.
+ *
+ * This clears the receive error count.
+ */
+extern void baud_rx_good(void);
+
+/**
+ * Determine if the serial data rate is locked.
+ *
+ * @return true if the data rate has been measured and the USART is
+ *         programmed, false if still searching. It is also true while a
+ *         baud_recheck() measurement is running.
+ */
+extern bool baud_is_locked(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/** @} */
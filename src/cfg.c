@@ -30,12 +30,18 @@
 #include <util/crc16.h>
 
 #include "cfg.h"
+#include "crc8.h"
 
 
 // configuration block type
 // this will change if the configuration block is updated
 #define CFG_TYPE_1 1
 #define CFG_TYPE_2 2
+#define CFG_TYPE_3 3
+
+// length of a version 2 config block. it is the same as version 3
+// without the groups field
+#define CFG_V2_LEN (sizeof(config_t) - 2)
 
 // version 1 config block
 // if needed for upgrades
@@ -73,6 +79,14 @@ config_t g_cfg_parms;
 // global to hold board type
 uint8_t g_board_type;
 
+// set when the RAM config has changes that are not stored yet
+static bool cfg_dirty = false;
+
+// copy of the config block being written to eeprom, and the next byte
+// to write. the write is finished when the index reaches the block size
+static config_t cfg_wrbuf;
+static uint8_t cfg_wridx = sizeof(config_t);
+
 // compute crc of a configuration block
 // this assumes that the length field is correct
 static uint8_t cfg_compute_crc(config_t *cfg)
@@ -81,11 +95,32 @@ static uint8_t cfg_compute_crc(config_t *cfg)
 
     for (uint8_t idx = 0; idx < cfg->len - 1; ++idx)
     {
-        crc = _crc8_ccitt_update(crc, ((uint8_t *)cfg)[idx]);
+        crc = crc8_update(crc, ((uint8_t *)cfg)[idx]);
     }
     return crc;
 }
 
+// populate the global config with default values
+static void cfg_defaults(void)
+{
+    // TODO: this can possibly be made more memory efficient, perhaps
+    // storing init values in code mem and doing a copy
+    g_cfg_parms.addr = 0;
+    g_cfg_parms.vscale = 4400;
+    g_cfg_parms.voffset = 0;
+    g_cfg_parms.tscale = 0;
+    g_cfg_parms.toffset = 0;
+    g_cfg_parms.xscale = 0;
+    g_cfg_parms.xoffset = 0;
+    g_cfg_parms.shuntmax = 4100;;
+    g_cfg_parms.shuntmin = 4000;
+    g_cfg_parms.shunttime = 300; // 5 minutes
+    g_cfg_parms.temphi = 50;
+    g_cfg_parms.templo = 40;
+    g_cfg_parms.tempadj = 0;
+    g_cfg_parms.groups = 0;
+}
+
 //////////
 //
 // See header file for public function API descriptions.
@@ -122,17 +157,17 @@ bool cfg_load(void)
     // but it adds some code  for a very limited contingency.
     // instead, save the code space and just reprogram that small number
     // of existing boards.
-    // Eventually however, if the config block is updated again, then we
-    // may need to deal with the ability to upgrade a config block
+    // a v2 block is upgraded below, because those boards are in use
 
     // read the block (whatever is there) from permanent eeprom
     eeprom_read_block(&g_cfg_parms, CFG_ADDR, sizeof(config_t));
+    cfg_dirty = false;
 
-    // compute the crc for whatever was read in (v1 or v2)
+    // compute the crc for whatever was read in (v1, v2 or v3)
     uint8_t crc = cfg_compute_crc(&g_cfg_parms);
 
-    // validate header item (only allow v2 at this time)
-    if ((g_cfg_parms.type == CFG_TYPE_2) && (g_cfg_parms.len == sizeof(config_t)))
+    // validate header item (only allow v3 at this time)
+    if ((g_cfg_parms.type == CFG_TYPE_3) && (g_cfg_parms.len == sizeof(config_t)))
     {
         if (crc == g_cfg_parms.crc)
         {
@@ -140,22 +175,21 @@ bool cfg_load(void)
         }
     }
 
+    // a v2 block has the crc where the groups field is now. keep the
+    // parameters, the node is not in any group. it is marked as changed
+    // so the v3 block is stored the next time the config is stored
+    else if ((g_cfg_parms.type == CFG_TYPE_2) && (g_cfg_parms.len == CFG_V2_LEN))
+    {
+        if (crc == ((uint8_t *)&g_cfg_parms)[CFG_V2_LEN - 1])
+        {
+            g_cfg_parms.groups = 0;
+            cfg_dirty = true;
+            return true;
+        }
+    }
+
     // getting here means a check failed, populate with defaults
-    // TODO: this can possibly be made more memory efficient, perhaps
-    // storing init values in code mem and doing a copy
-    g_cfg_parms.addr = 0;
-    g_cfg_parms.vscale = 4400;
-    g_cfg_parms.voffset = 0;
-    g_cfg_parms.tscale = 0;
-    g_cfg_parms.toffset = 0;
-    g_cfg_parms.xscale = 0;
-    g_cfg_parms.xoffset = 0;
-    g_cfg_parms.shuntmax = 4100;;
-    g_cfg_parms.shuntmin = 4000;
-    g_cfg_parms.shunttime = 300; // 5 minutes
-    g_cfg_parms.temphi = 50;
-    g_cfg_parms.templo = 40;
-    g_cfg_parms.tempadj = 0;
+    cfg_defaults();
 
     return false;
 }
@@ -165,21 +199,27 @@ bool cfg_load(void)
 // and the crc calculated before storing
 // if reset is requested, then the crc is forced to be invalid
 // which will cause defaults to be loaded
+// the block is copied and written by cfg_run(), so this does not wait
+// for the eeprom
 static void cfg_commit(bool reset)
 {
     g_cfg_parms.len = sizeof(config_t);
-    g_cfg_parms.type = CFG_TYPE_2;
+    g_cfg_parms.type = CFG_TYPE_3;
     g_cfg_parms.crc = cfg_compute_crc(&g_cfg_parms);
+    cfg_wrbuf = g_cfg_parms;
     if (reset)
     {
         // to reset the config, force crc to be invalid
-        g_cfg_parms.crc = ~g_cfg_parms.crc;
+        cfg_wrbuf.crc = ~cfg_wrbuf.crc;
     }
-    eeprom_update_block(&g_cfg_parms, CFG_ADDR, sizeof(config_t));
+    // start the write from the beginning of the block, even if a write
+    // was already in progress. bytes that are the same are not written
+    cfg_wridx = 0;
+    cfg_dirty = false;
     if (reset)
     {
-        // if reset, then reload to load defaults
-        cfg_load();
+        // if reset, then load defaults
+        cfg_defaults();
     }
 }
 
@@ -195,6 +235,30 @@ void cfg_reset(void)
     cfg_commit(true);
 }
 
+// true if there are parameter changes not stored yet
+bool cfg_is_dirty(void)
+{
+    return cfg_dirty;
+}
+
+// write the next config byte to eeprom, if the eeprom is not busy
+void cfg_run(void)
+{
+    if ((cfg_wridx < sizeof(config_t)) && eeprom_is_ready())
+    {
+        // only writes if the value is different
+        eeprom_update_byte((uint8_t *)CFG_ADDR + cfg_wridx,
+                           ((uint8_t *)&cfg_wrbuf)[cfg_wridx]);
+        ++cfg_wridx;
+    }
+}
+
+// true until the last byte is written and the eeprom is done
+bool cfg_is_active(void)
+{
+    return (cfg_wridx < sizeof(config_t)) || !eeprom_is_ready();
+}
+
 typedef struct
 {
     uint8_t index;
@@ -217,8 +281,9 @@ static const parm_entry_t parmtable[] =
     { 21, 1 },  // 11 - temphi
     { 22, 1 },  // 12 - templo
     { 23, 2 },  // 13 - tempadj
+    { 25, 2 },  // 14 - groups
 };
-#define MAX_PARMID 13
+#define MAX_PARMID 14
 
 bool cfg_set(uint8_t len, uint8_t *p_value)
 {
@@ -254,8 +319,8 @@ bool cfg_set(uint8_t len, uint8_t *p_value)
             p_cfg[idx + 1] = p_value[2];
         }
 
-        // TODO: make this configurable
-        cfg_store();    // update the persistent config store
+        // persistent config store is updated later by cfg_store()
+        cfg_dirty = true;
 
         return true;
     }
@@ -307,3 +372,113 @@ uint8_t cfg_get(uint8_t len, uint8_t *p_buf)
         return cnt + 1; // payload length (includes parm id)
     }
 }
+
+// check that a range of parameter ids is legit
+// returns the number of value bytes in the range, or 0 if not
+static uint8_t cfg_range_len(uint8_t first, uint8_t count)
+{
+    if ((first < 1) || (count == 0) || (count > MAX_PARMID)
+     || ((first + count - 1) > MAX_PARMID))
+    {
+        return 0;
+    }
+    uint8_t nbytes = 0;
+    for (uint8_t id = first; id < (first + count); ++id)
+    {
+        nbytes += parmtable[id].count;
+    }
+    return nbytes;
+}
+
+// first element of value buffer is first ID, second is the count
+// remaining bytes are the values of each parm in order
+// all entries are checked before anything is changed
+// returns true if all the parms were updated
+bool cfg_set_range(uint8_t len, uint8_t *p_value)
+{
+    uint8_t first = p_value[0];
+    uint8_t count = p_value[1];
+    uint8_t nbytes = cfg_range_len(first, count);
+
+    if ((nbytes == 0) || (nbytes != (len - 2)))
+    {
+        // bad range, or payload doesnt match expected length of the range
+        return false;
+    }
+
+    uint8_t *p_cfg = (uint8_t *)&g_cfg_parms;
+    uint8_t *p_in = &p_value[2];
+    for (uint8_t id = first; id < (first + count); ++id)
+    {
+        uint8_t idx = parmtable[id].index;
+        // cppcheck-suppress[objectIndex]
+        p_cfg[idx] = *p_in++;
+        if (parmtable[id].count == 2)
+        {
+            // cppcheck-suppress[objectIndex]
+            p_cfg[idx + 1] = *p_in++;
+        }
+    }
+
+    // persistent config store is updated later by cfg_store()
+    cfg_dirty = true;
+
+    return true;
+}
+
+// first element of passed buffer is first ID, second is the count
+// populates remaining bytes with as many parm values as fit in len
+// count is updated to the number of parms that were copied
+// returns 2 plus the number of value bytes
+// returns 0 if there is a problem
+uint8_t cfg_get_range(uint8_t len, uint8_t *p_buf)
+{
+    uint8_t first = p_buf[0];
+    uint8_t count = p_buf[1];
+
+    if (cfg_range_len(first, count) == 0)
+    {
+        return 0;
+    }
+
+    uint8_t *p_cfg = (uint8_t *)&g_cfg_parms;
+    uint8_t outlen = 2;
+    uint8_t id;
+    for (id = first; id < (first + count); ++id)
+    {
+        uint8_t cnt = parmtable[id].count;
+        if ((outlen + cnt) > len)
+        {
+            break; // no more room
+        }
+        uint8_t idx = parmtable[id].index;
+        // cppcheck-suppress[objectIndex]
+        p_buf[outlen++] = p_cfg[idx];
+        if (cnt == 2)
+        {
+            // cppcheck-suppress[objectIndex]
+            p_buf[outlen++] = p_cfg[idx + 1];
+        }
+    }
+
+    if (id == first)
+    {
+        return 0; // buffer too small for even one parm
+    }
+    p_buf[1] = id - first;
+    return outlen;
+}
+
+// crc of the parameter values between ADDR and GROUPS, in ID order
+// these are the config bytes from the first parm after ADDR up to GROUPS.
+// groups are left out, nodes in different groups can have the same setup
+uint16_t cfg_crc(void)
+{
+    uint16_t crc = 0xFFFF;
+    uint8_t *p_cfg = (uint8_t *)&g_cfg_parms;
+    for (uint8_t idx = parmtable[2].index; idx < offsetof(config_t, groups); ++idx)
+    {
+        crc = _crc_ccitt_update(crc, p_cfg[idx]);
+    }
+    return crc;
+}
@@ -34,6 +34,18 @@
 extern "C" {
 #endif
 
+/**
+ * Store changed parameters when the node goes to sleep.
+ *
+ * Parameter changes only update the RAM configuration. If this is 1, then
+ * the configuration is stored when the node goes idle, if there are changes.
+ * If 0, then the configuration is only stored by the COMMIT command. Can be
+ * overridden at build time.
+ */
+#ifndef CFG_AUTOCOMMIT
+#define CFG_AUTOCOMMIT 1
+#endif
+
 /**
  * Structure to hold the BMS Node configuration data.
  *
@@ -57,6 +69,7 @@ typedef struct __attribute__ ((__packed__))
     int8_t    temphi;   ///< temperature regulation upper limit in C
     int8_t    templo;   ///< temperature regulation lower limit in C  (should be < temphi)
     uint16_t  tempadj;  ///< TBD temperature regulation algorithm factor
+    uint16_t  groups;   ///< group membership, bit N is group address 240+N
     uint8_t   crc;      ///< (private) structure CRC for non-volatile storage
 } config_t;
 
@@ -130,6 +143,10 @@ extern bool cfg_load(void);
 
 /**
  * Stores the global configuration to persistent memory.
+ *
+ * This does not wait for the EEPROM. The configuration is copied and the
+ * bytes are written one at a time by cfg_run(). Use cfg_is_active() to find
+ * out when the write is complete.
  */
 extern void cfg_store(void);
 
@@ -138,6 +155,39 @@ extern void cfg_store(void);
  */
 extern void cfg_reset();
 
+/**
+ * Check for configuration changes that are not stored.
+ *
+ * cfg_set() and cfg_set_range() only update the global configuration in RAM.
+ * This is set by those, and cleared when the configuration is stored or
+ * loaded. It is also set when a configuration stored by older firmware is
+ * loaded, so it is stored again in the current format.
+ *
+ * @return `true` if the configuration has changes that are not in
+ * persistent memory.
+ */
+extern bool cfg_is_dirty(void);
+
+/**
+ * Run the configuration EEPROM writer.
+ *
+ * This should be called from the main loop. If a configuration store is in
+ * progress and the EEPROM is not busy, then the next byte is written. Bytes
+ * that are not changed are skipped without a write.
+ */
+extern void cfg_run(void);
+
+/**
+ * Determine if a configuration store is in progress.
+ *
+ * The node should not sleep or reset while this is true, or the stored
+ * configuration will be incomplete.
+ *
+ * @return `true` if there are bytes left to write or the EEPROM is still
+ * busy with the last one.
+ */
+extern bool cfg_is_active(void);
+
 /**
  * Set a parameter value from a payload buffer.
  *
@@ -181,6 +231,60 @@ extern bool cfg_set(uint8_t len, uint8_t *p_value);
  */
 extern uint8_t cfg_get(uint8_t len, uint8_t *p_buf);
 
+/**
+ * Set a range of parameter values from a payload buffer.
+ *
+ * @param len the payload length of p_value (includes id and count bytes)
+ * @param p_value payload buffer that holds the range and value bytes
+ *
+ * The buffer format is the same as the payload of a SETPARMS command. The
+ * first byte is the first parameter ID, the second byte is the number of
+ * parameters, and the remaining bytes are the value of each parameter in ID
+ * order, with the same encoding as cfg_set().
+ *
+ * The whole range is checked before anything is changed, so either all the
+ * parameters are updated or none are.
+ *
+ * @note the permanent configuration is not updated. The client must call
+ * cfg_store() in order to commit any changes.
+ *
+ * @return `true` if the parameters were updated, `false` if there is an
+ * error such as invalid range or wrong payload length.
+ */
+extern bool cfg_set_range(uint8_t len, uint8_t *p_value);
+
+/**
+ * Get a range of parameter values into a payload buffer.
+ *
+ * @param len the maximum length of the passed payload buffer p_buf
+ * @param p_buf a payload buffer to use for storing the parameter values
+ *
+ * The first byte of the buffer should be pre-populated with the first
+ * parameter ID, and the second byte with the number of parameters. The
+ * values are stored after these in ID order, with the same encoding as
+ * cfg_get(). If the buffer is not big enough for the whole range, then as
+ * many parameters as fit are stored, and the second byte is updated to the
+ * number of parameters that were stored.
+ *
+ * @return the number of bytes in the buffer, including the ID and count
+ * bytes. If the range is not valid, or the buffer cannot hold even one
+ * parameter, then zero (0) will be returned.
+ */
+extern uint8_t cfg_get_range(uint8_t len, uint8_t *p_buf);
+
+/**
+ * Get a CRC of the configuration parameters.
+ *
+ * The CRC covers the values of all the parameters except ADDR and GROUPS, in
+ * ID order, with the same encoding as cfg_get_range(). So nodes that have
+ * the same parameters have the same CRC, whatever their address and group
+ * membership. It is the same CRC-16 as the packet CRC-16: polynomial 0x1021
+ * in reflected form, initial value 0xFFFF and no final XOR.
+ *
+ * @return the CRC of the parameter values in the global configuration
+ */
+extern uint16_t cfg_crc(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -33,12 +33,14 @@
 
 #include "pkt.h"
 #include "cmd.h"
+#include "stats.h"
 #include "cfg.h"
 #include "adc.h"
 #include "ver.h"
 #include "tmr.h"
 #include "shunt.h"
 #include "testmode.h"
+#include "baud.h"
 
 //////////
 //
@@ -58,6 +60,40 @@ typedef union
 static uint16_t pkt_timeout;
 static bool pkt_waiting = false;
 
+// inter-character timeout, restarted when the parser byte count changes
+static uint16_t rx_timeout;
+static uint8_t rx_count;
+
+// deferred reply for a broadcast command
+// slot_cmd holds the command waiting for its reply slot, or 0 if none
+// slot_mask is the STATUS field mask for the reply
+// slot_flags are the flags for the reply, with the crc mode of the command
+static uint16_t slot_timeout;
+static uint8_t slot_cmd = 0;
+static uint8_t slot_mask;
+static uint8_t slot_flags;
+
+// flags for reply packets. this has the sequence number of the command
+// being processed, if it has one
+static uint8_t reply_flags = PKT_FLAG_REPLY;
+
+// sequence flags and command of the last command that was answered with a
+// single reply. seq_last is 0 if there is no such command
+static uint8_t seq_last = 0;
+static uint8_t seq_cmd;
+
+// chained scan state
+// scan_last is the highest address that has already had its turn
+static uint16_t scan_timeout;
+static bool scan_armed = false;
+static uint8_t scan_last;
+static uint8_t scan_ms;
+static uint8_t scan_flags;
+
+// new data rate waiting to be confirmed by a valid packet
+static uint16_t baud_timeout;
+static bool baud_pending = false;
+
 // implement command acknowledgement
 // (for commands that just need generic acknowledgement)
 static bool cmd_ack(packet_t *pkt)
@@ -66,7 +102,7 @@ static bool cmd_ack(packet_t *pkt)
     // normally these will always be the same
     // but if ID is changed to 0 due to factory reset, then this
     // reply will still look okay to controller
-    return pkt_send(PKT_FLAG_REPLY, pkt->addr, pkt->cmd, NULL, 0);
+    return pkt_send(reply_flags, pkt->addr, pkt->cmd, NULL, 0);
 }
 
 // implement DFU command
@@ -82,6 +118,11 @@ static bool cmd_dfu(void)
     // But for the '1614 it has a software reset command bit so it is much
     // easier to force a reset, and the hardware will all get reset back to
     // defaults.
+    // finish any config write first so it is not cut off by the reset
+    while (cfg_is_active())
+    {
+        cfg_run();
+    }
     ccp_write_io((void *)&(RSTCTRL.SWRR), 1);
 
     return false;
@@ -90,7 +131,11 @@ static bool cmd_dfu(void)
 // implement UID command
 static bool cmd_uid(void)
 {
-    uint8_t pld[8];
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
     u32buf_t uid;
     uid.u32 = cfg_uid();
     pld[0] = uid.u8[0];
@@ -101,7 +146,7 @@ static bool cmd_uid(void)
     pld[5] = g_version[0];
     pld[6] = g_version[1];
     pld[7] = g_version[2];
-    return pkt_send(PKT_FLAG_REPLY, NODEID, CMD_UID, pld, 8);
+    return pkt_send(reply_flags, NODEID, CMD_UID, pld, 8);
 }
 
 // implement ADDR command
@@ -114,7 +159,8 @@ static bool cmd_addr(packet_t *pkt)
     pktuid.u8[2] = pkt->payload[2];
     pktuid.u8[3] = pkt->payload[3];
     // compare UID in packet to our UID
-    if (uid == pktuid.u32)
+    // a group address cannot be used for a node
+    if ((uid == pktuid.u32) && !PKT_ADDR_IS_GROUP(pkt->addr))
     {
         // if the same, then update our address and store it
         // fake a SETPARM payload for ADDR parm
@@ -123,16 +169,16 @@ static bool cmd_addr(packet_t *pkt)
         setparm[1] = pkt->addr;
         cfg_set(2, setparm); // update the global config
         cfg_store(); // commit the change TODO: still needed?
-        return pkt_send(PKT_FLAG_REPLY, NODEID, CMD_ADDR, pkt->payload, 4);
+        return pkt_send(reply_flags, NODEID, CMD_ADDR, pkt->payload, 4);
     }
     // only send reply if the UID matches
     return false;
 }
 
-// implement STATUS command
-static bool cmd_status(void)
+// build STATUS reply payload
+// returns the payload length
+static uint8_t cmd_status_build(uint8_t *pld)
 {
-    uint8_t pld[10];
     uint16_t mvolts = adc_get_cellmv();
     pld[0] = mvolts;
     pld[1] = mvolts >> 8;
@@ -147,13 +193,151 @@ static bool cmd_status(void)
     tempC = adc_get_tempC(ADC_CH_MCU_TEMP);
     pld[8] = tempC;
     pld[9] = tempC >> 8;
-    return pkt_send(PKT_FLAG_REPLY, NODEID, CMD_STATUS, pld, sizeof(pld));
+    return 10;
 }
 
-// implement ADCRAW command
-static bool cmd_adcraw(void)
+// size of each STATUS field, in STATUS payload order
+static const uint8_t status_fields[] = { 2, 2, 1, 1, 2, 2 };
+
+// implement STATUS command
+// mask selects the fields for the reply, 0 means all fields
+static bool cmd_status(uint8_t mask)
+{
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    uint8_t len;
+    mask &= STATUS_ALL;
+    if ((mask == 0) || (mask == STATUS_ALL))
+    {
+        len = cmd_status_build(pld);
+    }
+    else
+    {
+        // build all the fields, then copy out only the selected ones
+        uint8_t full[10];
+        cmd_status_build(full);
+        uint8_t idx = 0;
+        len = 0;
+        for (uint8_t fld = 0; fld < sizeof(status_fields); ++fld)
+        {
+            if (mask & (1U << fld))
+            {
+                pld[len++] = full[idx];
+                if (status_fields[fld] == 2)
+                {
+                    pld[len++] = full[idx + 1];
+                }
+            }
+            idx += status_fields[fld];
+        }
+    }
+    return pkt_send(reply_flags, NODEID, CMD_STATUS, pld, len);
+}
+
+// last STATUS values reported by STATUSD, and replies until the next full
+static uint8_t statusd_last[10];
+static uint8_t statusd_left = 0;
+
+// implement STATUSD command
+// reply has a map of changed fields, then the change for each field.
+// a 16-bit field is sent as an 8-bit signed delta if it fits, or
+// else an escape followed by the full value. 8-bit fields are sent
+// as the value. a full frame is the map with the full bit, and the
+// same payload as STATUS
+static bool cmd_statusd(packet_t *pkt)
+{
+    uint8_t cur[10];
+    uint8_t delta[16];
+    uint8_t len = 1;
+    uint8_t map = 0;
+
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    cmd_status_build(cur);
+
+    // build the delta frame
+    uint8_t idx = 0;
+    for (uint8_t fld = 0; fld < sizeof(status_fields); ++fld)
+    {
+        if (status_fields[fld] == 1)
+        {
+            if (cur[idx] != statusd_last[idx])
+            {
+                map |= 1U << fld;
+                delta[len++] = cur[idx];
+            }
+        }
+        else
+        {
+            uint16_t val = cur[idx] | (cur[idx + 1] << 8);
+            uint16_t last = statusd_last[idx] | (statusd_last[idx + 1] << 8);
+            int16_t diff = (int16_t)(val - last);
+            if (diff != 0)
+            {
+                map |= 1U << fld;
+                if ((diff >= -127) && (diff <= 127))
+                {
+                    delta[len++] = (uint8_t)diff;
+                }
+                else
+                {
+                    // escape, full value follows
+                    delta[len++] = STATUSD_ESCAPE;
+                    delta[len++] = cur[idx];
+                    delta[len++] = cur[idx + 1];
+                }
+            }
+        }
+        idx += status_fields[fld];
+    }
+
+    // send a full frame if it is time to resync, if the controller asks
+    // for it, or if the delta frame is not shorter
+    bool full = (statusd_left == 0) || ((pkt->len > 0) && pkt->payload[0])
+             || (len >= (1 + sizeof(cur)));
+    if (full)
+    {
+        pld[0] = STATUSD_FULL | STATUS_ALL;
+        for (uint8_t i = 0; i < sizeof(cur); ++i)
+        {
+            pld[i + 1] = cur[i];
+        }
+        len = 1 + sizeof(cur);
+    }
+    else
+    {
+        delta[0] = map;
+        for (uint8_t i = 0; i < len; ++i)
+        {
+            pld[i] = delta[i];
+        }
+    }
+
+    // the values are only the controller's if the reply was sent
+    if (!pkt_send(reply_flags, NODEID, CMD_STATUSD, pld, len))
+    {
+        return false;
+    }
+
+    // every changed field was sent, so the controller has these values
+    statusd_left = full ? STATUSD_FULL_INTERVAL : (statusd_left - 1);
+    for (uint8_t i = 0; i < sizeof(cur); ++i)
+    {
+        statusd_last[i] = cur[i];
+    }
+    return true;
+}
+
+// build ADCRAW reply payload
+// returns the payload length
+static uint8_t cmd_adcraw_build(uint8_t *pld)
 {
-    uint8_t pld[8];
     uint16_t *p_results = adc_get_raw();
     pld[0] = p_results[0];
     pld[1] = p_results[0] >> 8;
@@ -163,38 +347,290 @@ static bool cmd_adcraw(void)
     pld[5] = p_results[2] >> 8;
     pld[6] = p_results[3];
     pld[7] = p_results[3] >> 8;
-    return pkt_send(PKT_FLAG_REPLY, NODEID, CMD_ADCRAW, pld, sizeof(pld));
+    return 8;
+}
+
+// implement ADCRAW command
+static bool cmd_adcraw(void)
+{
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    uint8_t len = cmd_adcraw_build(pld);
+    return pkt_send(reply_flags, NODEID, CMD_ADCRAW, pld, len);
 }
 
 // implement SETPARM command
 // this does not validate parameters
 static bool cmd_setparm(packet_t *pkt)
 {
-    uint8_t pld[1];
     // pass the payload onto cfg_set
     // cfg_set does a minimal validation
     // TODO test for error return and do *something* if there is an error
     cfg_set(pkt->len, pkt->payload);
+    // parameter is set even if there is no room to send the reply
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
     pld[0] = pkt->payload[0]; // get the parm ID for the reply
-    return pkt_send(PKT_FLAG_REPLY, NODEID, CMD_SETPARM, pld, 1);
+    return pkt_send(reply_flags, NODEID, CMD_SETPARM, pld, 1);
 }
 
-// implement GETPARM command
-static bool cmd_getparm(packet_t *pkt)
+// build GETPARM reply payload for parameter `parm`
+// `max` is the room in the payload buffer
+// returns the payload length
+static uint8_t cmd_getparm_build(uint8_t parm, uint8_t *pld, uint8_t max)
 {
-    // max possible payload
-    uint8_t pld[12];
-    pld[0] = pkt->payload[0]; // copy out the requested parameter id
+    pld[0] = parm; // copy out the requested parameter id
 
     // get the parameter value into a payload buffer
     // returns 0 if there is a problem
-    uint8_t len = cfg_get(sizeof(pld), pld);
+    uint8_t len = cfg_get(max, pld);
 
     // if 0 was returned due to parameter error, then re-set len to 1
     // and the reply packet will have just the parameter and no value
     // this will signal an error occurred
-    len = (len == 0) ? 1 : len;
-    return pkt_send(PKT_FLAG_REPLY, NODEID, CMD_GETPARM, pld, len);
+    return (len == 0) ? 1 : len;
+}
+
+// implement GETPARM command
+static bool cmd_getparm(packet_t *pkt)
+{
+    // build reply in place, max possible payload
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    uint8_t len = cmd_getparm_build(pkt->payload[0], pld, PKT_PAYLOAD_LEN);
+    return pkt_send(reply_flags, NODEID, CMD_GETPARM, pld, len);
+}
+
+// implement BATCH command
+// the payload is a list of sub-commands. GETPARM is followed by the
+// parameter id. the reply is a record for each sub-command, which is the
+// sub-command, the length, and the same payload as the single command reply.
+// records are packed into as few reply packets as possible, and a record is
+// never split between packets. an unknown sub-command gets a record with
+// length 0, and ends the batch.
+static bool cmd_batch(packet_t *pkt)
+{
+    uint8_t rec[PKT_PAYLOAD_LEN];
+    uint8_t *pld = NULL;
+    uint8_t len = 0;
+    uint8_t idx = 0;
+    bool sent = false;
+
+    do
+    {
+        uint8_t reclen = 0;
+        if (idx < pkt->len)
+        {
+            uint8_t sub = pkt->payload[idx++];
+            switch (sub)
+            {
+                case CMD_STATUS:
+                    reclen = cmd_status_build(&rec[2]);
+                    break;
+
+                case CMD_ADCRAW:
+                    reclen = cmd_adcraw_build(&rec[2]);
+                    break;
+
+                case CMD_GETPARM:
+                    if (idx < pkt->len)
+                    {
+                        reclen = cmd_getparm_build(pkt->payload[idx++],
+                                                   &rec[2], sizeof(rec) - 2);
+                        break;
+                    }
+                    // missing parameter id is an error
+                    // fall through
+
+                default:
+                    idx = pkt->len; // unknown, stop here
+                    break;
+            }
+            rec[0] = sub;
+            rec[1] = reclen;
+            reclen += 2;
+        }
+
+        // send the reply packet so far if this record does not fit
+        if (pld && ((len + reclen) > PKT_PAYLOAD_LEN))
+        {
+            sent |= pkt_send(reply_flags, NODEID, CMD_BATCH, pld, len);
+            pld = NULL;
+        }
+        // start a new reply packet
+        if (pld == NULL)
+        {
+            pld = pkt_tx_buf();
+            if (pld == NULL)
+            {
+                return sent; // TX queue is full, no more replies
+            }
+            len = 0;
+        }
+        // add the record to the reply
+        for (uint8_t i = 0; i < reclen; ++i)
+        {
+            pld[len++] = rec[i];
+        }
+    } while (idx < pkt->len);
+
+    sent |= pkt_send(reply_flags, NODEID, CMD_BATCH, pld, len);
+    return sent;
+}
+
+// implement GETPARMS command
+// reads a range of parameters. if the values do not all fit in one reply
+// then the range is split over more than one reply packet
+static bool cmd_getparms(packet_t *pkt)
+{
+    uint8_t first = pkt->payload[0];
+    uint8_t count = (pkt->len < 2) ? 0 : pkt->payload[1];
+    bool sent = false;
+
+    do
+    {
+        uint8_t *pld = pkt_tx_buf();
+        if (pld == NULL)
+        {
+            return sent; // TX queue is full, no more replies
+        }
+        pld[0] = first;
+        pld[1] = count;
+        uint8_t len = cfg_get_range(PKT_PAYLOAD_LEN, pld);
+        if (len == 0)
+        {
+            // bad range, reply with just the first parameter id
+            len = 1;
+            count = 0;
+        }
+        else
+        {
+            // pld[1] has the number of parameters in this reply
+            first += pld[1];
+            count -= pld[1];
+        }
+        sent |= pkt_send(reply_flags, NODEID, CMD_GETPARMS, pld, len);
+    } while (count);
+
+    return sent;
+}
+
+// implement SETPARMS command
+static bool cmd_setparms(packet_t *pkt)
+{
+    // all or none of the range is applied
+    bool ok = cfg_set_range(pkt->len, pkt->payload);
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    pld[0] = pkt->payload[0];
+    pld[1] = pkt->payload[1];
+    pld[2] = ok ? 0 : 1;
+    return pkt_send(reply_flags, NODEID, CMD_SETPARMS, pld, 3);
+}
+
+// implement MTU command
+// reply with the max payload length and the packet queue depths, so the
+// controller can size bulk transfers
+static bool cmd_mtu(void)
+{
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    pld[0] = PKT_PAYLOAD_LEN;
+    pld[1] = PKT_RX_POOL_DEPTH;
+    pld[2] = PKT_TX_QUEUE_DEPTH;
+    return pkt_send(reply_flags, NODEID, CMD_MTU, pld, 3);
+}
+
+// saturate a statistics counter to 8 bits for the GETSTATS reply
+static uint8_t cmd_stat8(enum stats_id id)
+{
+    uint16_t val = stats_get(id);
+    return (val > 255) ? 255 : val;
+}
+
+// implement GETSTATS command
+// packet counts are 16 bits, error counts are 8 bits (saturated)
+// if the first payload byte is non-zero, the counters are cleared after
+// they are read
+static bool cmd_getstats(packet_t *pkt)
+{
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    uint16_t cnt = stats_get(STATS_RX_PKT);
+    pld[0] = cnt;
+    pld[1] = cnt >> 8;
+    cnt = stats_get(STATS_TX_PKT);
+    pld[2] = cnt;
+    pld[3] = cnt >> 8;
+    pld[4] = cmd_stat8(STATS_CRC_ERR);
+    pld[5] = cmd_stat8(STATS_LEN_ERR);
+    pld[6] = cmd_stat8(STATS_NOBUF);
+    pld[7] = cmd_stat8(STATS_FRAME_ERR);
+    pld[8] = cmd_stat8(STATS_OVERRUN);
+    pld[9] = cmd_stat8(STATS_RX_OVERFLOW);
+    pld[10] = cmd_stat8(STATS_PKT_TIMEOUT);
+    // status flags, with the TX queue high-water mark in the upper bits
+    uint8_t hwm = pkt_tx_hwm();
+    pld[11] = ((hwm > 15) ? 0xF0 : (hwm << 4)) | (cfg_is_dirty() ? 1 : 0);
+    if ((pkt->len > 0) && (pkt->payload[0] != 0))
+    {
+        stats_clear();
+    }
+    return pkt_send(reply_flags, NODEID, CMD_GETSTATS, pld, 12);
+}
+
+// implement COMMIT command
+// stores the config if there are parameter changes
+static bool cmd_commit(void)
+{
+    uint8_t stored = 0;
+    if (cfg_is_dirty())
+    {
+        cfg_store();
+        stored = 1;
+    }
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    pld[0] = stored;
+    return pkt_send(reply_flags, NODEID, CMD_COMMIT, pld, 1);
+}
+
+// implement CFGCRC command
+// the controller compares the crc to check that a parameter push reached
+// every node
+static bool cmd_cfgcrc(void)
+{
+    uint8_t *pld = pkt_tx_buf();
+    if (pld == NULL)
+    {
+        return false; // TX queue is full, no reply
+    }
+    uint16_t crc = cfg_crc();
+    pld[0] = crc;
+    pld[1] = crc >> 8;
+    pld[2] = cfg_is_dirty();
+    return pkt_send(reply_flags, NODEID, CMD_CFGCRC, pld, 3);
 }
 
 // implement TESTMODE command
@@ -230,6 +666,261 @@ static bool cmd_testmode(packet_t *pkt)
     return cmd_ack(pkt);
 }
 
+// start the time slot for a reply to broadcast or group command `cmd`
+// node address 1 uses the first slot, which starts right away
+static void cmd_slot_start(uint8_t cmd, uint8_t width)
+{
+    uint16_t delay = (uint16_t)(NODEID - 1) * width;
+
+    // the timer cannot handle more than 32767 ms. if the slot is that far
+    // away then the controller asked for an impossible slot width, so
+    // dont reply at all
+    if (delay < 32768U)
+    {
+        slot_timeout = tmr_set(delay);
+        slot_cmd = cmd;
+    }
+}
+
+// schedule a reply to a broadcast command in this node's time slot
+// slot width can be passed as first payload byte, otherwise use default
+// STATUS field mask can be passed as second payload byte, it is not used
+// for other commands
+// returns false because the packet is not used after this
+static bool cmd_slot_schedule(packet_t *pkt)
+{
+    cmd_slot_start(pkt->cmd, pkt->len ? pkt->payload[0] : CMD_SLOT_MS);
+    slot_mask = (pkt->len > 1) ? pkt->payload[1] : STATUS_ALL;
+    slot_flags = PKT_FLAG_REPLY | (pkt->flags & PKT_FLAG_CRC16);
+    return false;
+}
+
+// true if this node is a member of group address `addr`
+static bool cmd_in_group(uint8_t addr)
+{
+    return PKT_ADDR_IS_GROUP(addr)
+        && (g_cfg_parms.groups & (1U << (addr - PKT_ADDR_GROUP)));
+}
+
+// run a command sent to a group, or to all nodes
+// there is no reply, unless the command has a sequence number. then an
+// empty ack is sent in this node's time slot, so the controller can tell
+// which nodes have it
+// returns true for the shunt commands, so the main loop can act on them
+static bool cmd_group(packet_t *pkt)
+{
+    bool ret = false;
+    switch (pkt->cmd)
+    {
+        case CMD_SHUNTON:
+        case CMD_SHUNTOFF:
+            ret = true;
+            break;
+
+        // every node would get the same address, so ADDR is not
+        // allowed (1 is the address parameter ID)
+        case CMD_SETPARM:
+            if ((pkt->payload[0] == 1) || !cfg_set(pkt->len, pkt->payload))
+            {
+                return false; // not set, so no ack
+            }
+            break;
+
+        case CMD_COMMIT:
+            if (cfg_is_dirty())
+            {
+                cfg_store();
+            }
+            break;
+
+        default:
+            return false;
+    }
+
+    if (pkt->flags & PKT_FLAG_SEQ)
+    {
+        slot_flags = PKT_FLAG_REPLY
+                   | (pkt->flags & (PKT_FLAG_SEQ | PKT_SEQ_MASK | PKT_FLAG_CRC16));
+        cmd_slot_start(pkt->cmd, CMD_SLOT_MS);
+    }
+    return ret;
+}
+
+// send any slotted reply whose time slot has arrived
+// the reply uses the flags of the command that scheduled it
+static void cmd_slot_run(void)
+{
+    if (slot_cmd && tmr_expired(slot_timeout))
+    {
+        reply_flags = slot_flags;
+        switch (slot_cmd)
+        {
+            case CMD_STATUS:
+                cmd_status(slot_mask);
+                break;
+
+            case CMD_CFGCRC:
+                cmd_cfgcrc();
+                break;
+
+            // ack for a group command. it has a sequence number so it
+            // replaces the cached reply, and a retry of the last unicast
+            // command must run it again
+            default:
+                pkt_send(reply_flags, NODEID, slot_cmd, NULL, 0);
+                seq_last = 0;
+                break;
+        }
+        reply_flags = PKT_FLAG_REPLY;
+        slot_cmd = 0;
+    }
+}
+
+// (re)start the scan timeout for our turn
+// we wait one timeout for each address between the last node heard and us
+// so that each missing node only costs one timeout
+static void cmd_scan_wait(void)
+{
+    uint16_t wait = (uint16_t)(NODEID - scan_last - 1) * scan_ms;
+    scan_timeout = tmr_set((wait < 32768U) ? wait : 32767U);
+}
+
+// start a chained scan
+// first payload byte is the first address of the scan (default 1)
+// second payload byte is the per-address timeout (default CMD_SCAN_MS)
+// returns false because the packet is not used after this
+static bool cmd_scan_start(packet_t *pkt)
+{
+    uint8_t first = (pkt->len > 0) ? pkt->payload[0] : 1;
+    scan_ms = (pkt->len > 1) ? pkt->payload[1] : CMD_SCAN_MS;
+    scan_flags = PKT_FLAG_REPLY | (pkt->flags & PKT_FLAG_CRC16);
+
+    // nodes below the start of the scan do not take part
+    // (first cannot be 0 since NODEID is not 0 here)
+    scan_armed = (first != 0) && (NODEID >= first);
+    if (scan_armed)
+    {
+        // pretend the node before the first one already had its turn
+        scan_last = first - 1;
+        cmd_scan_wait();
+    }
+    return false;
+}
+
+// a reply packet from another node was received
+// if a scan is running and this is a STATUS reply from a node between
+// the last one heard and us, then it is our predecessor taking its turn
+static void cmd_scan_heard(packet_t *pkt)
+{
+    if (scan_armed && (pkt->cmd == CMD_STATUS)
+     && (pkt->addr > scan_last) && (pkt->addr < NODEID))
+    {
+        scan_last = pkt->addr;
+        cmd_scan_wait();
+    }
+}
+
+// send our scan reply when it is our turn
+// it is our turn as soon as the node right before us has replied, or if
+// the timeout expires with no bus activity (the nodes before us are missing)
+static void cmd_scan_run(void)
+{
+    if (scan_armed)
+    {
+        if (scan_last == (uint8_t)(NODEID - 1))
+        {
+            // predecessor already replied, go now
+        }
+        else if (pkt_is_active())
+        {
+            // some node is replying right now so restart the wait
+            // from when it finishes
+            cmd_scan_wait();
+            return;
+        }
+        else if (!tmr_expired(scan_timeout))
+        {
+            return;
+        }
+        // reply uses the crc of the SCAN command
+        reply_flags = scan_flags;
+        cmd_status(STATUS_ALL);
+        reply_flags = PKT_FLAG_REPLY;
+        scan_armed = false;
+    }
+}
+
+// command processor has a deferred reply waiting
+// change the bus data rate
+// payload is the new data rate in bps, 32-bit little-endian
+// the new rate is used until a valid packet is received, or else
+// there is a timeout and it goes back to the rate it had before
+// there is no reply
+static bool cmd_setbaud(packet_t *pkt)
+{
+    if (pkt->len == 4)
+    {
+        u32buf_t bps;
+        bps.u8[0] = pkt->payload[0];
+        bps.u8[1] = pkt->payload[1];
+        bps.u8[2] = pkt->payload[2];
+        bps.u8[3] = pkt->payload[3];
+        if (baud_set(bps.u32))
+        {
+            baud_timeout = tmr_set(CMD_SETBAUD_MS);
+            baud_pending = true;
+        }
+    }
+    return false;
+}
+
+// fall back to the previous data rate if a new rate was not confirmed
+static void cmd_baud_run(void)
+{
+    if (baud_pending && tmr_expired(baud_timeout))
+    {
+        baud_restore();
+        baud_pending = false;
+    }
+}
+
+// decide from the header if a packet is wanted
+// this must match the packets that cmd_process() uses
+bool cmd_accept(uint8_t flags, uint8_t addr, uint8_t cmd)
+{
+    // any valid packet confirms a new data rate
+    if (baud_pending)
+    {
+        return true;
+    }
+    // replies from other nodes are only needed during a scan
+    if (flags & PKT_FLAG_REPLY)
+    {
+        return scan_armed && (cmd == CMD_STATUS);
+    }
+    // processed for any node
+    if ((addr == PKT_ADDR_BROADCAST) || (cmd == CMD_ADDR) || (cmd == CMD_DFU))
+    {
+        return true;
+    }
+    // group commands, if this node is in the group
+    if (cmd_in_group(addr))
+    {
+        return true;
+    }
+    // without a nodeid, only UID to address 0 is used
+    if (NODEID == 0)
+    {
+        return (addr == 0) && (cmd == CMD_UID);
+    }
+    return addr == NODEID;
+}
+
+bool cmd_is_active(void)
+{
+    return (slot_cmd != 0) || scan_armed || baud_pending;
+}
+
 // run command processor
 packet_t *cmd_process(void)
 {
@@ -243,20 +934,34 @@ packet_t *cmd_process(void)
         // we got a packet, so clear the waiting flag
         pkt_waiting = false;
 
+        // a valid packet also confirms any new data rate
+        baud_pending = false;
+
         // save indicator of any DFU command, for any node
         // this is used by app main loop
         // if command is DFU to any node, we want to return command to
         // caller. Main loop runs special state if command was DFU
-        if (pkt->cmd == CMD_DFU)
+        if ((pkt->cmd == CMD_DFU) && !(pkt->flags & PKT_FLAG_REPLY))
         {
             ret = true;
         }
 
+        // reply packets from other nodes are never commands, but they
+        // are needed to know when it is our turn in a chained scan
+        if (pkt->flags & PKT_FLAG_REPLY)
+        {
+            cmd_scan_heard(pkt);
+        }
         // process ADDR command for any address
-        if (pkt->cmd == CMD_ADDR)
+        else if (pkt->cmd == CMD_ADDR)
         {
             ret = cmd_addr(pkt);
         }
+        // data rate change applies to all nodes, even without nodeid
+        else if ((pkt->cmd == CMD_SETBAUD) && (pkt->addr == PKT_ADDR_BROADCAST))
+        {
+            ret = cmd_setbaud(pkt);
+        }
         // special handling if our nodeid is not set
         else if (NODEID == 0)
         {
@@ -267,9 +972,67 @@ packet_t *cmd_process(void)
                 ret = cmd_uid();
             }
         }
+        // broadcast commands are for all nodes that have a nodeid
+        else if (pkt->addr == PKT_ADDR_BROADCAST)
+        {
+            switch (pkt->cmd)
+            {
+                // each node replies in its own time slot
+                case CMD_STATUS:
+                case CMD_CFGCRC:
+                    ret = cmd_slot_schedule(pkt);
+                    break;
+
+                // each node replies when its predecessor is done
+                case CMD_SCAN:
+                    ret = cmd_scan_start(pkt);
+                    break;
+
+                // pack-wide balancing and config push
+                case CMD_SHUNTON:
+                case CMD_SHUNTOFF:
+                case CMD_SETPARM:
+                case CMD_COMMIT:
+                    ret = cmd_group(pkt);
+                    break;
+
+                // other commands are ignored, but ret is left alone so
+                // that DFU still gets to the main loop
+                default:
+                    break;
+            }
+        }
+        // commands for a group that this node is in
+        // (ret is only set for a shunt command, so that DFU is kept)
+        else if (cmd_in_group(pkt->addr))
+        {
+            if (cmd_group(pkt))
+            {
+                ret = true;
+            }
+        }
+        // a retry of the last sequenced command gets the same reply again,
+        // without running the command again. if the reply cannot be sent
+        // again, then the command is run below like a new one
+        else if ((pkt->addr == NODEID) && seq_last
+              && (pkt->flags & (PKT_FLAG_SEQ | PKT_SEQ_MASK)) == seq_last
+              && (pkt->cmd == seq_cmd) && pkt_resend())
+        {
+            // reply is queued from the cache
+        }
         // we have a nodeid so process normally
         else if (pkt->addr == NODEID)
         {
+            uint8_t seq = 0;
+            if (pkt->flags & PKT_FLAG_SEQ)
+            {
+                seq = pkt->flags & (PKT_FLAG_SEQ | PKT_SEQ_MASK);
+            }
+            // reply uses the same crc as the command, and has a stamp
+            // trailer if the command asked for one
+            reply_flags = PKT_FLAG_REPLY | seq
+                        | (pkt->flags & (PKT_FLAG_CRC16 | PKT_FLAG_STAMP));
+
             switch (pkt->cmd)
             {
                 case CMD_PING:
@@ -291,7 +1054,7 @@ packet_t *cmd_process(void)
                     break;
 
                 case CMD_STATUS:
-                    ret = cmd_status();
+                    ret = cmd_status(pkt->len ? pkt->payload[0] : STATUS_ALL);
                     break;
 
                 // we could have a single shunt command with a parameter,
@@ -321,10 +1084,57 @@ packet_t *cmd_process(void)
                     ret = cmd_ack(pkt);
                     break;
 
+                case CMD_MTU:
+                    ret = cmd_mtu();
+                    break;
+
+                case CMD_GETSTATS:
+                    ret = cmd_getstats(pkt);
+                    break;
+
+                case CMD_BATCH:
+                    ret = cmd_batch(pkt);
+                    break;
+
+                case CMD_GETPARMS:
+                    ret = cmd_getparms(pkt);
+                    break;
+
+                case CMD_SETPARMS:
+                    ret = cmd_setparms(pkt);
+                    break;
+
+                case CMD_COMMIT:
+                    ret = cmd_commit();
+                    break;
+
+                case CMD_STATUSD:
+                    ret = cmd_statusd(pkt);
+                    break;
+
+                case CMD_CFGCRC:
+                    ret = cmd_cfgcrc();
+                    break;
+
                 default:
                     ret = false;
                     break;
             }
+
+            // the reply cache only holds one packet, so only remember
+            // commands that have a single reply. the handlers return true
+            // only if the reply was queued, so if ret is false then this
+            // command has no reply in the cache, and a retry must not get
+            // the cached reply of an earlier command
+            if (!ret || (pkt->cmd == CMD_BATCH) || (pkt->cmd == CMD_GETPARMS))
+            {
+                seq = 0;
+            }
+#if PKT_REPLY_CACHE
+            seq_last = seq;
+            seq_cmd = pkt->cmd;
+#endif
+            reply_flags = PKT_FLAG_REPLY;
         }
 
         // if ret is true, it means packet should be returned to caller
@@ -345,6 +1155,26 @@ packet_t *cmd_process(void)
 
     // getting here means no valid packet is available
 
+    // if the line goes idle in the middle of a packet, abandon it right
+    // away instead of waiting for more preamble or the packet timeout
+    uint8_t count = pkt_rx_count();
+    if (count != rx_count)
+    {
+        rx_count = count;
+        rx_timeout = tmr_set(PKT_IDLE_MS);
+    }
+    else if (tmr_expired(rx_timeout) && pkt_rx_abort())
+    {
+        stats_inc(STATS_PKT_TIMEOUT);
+    }
+
+    // check for a slotted or chained reply that is ready to go
+    cmd_slot_run();
+    cmd_scan_run();
+
+    // check if new data rate was not confirmed
+    cmd_baud_run();
+
     // check if we are waiting on the packet to complete
     if (pkt_waiting)
     {
@@ -353,6 +1183,7 @@ packet_t *cmd_process(void)
         {
             // something must have gone wrong
             // reset the packet processor
+            stats_inc(STATS_PKT_TIMEOUT);
             pkt_reset();
             pkt_waiting = false;
         }
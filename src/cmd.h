@@ -74,6 +74,15 @@
  */
 #define CMD_STATUS 6
 
+// STATUS field mask bits, also used as the STATUSD field map
+#define STATUS_MV 0x01      //< cell voltage
+#define STATUS_TBOARD 0x02  //< board temperature
+#define STATUS_SHUNT 0x04   //< shunt status
+#define STATUS_PWM 0x08     //< shunt PWM
+#define STATUS_TEXT 0x10    //< external temperature
+#define STATUS_TMCU 0x20    //< internal (MCU) temperature
+#define STATUS_ALL 0x3F     //< all fields
+
 /**
  * SHUNTON command code
  *
@@ -116,6 +125,131 @@
  */
 #define CMD_FACTORY 12
 
+/**
+ * SCAN command code
+ *
+ * Broadcast chained pack scan. Each node sends a STATUS reply as soon as it
+ * hears the STATUS reply from the node before it.
+ */
+#define CMD_SCAN 13
+
+/**
+ * SETBAUD command code
+ *
+ * Broadcast change of the bus data rate, with fallback to the default data
+ * rate if the new rate does not work.
+ */
+#define CMD_SETBAUD 14
+
+/**
+ * MTU command code
+ *
+ * Report the largest payload the node accepts, and its packet buffering.
+ */
+#define CMD_MTU 15
+
+/**
+ * GETSTATS command code
+ *
+ * Read, and optionally clear, the bus and protocol error statistics.
+ */
+#define CMD_GETSTATS 16
+
+/**
+ * BATCH command code
+ *
+ * Run several read commands (STATUS, ADCRAW, GETPARM) from one packet, and
+ * pack the results into as few reply packets as possible.
+ */
+#define CMD_BATCH 17
+
+/**
+ * GETPARMS command code
+ *
+ * Read a range of configuration parameters.
+ */
+#define CMD_GETPARMS 18
+
+/**
+ * SETPARMS command code
+ *
+ * Write a range of configuration parameters.
+ */
+#define CMD_SETPARMS 19
+
+/**
+ * COMMIT command code
+ *
+ * Store changed configuration parameters to EEPROM.
+ */
+#define CMD_COMMIT 20
+
+/**
+ * STATUSD command code
+ *
+ * Same as STATUS but only the changes since the last STATUSD are sent.
+ */
+#define CMD_STATUSD 21
+
+/**
+ * CFGCRC command code
+ *
+ * Read a CRC of the configuration parameters.
+ */
+#define CMD_CFGCRC 22
+
+/**
+ * STATUSD reply map bit for a full frame.
+ */
+#define STATUSD_FULL 0x80
+
+
+/**
+ * STATUSD delta value meaning that the full 16-bit value follows.
+ */
+#define STATUSD_ESCAPE 0x80
+
+/**
+ * Number of STATUSD delta replies between full frames. Can be overridden
+ * at build time.
+ */
+#ifndef STATUSD_FULL_INTERVAL
+#define STATUSD_FULL_INTERVAL 16
+#endif
+
+/**
+ * Default reply slot width for broadcast commands, in milliseconds.
+ *
+ * When a broadcast command requires a reply, each node replies in its own
+ * time slot, computed from the node address. This is the slot width that is
+ * used if the command does not specify one. It should be long enough to hold
+ * a complete STATUS reply at the bus data rate.
+ */
+#ifndef CMD_SLOT_MS
+#define CMD_SLOT_MS 25
+#endif
+
+/**
+ * Default per-address timeout for a chained scan, in milliseconds.
+ *
+ * During a SCAN, if the predecessor node does not start to reply within this
+ * time then it is assumed to be missing and the next node takes its turn.
+ * It must be longer than the preamble time plus the reply turnaround time.
+ */
+#ifndef CMD_SCAN_MS
+#define CMD_SCAN_MS 10
+#endif
+
+/**
+ * Timeout to confirm a new data rate after SETBAUD, in milliseconds.
+ *
+ * After a SETBAUD command, if no valid packet is received at the new data
+ * rate within this time then the node goes back to the default data rate.
+ */
+#ifndef CMD_SETBAUD_MS
+#define CMD_SETBAUD_MS 2000
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -133,6 +267,41 @@ extern "C" {
  */
 extern packet_t *cmd_process(void);
 
+/**
+ * Check if an incoming packet is wanted by the command processor.
+ *
+ * @param flags packet flags field
+ * @param addr packet address field
+ * @param cmd packet command field
+ *
+ * This is called by the packet parser as soon as a packet header is
+ * received, before any buffer is used for the packet. It accepts commands
+ * for this node, broadcast commands, commands for the groups this node is
+ * in, and the commands that are processed for any address (ADDR and DFU).
+ * Replies from other nodes are only accepted when they are needed for a
+ * chained scan. While a new data rate is being confirmed, all packets are
+ * accepted.
+ *
+ * @return `true` if the packet should be received, `false` if it can be
+ * skipped.
+ *
+ * @note This is called from the packet parser, which runs in the UART RX
+ * interrupt or from the main loop, depending on \ref SER_RX_ISR_PARSE.
+ */
+extern bool cmd_accept(uint8_t flags, uint8_t addr, uint8_t cmd);
+
+/**
+ * Determine if the command processor is active.
+ *
+ * The command processor is active when it is waiting to send a deferred
+ * reply, such as a slotted reply to a broadcast command, or waiting to
+ * confirm a new data rate. The MCU should not
+ * sleep while the command processor is active.
+ *
+ * @return `true` if the command processor has pending work.
+ */
+extern bool cmd_is_active(void);
+
 #ifdef __cplusplus
 }
 #endif
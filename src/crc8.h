@@ -0,0 +1,82 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __CRC8_H__
+#define __CRC8_H__
+
+/** @addtogroup crc8 CRC-8
+ *
+ * @{
+ */
+
+/** Bitwise CRC-8 using the avr-libc `_crc8_ccitt_update()` (no table) */
+#define CRC8_BITWISE 0
+/** CRC-8 using a 16 entry table, one lookup per nibble */
+#define CRC8_NIBBLE 1
+/** CRC-8 using a 256 entry table, one lookup per byte */
+#define CRC8_TABLE 2
+
+/**
+ * Build time selection of the CRC-8 implementation.
+ *
+ * All choices compute the same CRC (CCITT, polynomial 0x07, initial value 0),
+ * and trade flash size for speed. The tables are `const` and stay in flash,
+ * which on this MCU can be read directly without `pgm_read_byte()`.
+ *
+ * - CRC8_BITWISE - smallest, slowest (8 shift/xor loop iterations per byte)
+ * - CRC8_NIBBLE - adds 16 bytes of table
+ * - CRC8_TABLE - adds 256 bytes of table, fastest
+ *
+ * The CRC is computed for each received byte by the packet parser, which
+ * runs in the main loop or in the serial RX interrupt (see
+ * \ref SER_RX_ISR_PARSE). Either way the parser has to keep up with the
+ * bus, so the speed matters at higher data rates.
+ */
+#ifndef CRC8_IMPL
+#define CRC8_IMPL CRC8_TABLE
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Update a CRC-8 with the next data byte.
+ *
+ * @param crc is the CRC value so far (start with 0)
+ * @param data is the next byte of data
+ *
+ * This is a drop-in replacement for the avr-libc `_crc8_ccitt_update()`.
+ *
+ * @return the updated CRC value
+ */
+extern uint8_t crc8_update(uint8_t crc, uint8_t data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/** @} */
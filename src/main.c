@@ -58,6 +58,7 @@
 #include "led.h"
 #include "kissm.h"
 #include "iomap.h"
+#include "baud.h"
 
 /*
  * Pin Assignments
@@ -93,7 +94,8 @@ void device_init(void)
     // not clear we need pullup on TX since there is board pullup
     // PORTA.PIN1CTRL = PORT_PULLUPEN_bm;  // enable pullup on TX pin
     USART0.CTRLA = USART_LBME_bm | USART_RXCIE_bm;  // enable loopback and RX int
-    USART0.BAUD = BAUDREG;  // set data rate
+    // set default data rate, and start measuring the actual data rate
+    baud_init(BAUDREG);
     // UART protocol 8,n,1 is already the default at boot
     USART0.CTRLB = USART_TXEN_bm | USART_RXEN_bm | USART_ODME_bm | USART_SFDEN_bm; // enable, open-drain
 }
@@ -206,7 +208,22 @@ KISSM_DEFSTATE(idle)
         // means there has been no activity so need to sleep
         case EVT_TIMEOUT:
         {
-            p_ns = KISSM_STATEREF(sleep);
+#if CFG_AUTOCOMMIT
+            // store any parameter changes now the bus is quiet
+            if (cfg_is_dirty())
+            {
+                cfg_store();
+            }
+#endif
+            // stay awake until the config is written to eeprom
+            if (cfg_is_active())
+            {
+                tmr_schedule(&state_tmr, STATE_TMR, 1000, false);
+            }
+            else
+            {
+                p_ns = KISSM_STATEREF(sleep);
+            }
             break;
         }
 
@@ -216,9 +233,11 @@ KISSM_DEFSTATE(idle)
         {
             wdt_reset();    // pet the watchdog
             // if a command was just processed, or if other modules
-            // are current active (packets in processs) then
+            // are current active (packets in processs, or a reply waiting
+            // for its slot) then
             // reset the state timeout
-            if (pkt_is_active() || ser_is_active())
+            if (pkt_is_active() || ser_is_active() || cmd_is_active()
+             || cfg_is_active())
             {
                 tmr_schedule(&state_tmr, STATE_TMR, 1000, false);
             }
@@ -378,6 +397,12 @@ KISSM_DEFSTATE(sleep)
             LOADON_PORT.OUTCLR = LOADON_PIN;
             REFON_PORT.OUTCLR = REFON_PIN;
 
+            // bus is idle, so the controller may change the data rate
+            // before the next packet. re-measure on the next preamble, but
+            // keep receiving at the current rate so that the packet that
+            // wakes us up is not lost
+            baud_recheck();
+
             // go to sleep
             set_sleep_mode(SLEEP_MODE_STANDBY);
             //set_sleep_mode(SLEEP_MODE_PWR_DOWN);
@@ -456,6 +481,9 @@ void main_loop(void)
         // run ADC conversions
         adc_run();
 
+        // write any pending config bytes to eeprom
+        cfg_run();
+
         // event generator
         // check for possible events in the system
         // check first for expiring timers, then incoming commands
@@ -463,6 +491,9 @@ void main_loop(void)
         evt.type = KISSM_EVT_NONE;
         pkt = NULL;
 
+        // parse any bytes that were received since last time
+        ser_rx_run();
+
         struct tmr *expired = tmr_process();    // any timers expired?
         if (expired)
         {
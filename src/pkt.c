@@ -25,11 +25,16 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
-#include <util/crc16.h>
 #include <util/atomic.h>
+#include <util/crc16.h>
 
 #include "pkt.h"
 #include "ser.h"
+#include "tmr.h"
+#include "cmd.h"
+#include "baud.h"
+#include "crc8.h"
+#include "stats.h"
 
 /*
  * |Byte| Field  | Description                              |
@@ -41,13 +46,43 @@
  * |  2 | Cmd/Rsp| command ID                               |
  * |  3 | Length | payload length in bytes (can be 0)       |
  * |  4+| Payload| variable payload contents (can be none)  |
- * |  N | CRC    | 8-bit CRC                                |
+ * |  N | CRC    | 8-bit CRC, or 16-bit CRC low byte first  |
+ *
+ * A reply with the stamp flag has the timestamp trailer at the end of the
+ * payload, and the length includes it.
+ *
+ * The 16-bit CRC is CCITT (polynomial 0x1021 reflected), initial value
+ * 0xFFFF, no final xor. Running it over the whole packet including the CRC
+ * gives 0.
  */
 
-#define PKT_PREAMBLE 0x55
-#define PKT_SYNC 0xF0
 #define PKT_GET_LEN(buf) ((buf)[3])
 
+#define PKT_CRC16_INIT 0xFFFF
+
+// true if a packet with these flags uses a 16-bit CRC
+#if PKT_CRC16
+#define PKT_IS_CRC16(flags) ((flags) & PKT_FLAG_CRC16)
+#else
+#define PKT_IS_CRC16(flags) (false)
+#endif
+
+// number of timestamp trailer bytes for a packet with these flags
+#if PKT_STAMP
+#define PKT_STAMP_BYTES(flags) (((flags) & PKT_FLAG_STAMP) ? PKT_STAMP_LEN : 0)
+#else
+#define PKT_STAMP_BYTES(flags) (0)
+#endif
+
+// longest time the turnaround of a stamp trailer can show, in milliseconds
+#define PKT_STAMP_MAX_MS 60
+
+// update a CRC-8 or CRC-16 with the next byte
+static inline uint16_t pkt_crc_update(bool wide, uint16_t crc, uint8_t data)
+{
+    return wide ? _crc_ccitt_update(crc, data) : crc8_update(crc, data);
+}
+
 // parser state machine states
 typedef enum
 {
@@ -55,29 +90,87 @@ typedef enum
     RX_SYNC,
     RX_HEADER,
     RX_DATA,
-    RX_CHECK
+    RX_CHECK,
+    RX_SKIP
 } rx_state_t;
 
 static rx_state_t state = RX_SEARCH;
 
-// indicates single RX buffer is allocated
-static bool rxbuf_inuse = false;
-
-// buffer used for RX packets
-static uint8_t rxbuf[16];
-
-// storage for received packet waiting for pickup
-static packet_t *ready_packet = NULL;
-
-// buffer used for assembling outgoing packets
-typedef struct
-{
-    const uint8_t preambles[4];
-    const uint8_t sync;
-    packet_t pkt;
-} txpacket_t;
-static txpacket_t txpkt =
-{ {PKT_PREAMBLE, PKT_PREAMBLE, PKT_PREAMBLE, PKT_PREAMBLE}, PKT_SYNC };
+// buffer of the packet being received, in the DATA and CHECK states
+static uint8_t *pbuf;
+
+// count of bytes seen by the parser, see pkt_rx_count()
+static volatile uint8_t rxcount = 0;
+
+#if PKT_STAMP
+// receive time of the packet last returned by pkt_ready()
+static uint16_t rx_ms;
+static uint16_t rx_us;
+#endif
+
+#if (PKT_RX_POOL_DEPTH < 1) || (PKT_RX_POOL_DEPTH > 8)
+#error "PKT_RX_POOL_DEPTH must be 1-8"
+#endif
+
+// the whole packet must be indexable with a uint8_t
+#if (PKT_PAYLOAD_LEN < 12) || (PKT_PAYLOAD_LEN > 250)
+#error "PKT_PAYLOAD_LEN must be 12-250"
+#endif
+
+// a packet being skipped must be countable with a uint8_t
+#if (PKT_PAYLOAD_LEN + PKT_STAMP_LEN) > 253
+#error "PKT_PAYLOAD_LEN must be 12-249 with PKT_STAMP"
+#endif
+
+#if PKT_TX_QUEUE_DEPTH < 1
+#error "PKT_TX_QUEUE_DEPTH must be at least 1"
+#endif
+
+// size of one packet_t buffer
+#define PKT_BUF_SIZE \
+    (PKT_HEADER_LEN + PKT_PAYLOAD_LEN + PKT_STAMP_LEN + 1 + PKT_CRC16)
+
+// all of the packet buffers must fit in the RAM set aside for them
+#if ((PKT_RX_POOL_DEPTH + PKT_TX_QUEUE_DEPTH + PKT_REPLY_CACHE) \
+     * PKT_BUF_SIZE) > PKT_RAM_MAX
+#error "packet buffers do not fit in PKT_RAM_MAX"
+#endif
+
+// pool of buffers used for RX packets
+static packet_t rxpool[PKT_RX_POOL_DEPTH];
+
+// bit mask of allocated RX buffers, bit N is rxpool[N]
+static uint8_t rxpool_inuse = 0;
+
+// FIFO of received packets waiting for pickup
+// every queued packet holds a pool buffer, so the FIFO can never hold
+// more than the pool depth and does not need an overflow check
+static packet_t *readyq[PKT_RX_POOL_DEPTH];
+static uint8_t readyq_head = 0;     // index of oldest ready packet
+static uint8_t readyq_cnt = 0;      // number of ready packets
+
+// preamble and sync bytes are the same for every outgoing packet
+static const uint8_t txpreamble[5] =
+{ PKT_PREAMBLE, PKT_PREAMBLE, PKT_PREAMBLE, PKT_PREAMBLE, PKT_SYNC };
+
+// outgoing packet queue
+// packets are transmitted directly from the queue by the serial module.
+// txq_head is the packet being sent, and txq_cnt counts that packet along
+// with any waiting behind it. txq_hwm is the most packets ever queued.
+// txq_tail is the next free slot. it is only changed by the main loop, so
+// the slot stays the same while a packet is built in it, even if the TX
+// complete interrupt moves the head
+static packet_t txq[PKT_TX_QUEUE_DEPTH];
+static volatile uint8_t txq_head = 0;
+static volatile uint8_t txq_cnt = 0;
+static uint8_t txq_tail = 0;
+static uint8_t txq_hwm = 0;
+
+#if PKT_REPLY_CACHE
+// copy of the last packet sent with a sequence number, for pkt_resend()
+// the flags are 0 if there is no copy
+static packet_t txlast;
+#endif
 
 //////////
 //
@@ -90,6 +183,7 @@ static txpacket_t txpkt =
 // - any packet buffers are in use
 // - a packet is ready for command processing
 // - packet state machine is not in SEARCH or SYNC mode
+// - there are outgoing packets in the TX queue
 //
 // this should be coupled with checking the serial hardware as well, to
 // make sure the rx input is idle (see serial module)
@@ -99,8 +193,9 @@ bool pkt_is_active(void)
     bool b_isactive = false;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        if (rxbuf_inuse
-         || (ready_packet != NULL)
+        if (rxpool_inuse
+         || readyq_cnt
+         || txq_cnt
          || ((state != RX_SEARCH) && (state != RX_SYNC)))
         {
             b_isactive = true;
@@ -115,119 +210,335 @@ void pkt_reset(void)
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
         state = RX_SEARCH;
-        rxbuf_inuse = false;
-        ready_packet = NULL;
+        rxpool_inuse = 0;
+        readyq_head = 0;
+        readyq_cnt = 0;
+    }
+}
+
+// get the parser byte count
+uint8_t pkt_rx_count(void)
+{
+    return rxcount;
+}
+
+// abandon a partly received packet
+// only the DATA and CHECK states hold a buffer
+bool pkt_rx_abort(void)
+{
+    bool ret = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if ((state != RX_SEARCH) && (state != RX_SYNC))
+        {
+            if ((state == RX_DATA) || (state == RX_CHECK))
+            {
+                pkt_rx_free((packet_t *)pbuf);
+            }
+            state = RX_SEARCH;
+            ret = true;
+        }
     }
+    return ret;
 }
 
 // Release an RX packet buffer for re-use.
+// the buffer index is found from the pointer position in the pool
 void pkt_rx_free(packet_t *pktbuf)
 {
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    ptrdiff_t idx = pktbuf - rxpool;
+    if ((idx >= 0) && (idx < PKT_RX_POOL_DEPTH))
     {
-        rxbuf_inuse = false;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            rxpool_inuse &= ~(1U << idx);
+        }
     }
 }
 
 // Allocate RX packet buffer.
+// returns the first free buffer in the pool
 packet_t *pkt_rx_alloc(void)
 {
-    packet_t *ret;
+    packet_t *ret = NULL;
 
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        if (!rxbuf_inuse)
+        for (uint8_t idx = 0; idx < PKT_RX_POOL_DEPTH; ++idx)
         {
-            rxbuf_inuse = true;
-            ret = (packet_t *)rxbuf;
+            uint8_t mask = 1U << idx;
+            if (!(rxpool_inuse & mask))
+            {
+                rxpool_inuse |= mask;
+                ret = &rxpool[idx];
+                break;
+            }
         }
-        else
+    }
+    return ret;
+}
+
+// add a completed packet to the ready FIFO
+// this is only called from the parser. the parser runs in the RX interrupt,
+// or from the main loop when the serial module queues bytes in its ring
+// (SER_RX_ISR_PARSE=0). either way pkt_ready() cannot run in the middle of
+// this, so no lock is needed here
+static void pkt_ready_put(packet_t *pkt)
+{
+    uint8_t idx = readyq_head + readyq_cnt;
+    if (idx >= PKT_RX_POOL_DEPTH)
+    {
+        idx -= PKT_RX_POOL_DEPTH;
+    }
+    readyq[idx] = pkt;
+    ++readyq_cnt;
+}
+
+// return the oldest received packet
+packet_t *pkt_ready(void)
+{
+    packet_t *ret = NULL;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (readyq_cnt)
         {
-            ret = NULL;
+            ret = readyq[readyq_head];
+#if PKT_STAMP
+            rx_ms = ret->stamp[0] | (ret->stamp[1] << 8);
+            rx_us = ret->stamp[2] | (ret->stamp[3] << 8);
+#endif
+            ++readyq_head;
+            if (readyq_head >= PKT_RX_POOL_DEPTH)
+            {
+                readyq_head = 0;
+            }
+            --readyq_cnt;
         }
     }
     return ret;
 }
 
-// return a received packet
-packet_t *pkt_ready(void)
+// start sending the packet at the head of the TX queue
+// the packet is sent with serial descriptors for the preamble, the packet,
+// and the crc, so nothing is copied. a stamp trailer is stored just before
+// the crc, so it is sent with the crc descriptor
+// returns false if the serial module did not accept the packet
+static bool pkt_tx_start(void)
+{
+    packet_t *pkt = &txq[txq_head];
+    uint8_t stamplen = PKT_STAMP_BYTES(pkt->flags);
+    ser_desc_t desc[3] =
+    {
+        { txpreamble, sizeof(txpreamble) },
+        { (uint8_t *)pkt, PKT_HEADER_LEN + pkt->len - stamplen },
+        { &pkt->crc - stamplen, stamplen + (PKT_IS_CRC16(pkt->flags) ? 2 : 1) }
+    };
+    return ser_write_desc(desc, 3);
+}
+
+// get the payload buffer of the next outgoing packet
+uint8_t *pkt_tx_buf(void)
+{
+    uint8_t *buf = NULL;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (txq_cnt < PKT_TX_QUEUE_DEPTH)
+        {
+            buf = txq[txq_tail].payload;
+        }
+    }
+    return buf;
+}
+
+// add the packet in the tail slot to the TX queue, and start sending if
+// nothing else is being sent. the slot must already hold the whole packet
+static bool pkt_tx_queue(void)
 {
-    packet_t *ret;
+    bool ret = true;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        ret = ready_packet;
-        ready_packet = NULL;
+        ++txq_cnt;
+        if (txq_cnt > txq_hwm)
+        {
+            txq_hwm = txq_cnt;
+        }
+        // if the serial module does not take it, then take it back out
+        // of the queue so it does not get stuck there
+        if ((txq_cnt == 1) && !pkt_tx_start())
+        {
+            txq_cnt = 0;
+            ret = false;
+        }
+        else
+        {
+            txq_tail = (txq_tail + 1) % PKT_TX_QUEUE_DEPTH;
+        }
+    }
+    if (ret)
+    {
+        stats_inc(STATS_TX_PKT);
     }
     return ret;
 }
 
-// assemble a packet and send it
-// this uses an extra buffer to assemble the packet instead of just
-// sending bytes one at a time. this ensures that the entire packet
-// gets copied into the serial output buffer without getting corrupted
-// by any incoming data at the time. If there was already incoming data then
-// this could corrupt the incoming packet for downstream nodes
+// assemble a packet and add it to the TX queue
+// If the payload was built in place (see pkt_tx_buf()) then there is no
+// copy at all. Otherwise, the payload is copied into the queue slot. The
+// queue is not used by anything else, so the packet cannot be corrupted by
+// any incoming data at the time.
 // TODO: add a lock to prevent outgoing while processing an incoming
 bool pkt_send(uint8_t flags, uint8_t addr, uint8_t cmd,
               uint8_t *payload, uint8_t len)
 {
     uint8_t idx;
-    uint8_t crc = 0; // init the crc
+    bool wide = PKT_IS_CRC16(flags);
+    uint16_t crc = wide ? PKT_CRC16_INIT : 0; // init the crc
 
-    // sanity check the payload length
-    if (len > PKT_PAYLOAD_LEN)
+    // sanity check the payload length, and room in the queue
+    // the queue count can only go down in the ISR, and the ISR never uses
+    // the tail slot, so if there is room now then the slot will stay free
+    if ((len > PKT_PAYLOAD_LEN) || (txq_cnt >= PKT_TX_QUEUE_DEPTH))
     {
         return false;
     }
 
+    packet_t *pkt = &txq[txq_tail];
+
     // populate the header bytes
-    txpkt.pkt.flags = flags;
-    txpkt.pkt.addr = addr;
-    txpkt.pkt.cmd = cmd;
-    txpkt.pkt.len = len;
-
-    // compute the crc over the header
-    // could be more efficient with count down loop
-    for (idx = 0; idx < 4; ++idx)
+    pkt->flags = flags;
+    pkt->addr = addr;
+    pkt->cmd = cmd;
+    pkt->len = len + PKT_STAMP_BYTES(flags);
+
+    // copy the payload into the buffer if it is not already there
+    if (payload != pkt->payload)
     {
-        // cppcheck-suppress[objectIndex]
-        crc = _crc8_ccitt_update(crc, ((uint8_t *)&txpkt.pkt)[idx]);
+        for (idx = 0; idx < len; ++idx)
+        {
+            pkt->payload[idx] = payload[idx];
+        }
     }
 
-    // copy the payload into the buffer and compute ongoing crc
-    for (idx = 0; idx < len; ++idx)
+    // compute the crc over the header and payload
+    for (idx = 0; idx < (PKT_HEADER_LEN + len); ++idx)
     {
-        txpkt.pkt.payload[idx] = payload[idx];
-        crc = _crc8_ccitt_update(crc, payload[idx]);
+        // cppcheck-suppress[objectIndex]
+        crc = pkt_crc_update(wide, crc, ((uint8_t *)pkt)[idx]);
     }
 
-    // put crc on end of payload
-    // depending on payload len, this may not be the actual
-    // crc field of packet_t
-    txpkt.pkt.payload[idx] = crc;
-
-    // compute total length. it is number of payload bytes,
-    // plus 4 header bytes, plus 4 preamble and 1 sync, plus crc
-    len = 4 + 1 + 4 + len + 1;
+#if PKT_STAMP
+    // add the stamp trailer, with the time the command was received and
+    // the time from then until now. the turnaround saturates if it is too
+    // long for the microsecond timestamp
+    if (flags & PKT_FLAG_STAMP)
+    {
+        uint16_t turn = tmr_us() - rx_us;
+        if ((uint16_t)(tmr_ms() - rx_ms) > PKT_STAMP_MAX_MS)
+        {
+            turn = 0xFFFF;
+        }
+        pkt->stamp[0] = rx_ms;
+        pkt->stamp[1] = rx_ms >> 8;
+        pkt->stamp[2] = turn;
+        pkt->stamp[3] = turn >> 8;
+        for (idx = 0; idx < PKT_STAMP_LEN; ++idx)
+        {
+            crc = pkt_crc_update(wide, crc, pkt->stamp[idx]);
+        }
+    }
+#endif
+    pkt->crc = crc;
+#if PKT_CRC16
+    pkt->crc_hi = crc >> 8;
+#endif
+
+#if PKT_REPLY_CACHE
+    // keep a copy of a sequenced reply in case the command is retried
+    if (flags & PKT_FLAG_SEQ)
+    {
+        txlast = *pkt;
+    }
+#endif
 
-    // send the packet to serial output
-    idx = ser_write((uint8_t *)&txpkt, len);
+    return pkt_tx_queue();
+}
 
-    if (idx != len)
+// queue the kept sequenced reply again
+bool pkt_resend(void)
+{
+#if PKT_REPLY_CACHE
+    if (!(txlast.flags & PKT_FLAG_SEQ) || (txq_cnt >= PKT_TX_QUEUE_DEPTH))
     {
         return false;
     }
+    txq[txq_tail] = txlast;
+    return pkt_tx_queue();
+#else
+    return false;
+#endif
+}
+
+// packet at head of TX queue is sent, start the next one
+// called from serial TX complete interrupt
+void pkt_tx_done(void)
+{
+    // any packet that the serial module does not accept is dropped
+    while (txq_cnt)
+    {
+        txq_head = (txq_head + 1) % PKT_TX_QUEUE_DEPTH;
+        --txq_cnt;
+        if (txq_cnt && pkt_tx_start())
+        {
+            break;
+        }
+    }
+}
 
-    return true;
+// number of packets in TX queue
+uint8_t pkt_tx_depth(void)
+{
+    return txq_cnt;
+}
+
+// most packets that were ever in the TX queue
+uint8_t pkt_tx_hwm(void)
+{
+    return txq_hwm;
+}
+
+#if PKT_STAMP
+// receive time of the sync byte of the packet being received
+// sync_timed is set when the time of the next byte was given
+static uint16_t sync_ms;
+static uint16_t sync_us;
+static bool sync_timed = false;
+
+// set the receive time of the next byte
+void pkt_rx_time(uint16_t ms, uint16_t us)
+{
+    sync_ms = ms;
+    sync_us = us;
+    sync_timed = true;
 }
+#endif
 
 // Process next byte in stream and parse packets.
+// The header is collected before a buffer is allocated, so that packets
+// that are not for this node can be skipped without using a buffer.
 void pkt_parser(uint8_t nextbyte)
 {
     static uint8_t idx;
-    static uint8_t crc;
+    static uint16_t crc;
+    static bool wide;
     static uint8_t len;
-    static uint8_t *pbuf;
+    static uint8_t hdr[PKT_HEADER_LEN];
+#if PKT_STAMP
+    // the time from pkt_rx_time() is only for this byte
+    bool timed = sync_timed;
+    sync_timed = false;
+#endif
+
+    ++rxcount;
 
     // process packet state machine
     switch (state)
@@ -245,20 +556,19 @@ void pkt_parser(uint8_t nextbyte)
             // waiting for sync byte
             if (nextbyte == PKT_SYNC)
             {
-                // get buffer to store incoming packet
-                pbuf = (uint8_t *)pkt_rx_alloc();
-                if (pbuf)
+                state = RX_HEADER;
+                idx = 0;
+                // the rest of the packet must not be measured as preamble
+                baud_rx_sync();
+#if PKT_STAMP
+                // receive time of the packet, for a stamp trailer. use
+                // the time from the RX interrupt if there is one
+                if (!timed)
                 {
-                    state = RX_HEADER;
-                    idx = 0;
-                    crc = 0;
-                }
-                // if no buffer is available, ignore this packet and go
-                // back to search for next
-                else
-                {
-                    state = RX_SEARCH;
+                    sync_ms = tmr_ms();
+                    sync_us = tmr_us();
                 }
+#endif
             }
             // if its not a sync, it should be preamble
             // if not, then go back to search
@@ -270,28 +580,70 @@ void pkt_parser(uint8_t nextbyte)
 
         // read in header bytes
         case RX_HEADER:
-            crc = _crc8_ccitt_update(crc, nextbyte);
-            pbuf[idx] = nextbyte;
+            // first header byte is the flags, which select the crc
+            if (idx == 0)
+            {
+                wide = PKT_IS_CRC16(nextbyte);
+                crc = wide ? PKT_CRC16_INIT : 0;
+            }
+            crc = pkt_crc_update(wide, crc, nextbyte);
+            hdr[idx] = nextbyte;
             ++idx;
             // all header bytes received
             if (idx == PKT_HEADER_LEN)
             {
                 // get the length and validate it
-                len = PKT_GET_LEN(pbuf);
+                len = PKT_GET_LEN(hdr);
+
+                // if len is too big, then abandon this packet. a reply
+                // from another node can be longer by its stamp trailer
+                if (len > (PKT_PAYLOAD_LEN + PKT_STAMP_BYTES(hdr[0])))
+                {
+                    stats_inc(STATS_LEN_ERR);
+                    state = RX_SEARCH;
+                    break;
+                }
+
+                // only get a buffer if the command processor wants
+                // this packet, and it fits
+                pbuf = NULL;
+                if ((len <= PKT_PAYLOAD_LEN)
+                 && cmd_accept(hdr[0], hdr[1], hdr[2]))
+                {
+                    pbuf = (uint8_t *)pkt_rx_alloc();
+                    if (pbuf == NULL)
+                    {
+                        stats_inc(STATS_NOBUF);
+                    }
+                }
+
+                // not wanted, or no buffer is available, so skip the
+                // payload and crc without looking at them
+                if (pbuf == NULL)
+                {
+                    len += wide ? 2 : 1;
+                    state = RX_SKIP;
+                    break;
+                }
+
+                for (idx = 0; idx < PKT_HEADER_LEN; ++idx)
+                {
+                    pbuf[idx] = hdr[idx];
+                }
+#if PKT_STAMP
+                ((packet_t *)pbuf)->stamp[0] = sync_ms;
+                ((packet_t *)pbuf)->stamp[1] = sync_ms >> 8;
+                ((packet_t *)pbuf)->stamp[2] = sync_us;
+                ((packet_t *)pbuf)->stamp[3] = sync_us >> 8;
+#endif
 
                 // special case, if len is 0 then no payload, do crc
+                // otherwise read in payload bytes
                 if (len == 0)
                 {
+                    len = 2; // CRC-16 byte count, not used for CRC-8
                     state = RX_CHECK;
                 }
-                // if len is too big, then abandon this packet
-                else if (len > PKT_PAYLOAD_LEN)
-                {
-                    pkt_rx_free((packet_t*)pbuf);
-                    state = RX_SEARCH;
-                }
-                // length field appear valid
-                // read in payload bytes
                 else
                 {
                     state = RX_DATA;
@@ -302,32 +654,57 @@ void pkt_parser(uint8_t nextbyte)
         // put incoming bytes into payload buffer until `len` bytes
         // have been stored
         case RX_DATA:
-            crc = _crc8_ccitt_update(crc, nextbyte);
+            crc = pkt_crc_update(wide, crc, nextbyte);
             pbuf[idx] = nextbyte;
             ++idx;
             --len;
             if (len == 0)
             {
+                len = 2; // CRC-16 byte count, not used for CRC-8
                 state = RX_CHECK;
             }
             break;
 
         // last byte of packet is crc. compare it to the computed crc
-        // for the incoming bytes
+        // for the incoming bytes. a CRC-16 is run over both crc bytes and
+        // the result is 0 if it is good
         case RX_CHECK:
+            if (wide)
+            {
+                crc = _crc_ccitt_update(crc, nextbyte);
+                if (--len)
+                {
+                    break; // wait for the high byte
+                }
+                nextbyte = 0;
+            }
             state = RX_SEARCH;
             if (nextbyte == crc)
             {
-                // good packet, save for client
-                ready_packet = (packet_t *)pbuf;
+                // good packet, queue it for client
+                stats_inc(STATS_RX_PKT);
+                baud_rx_good();
+                pkt_ready_put((packet_t *)pbuf);
             }
             else
             {
                 // bad packet, abandon
+                stats_inc(STATS_CRC_ERR);
+                baud_rx_error();
                 pkt_rx_free((packet_t *)pbuf);
             }
             break;
 
+        // ignore the rest of a packet that is not wanted
+        // `len` counts the remaining payload and crc bytes
+        case RX_SKIP:
+            --len;
+            if (len == 0)
+            {
+                state = RX_SEARCH;
+            }
+            break;
+
         default:
             state = RX_SEARCH;
             break;
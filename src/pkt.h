@@ -37,9 +37,112 @@
 #define PKT_HEADER_LEN 4
 
 /**
- * Maximum number of payload bytes
+ * Maximum number of payload bytes (MTU).
+ *
+ * This sets the size of every packet buffer, and the longest packet the
+ * parser will accept. It can be overridden at build time to allow larger
+ * transfers with less packet overhead. It must be 12-250, or 12-249 with
+ * \ref PKT_STAMP, and all of the packet buffers together must fit in
+ * \ref PKT_RAM_MAX. With the default buffer counts that limits it to about
+ * 180. The controller can discover the value with the MTU command.
  */
+#ifndef PKT_PAYLOAD_LEN
 #define PKT_PAYLOAD_LEN 12
+#endif
+
+/**
+ * Number of RX packet buffers in the receive pool.
+ *
+ * This is also the maximum number of received packets that can be waiting
+ * to be processed by the client of pkt_ready(). It can be overridden at build
+ * time. It must be in the range 1-8.
+ */
+#ifndef PKT_RX_POOL_DEPTH
+#define PKT_RX_POOL_DEPTH 4
+#endif
+
+/**
+ * Number of outgoing packets in the transmit queue.
+ *
+ * Reply packets are queued and transmitted in order, so that several replies
+ * can be sent back-to-back without waiting. It can be overridden at build
+ * time. It must be at least 1.
+ */
+#ifndef PKT_TX_QUEUE_DEPTH
+#define PKT_TX_QUEUE_DEPTH 3
+#endif
+
+/**
+ * Keep a copy of the last reply sent with a sequence number.
+ *
+ * If 1, replies sent with \ref PKT_FLAG_SEQ are kept so that they can be
+ * sent again by pkt_resend() when the controller retries a command. This
+ * costs one more packet buffer of RAM, so it can be set to 0 at build time
+ * for large MTU builds.
+ */
+#ifndef PKT_REPLY_CACHE
+#define PKT_REPLY_CACHE 1
+#endif
+
+/**
+ * Support CRC-16 packets.
+ *
+ * If 1, a packet with \ref PKT_FLAG_CRC16 in its flags ends with a 16-bit
+ * CRC instead of the 8-bit CRC. The controller chooses the CRC for each
+ * command and the node replies with the same. If 0, CRC-16 packets are
+ * dropped as bad packets, which saves a little code and one byte per packet
+ * buffer.
+ */
+#ifndef PKT_CRC16
+#define PKT_CRC16 1
+#endif
+
+/**
+ * Support the timestamp trailer on replies.
+ *
+ * If 1, a command with \ref PKT_FLAG_STAMP in its flags is answered with a
+ * reply that has the same flag, and \ref PKT_STAMP_LEN more bytes at the
+ * end of its payload. The trailer has the system tick (milliseconds) when
+ * the sync byte of the command was received, followed by the time in
+ * microseconds from then until the reply was queued to send. Both are
+ * 16-bit little endian. If 0, the flag is ignored, which saves a little
+ * code and \ref PKT_STAMP_LEN bytes per packet buffer.
+ */
+#ifndef PKT_STAMP
+#define PKT_STAMP 1
+#endif
+
+#if PKT_STAMP
+#define PKT_STAMP_LEN 4 //< number of bytes in the timestamp trailer
+#else
+#define PKT_STAMP_LEN 0
+#endif
+
+/**
+ * Most RAM that the packet buffers can use, in bytes.
+ *
+ * The RX pool, the TX queue and the reply cache each hold whole packet
+ * buffers, so their size grows with \ref PKT_PAYLOAD_LEN. The build fails
+ * if they need more than this. The MCU has 2048 bytes of RAM, and the rest
+ * is left for the other modules and the stack. A large MTU build can lower
+ * the buffer counts, or turn off \ref PKT_REPLY_CACHE, to fit.
+ */
+#ifndef PKT_RAM_MAX
+#define PKT_RAM_MAX 1536
+#endif
+
+/**
+ * Inter-character timeout, in milliseconds.
+ *
+ * If the line goes idle for this long in the middle of a packet, the
+ * partly received packet is abandoned and the parser goes back to searching
+ * for a preamble (see pkt_rx_abort()). It must be longer than a few byte
+ * times at the lowest data rate in use, and the controller must not pause
+ * this long in the middle of a packet.
+ */
+#ifndef PKT_IDLE_MS
+#define PKT_IDLE_MS 10
+#endif
 
 /**
  * BMS Node Packet Format
@@ -51,11 +154,38 @@ typedef struct __attribute__ ((__packed__))
     uint8_t cmd;    //!< packet command code
     uint8_t len;    //!< payload length
     uint8_t payload[PKT_PAYLOAD_LEN];   //!< data bytes (variable length)
-    uint8_t crc;    //!< CRC over header and data
+#if PKT_STAMP
+    uint8_t stamp[PKT_STAMP_LEN];   //!< RX time, or the trailer of a reply
+#endif
+    uint8_t crc;    //!< CRC over header and data (CRC-16 low byte)
+#if PKT_CRC16
+    uint8_t crc_hi; //!< CRC-16 high byte
+#endif
 } packet_t;
 
 #define PKT_FLAG_REPLY 0x80 //< indicates reply packet
 #define PKT_FLAG_INIT 0x40  //< node init packet
+#define PKT_FLAG_SEQ 0x20   //< flags bits 2:0 hold a sequence number
+#define PKT_FLAG_CRC16 0x10 //< packet ends with a 16-bit CRC
+#define PKT_FLAG_STAMP 0x08 //< reply has a timestamp trailer
+#define PKT_SEQ_MASK 0x07   //< sequence number bits of the flags
+
+#define PKT_PREAMBLE 0x55   //< preamble byte, sent before the sync byte
+#define PKT_SYNC 0xF0       //< sync byte, marks the start of a packet
+
+/**
+ * Broadcast address. Packets sent to this address are for all nodes.
+ */
+#define PKT_ADDR_BROADCAST 255
+
+/**
+ * First group address. There are PKT_ADDR_GROUP_CNT group addresses, from
+ * 240 to 253. A node is in the groups that are set in its GROUPS parameter.
+ * These cannot be used as node addresses.
+ */
+#define PKT_ADDR_GROUP 240
+#define PKT_ADDR_GROUP_CNT 14
+#define PKT_ADDR_IS_GROUP(a) ((uint8_t)((a) - PKT_ADDR_GROUP) < PKT_ADDR_GROUP_CNT)
 
 #ifdef __cplusplus
 extern "C" {
@@ -98,7 +228,8 @@ extern bool pkt_is_active(void);
  *
  * Marks the RX packet buffer as available for re-use so that another
  * incoming packet can be processed. This should be called by the client
- * of pkt_parser() once it no longer needs the buffer.
+ * of pkt_parser() once it no longer needs the buffer. Passing a pointer that
+ * did not come from pkt_rx_alloc() has no effect.
  */
 extern void pkt_rx_free(packet_t *pkt);
 
@@ -119,13 +250,32 @@ extern packet_t *pkt_rx_alloc(void);
 /**
  * Get a received packet that is ready.
  *
+ * Received packets are queued in the order they were received, up to
+ * \ref PKT_RX_POOL_DEPTH packets. Each call returns the oldest waiting packet.
+ * The receive time of the returned packet is kept for the timestamp trailer
+ * of the next reply (see \ref PKT_STAMP).
+ *
  * @return A valid packet that has been received or NULL if there is no new
  * available packet.
  */
 extern packet_t *pkt_ready(void);
 
 /**
- * Assemble a packet and send it.
+ * Get the payload buffer of the next outgoing packet.
+ *
+ * A reply payload can be built directly in this buffer, and then passed to
+ * pkt_send(), which avoids copying the payload. The buffer holds up to
+ * \ref PKT_PAYLOAD_LEN bytes. The buffer is the next free slot of the
+ * transmit queue, so it must be passed to pkt_send() before getting another
+ * buffer.
+ *
+ * @return pointer to the outgoing payload buffer, or NULL if the transmit
+ * queue is full.
+ */
+extern uint8_t *pkt_tx_buf(void);
+
+/**
+ * Assemble a packet and queue it for sending.
  *
  * @param flags flags field TBD
  * @param addr packet address
@@ -134,18 +284,103 @@ extern packet_t *pkt_ready(void);
  * @param len length of payload data (can be 0)
  *
  * This function will assemble a packet, along with the computed CRC and
- * the preamble and sync bytes, and transmit it on the serial port. Upon
- * return, all data will have been copied into an outgoing buffer, so the
- * payload data buffer can be reused. The outgoing packet is queued, but will
+ * the preamble and sync bytes, and add it to the transmit queue. The packets
+ * are sent in order directly from the queue. If _payload_ is the buffer from
+ * pkt_tx_buf() then it is used in place, otherwise the payload is copied to
+ * the queue and the caller's buffer can be reused. The packet will usually
  * still be in progress when this function returns.
  *
- * @return `true` if the packet was copied to output, `false` if not. A return
- * value of false means that the packet could not fit in the serial transmit
- * buffer.
+ * If _flags_ has \ref PKT_FLAG_STAMP, the timestamp trailer is added after
+ * the payload. It is for the packet last returned by pkt_ready().
+ *
+ * This is all or nothing. Either the whole packet is queued or nothing is.
+ *
+ * @return `true` if the packet was queued, `false` if not. A return value of
+ * false means that the payload is too long or that the transmit queue is
+ * full.
  */
 extern bool pkt_send(uint8_t flags, uint8_t addr, uint8_t cmd,
                      uint8_t *payload, uint8_t len);
 
+/**
+ * Queue the last sequenced reply to be sent again.
+ *
+ * The last packet that was sent with \ref PKT_FLAG_SEQ in its flags is kept
+ * whole, including its CRC. This queues that same packet again, without
+ * building it again. This is used to answer a retried command without
+ * running the command again.
+ *
+ * @return `true` if the packet was queued, `false` if there is no kept
+ * packet, the transmit queue is full, or the cache is not built in (see
+ * \ref PKT_REPLY_CACHE).
+ */
+extern bool pkt_resend(void);
+
+/**
+ * Notify the packet module that a packet transmission is finished.
+ *
+ * This is called by the serial module from the TX complete interrupt. It
+ * removes the packet from the transmit queue and starts sending the next
+ * one if there is one.
+ */
+extern void pkt_tx_done(void);
+
+/**
+ * Get the number of packets in the transmit queue.
+ *
+ * @return count of packets that are being sent or waiting to be sent
+ */
+extern uint8_t pkt_tx_depth(void);
+
+/**
+ * Get the transmit queue high-water mark.
+ *
+ * @return the most packets that were ever in the transmit queue at once,
+ * since startup. This is useful to see if \ref PKT_TX_QUEUE_DEPTH is large
+ * enough.
+ */
+extern uint8_t pkt_tx_hwm(void);
+
+/**
+ * Get the count of bytes seen by the packet parser.
+ *
+ * The count goes up by one for every byte passed to pkt_parser() and wraps
+ * around. It is used with a timer to find out if the line has gone idle.
+ *
+ * @return the parser byte count
+ */
+extern uint8_t pkt_rx_count(void);
+
+/**
+ * Abandon a partly received packet.
+ *
+ * If the parser is in the middle of a packet, any buffer it is using is
+ * released and it goes back to searching for a preamble. This is meant to
+ * be called when the line has been idle for \ref PKT_IDLE_MS, so that a
+ * packet that was cut off does not hold up the parser until enough
+ * preamble bytes arrive. Packets that were already received are kept.
+ *
+ * @return true if a packet was abandoned, false if the parser was not in
+ *         the middle of a packet
+ */
+extern bool pkt_rx_abort(void);
+
+#if PKT_STAMP
+/**
+ * Set the receive time of the next byte passed to pkt_parser().
+ *
+ * @param ms millisecond time from tmr_ms()
+ * @param us microsecond time from tmr_us()
+ *
+ * If the next byte is the sync byte of a packet, this is used as the
+ * receive time for the stamp trailer. This lets the serial module latch the
+ * time in the RX interrupt when the parser runs later from the main loop.
+ * If it is not called, the parser reads the time itself when it sees the
+ * sync byte.
+ */
+extern void pkt_rx_time(uint16_t ms, uint16_t us);
+#endif
+
 /**
  * Process next byte in stream and parse packets.
  *
@@ -156,13 +391,21 @@ extern bool pkt_send(uint8_t flags, uint8_t addr, uint8_t cmd,
  * a complete packet is received and validated, this function returns a pointer
  * to the packet. Until then, it returns NULL.
  *
- * Once the buffer pointer is returned, a new packet cannot be parsed until
- * the client releases the buffer by calling pkt_rx_free().
+ * Each returned packet holds one buffer from the RX pool until the client
+ * releases it by calling pkt_rx_free(). If all of the pool buffers are in
+ * use, then new incoming packets are dropped.
+ *
+ * When the header has been received, the parser asks the command processor
+ * (see cmd_accept()) if the packet is wanted. Packets that are not wanted,
+ * such as commands for other nodes, are skipped without using a buffer and
+ * without checking the CRC.
  *
  * @return A pointer to a valid packet or NULL.
  *
- * @note This function is expected to be called from (UART RX) interrupt
- * context. So it should non-blocking and execute in minimal time.
+ * @note This function is called from the UART RX interrupt, or from the
+ * main loop by ser_rx_run() when the serial module queues received bytes
+ * (see \ref SER_RX_ISR_PARSE). So it is non-blocking and executes in
+ * minimal time.
  */
 extern void pkt_parser(uint8_t nextbyte);
 
@@ -33,18 +33,56 @@
 #include "pkt.h"
 #include "ser.h"
 #include "cfg.h"
+#include "baud.h"
+#include "stats.h"
+#if PKT_STAMP
+#include "tmr.h"
+#endif
+
+// serial transmit descriptors
+// the data is sent directly from the caller buffers, there is no copy.
+// txdesc_idx is the next descriptor to start, txp/txlen track the
+// descriptor that is being sent
+static ser_desc_t txdesc[SER_DESC_MAX];
+static uint8_t txdesc_cnt = 0;
+static uint8_t txdesc_idx = 0;
+static const uint8_t *txp;
+static uint8_t txlen = 0;
+
+#if !SER_RX_ISR_PARSE
+#if (SER_RX_RING_LEN & (SER_RX_RING_LEN - 1)) || (SER_RX_RING_LEN > 128)
+#error "SER_RX_RING_LEN must be a power of 2, up to 128"
+#endif
 
-// serial transmit buffer and pointers
-static uint8_t headp = 0;
-static uint8_t tailp = 0;
-static uint8_t txbuf[32];
+// serial receive ring buffer
+// this has one producer (RX ISR) and one consumer (ser_rx_run() in the main
+// loop). the ISR only writes rxhead, the main loop only writes rxtail, so
+// no lock is needed. the indexes are free running and masked on use, which
+// means head - tail is the count of bytes in the ring.
+#define RXRING_MASK (SER_RX_RING_LEN - 1)
+static uint8_t rxring[SER_RX_RING_LEN];
+static volatile uint8_t rxhead = 0;
+static volatile uint8_t rxtail = 0;
+#define RX_PENDING() (rxhead != rxtail)
 
-// convenience macros for managing the serial buffer
-#define BUF_EMPTY() (headp == tailp)
-#define BUF_NOTEMPTY() (headp != tailp)
-#define BUF_CNT() ((headp - tailp) & 0x1F)
-#define BUF_FULL() (BUF_CNT() == 31)
-#define BUF_NOTFULL() (BUF_CNT() < 31)
+#if PKT_STAMP
+// receive time of the last sync byte that followed a preamble byte, and
+// its free running ring index. the time is latched in the ISR so that the
+// stamp trailer does not include the main loop latency. if another sync
+// byte comes before the parser gets to this one, the time is replaced and
+// the parser reads the time itself for the earlier packet
+static volatile bool rxsync_set = false;
+static uint8_t rxsync_idx;
+static uint16_t rxsync_ms;
+static uint16_t rxsync_us;
+static uint8_t rxlast; // last byte received, only used by the ISR
+#endif
+#else
+#define RX_PENDING() (false)
+#endif
+
+// convenience macro to check for more data to send
+#define TX_PENDING() (txlen || (txdesc_idx < txdesc_cnt))
 
 // easy enable/disable of TX ISR
 #define TXINT_ENABLE() (USART0.CTRLA |= USART_DREIE_bm | USART_TXCIE_bm)
@@ -106,10 +144,11 @@ bool rxint_disable(void)
 
 // determine if serial hardware is active
 // criteria:
-// - tx sw buffer is not  empty
+// - tx descriptors are not all sent
 // - tx UDRE interrupt is enabled (which means there is ongoing tx operation)
 // - tx TXC interrupt is enabled (tx byte in progress)
 // - rx is not empty (incoming bytes to process)
+// - rx ring has bytes that were not parsed yet
 //
 // This should be coupled with checking the packet processor as well
 //
@@ -118,10 +157,11 @@ bool ser_is_active(void)
     bool b_isactive = false;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-        if (BUF_NOTEMPTY()
+        if (TX_PENDING()
          || (USART0.CTRLA & USART_DREIE_bm)
          || (USART0.CTRLA & USART_TXCIE_bm)
-         || (USART0.STATUS & USART_RXCIF_bm))
+         || (USART0.STATUS & USART_RXCIF_bm)
+         || RX_PENDING())
         {
             b_isactive = true;
         }
@@ -129,39 +169,88 @@ bool ser_is_active(void)
     return b_isactive;
 }
 
-// write data to the serial output
-// TODO: consider all or nothing write, instead of partial when there
-// is not enough room in the buffer
+// determine if a transmit is in progress
+// TXC interrupt stays enabled until the last byte is shifted out
+bool ser_tx_busy(void)
+{
+    return (USART0.CTRLA & USART_TXCIE_bm) != 0;
+}
+
+// write data to the serial output from a list of descriptors
+// the descriptors are copied, but not the data they point to
 //
 // NOTE: this starts transmitting. so assume there is not any contention on
 // the serial bus (nothing being received)
-uint8_t ser_write(uint8_t *buf, uint8_t len)
+bool ser_write_desc(const ser_desc_t *desc, uint8_t cnt)
 {
-    uint8_t cnt = 0;
+    if ((cnt == 0) || (cnt > SER_DESC_MAX) || ser_tx_busy())
+    {
+        return false;
+    }
+
     CRITICAL_RX()
     {
-        while (BUF_NOTFULL() && len--)
+        for (uint8_t idx = 0; idx < cnt; ++idx)
         {
-            txbuf[headp++] = buf[cnt++];
-            headp &= 0x1F;
+            txdesc[idx] = desc[idx];
         }
+        txdesc_cnt = cnt;
+        txdesc_idx = 0;
+        txlen = 0;
+
         // switch duplex
         USART0.CTRLB &= ~USART_RXEN_bm; // disable RX function
         USART0.CTRLB |= USART_TXEN_bm;  // enable TX function
         TXINT_ENABLE(); // will kick off serial transmit
     }
-    return cnt;
+    return true;
 }
 
-// flush the serial buffer and reset internals
+// write a single buffer to the serial output
+uint8_t ser_write(uint8_t *buf, uint8_t len)
+{
+    ser_desc_t desc = { buf, len };
+    return ser_write_desc(&desc, 1) ? len : 0;
+}
+
+// pass any bytes in the RX ring to the packet parser
+void ser_rx_run(void)
+{
+#if !SER_RX_ISR_PARSE
+    uint8_t tail = rxtail;
+    while (tail != rxhead)
+    {
+#if PKT_STAMP
+        // pass on the time that was latched for a sync byte
+        if (rxsync_set)
+        {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            {
+                if (tail == rxsync_idx)
+                {
+                    pkt_rx_time(rxsync_ms, rxsync_us);
+                    rxsync_set = false;
+                }
+            }
+        }
+#endif
+        pkt_parser(rxring[tail & RXRING_MASK]);
+        ++tail;
+        rxtail = tail; // free the slot for the ISR
+    }
+#endif
+}
+
+// flush the serial transmit and reset internals
 void ser_flush(void)
 {
     CRITICAL_RX()
     {
         TXINT_DISABLE();
         USART0.CTRLA &= ~USART_TXCIE_bm;
-        headp = 0;
-        tailp = 0;
+        txdesc_cnt = 0;
+        txdesc_idx = 0;
+        txlen = 0;
     }
     // CRITICAL_RX() has the side effect of leaving the RX interrupt enabled
 }
@@ -176,11 +265,58 @@ ISR(USART0_RXC_vect)
     // check for rx received
     if (flags & USART_RXCIF_bm)
     {
+        // read error flags, these must be read before the data
+        uint8_t errs = USART0.RXDATAH;
+
         // read character from uart
         uint8_t ch = USART0.RXDATAL;
 
         // process bytes into packets
-        pkt_parser(ch);
+        // while the data rate is being measured the bytes are not valid
+        if (baud_is_locked())
+        {
+            // count receive errors. the byte is still passed on and the
+            // packet it belongs to will fail the crc check
+            if (errs & USART_FERR_bm)
+            {
+                stats_inc(STATS_FRAME_ERR);
+                baud_rx_error();
+            }
+            if (errs & USART_BUFOVF_bm)
+            {
+                stats_inc(STATS_OVERRUN);
+            }
+
+#if SER_RX_ISR_PARSE
+            pkt_parser(ch);
+#else
+            // queue the byte for the parser in the main loop
+            uint8_t head = rxhead;
+            if ((uint8_t)(head - rxtail) < SER_RX_RING_LEN)
+            {
+                rxring[head & RXRING_MASK] = ch;
+                rxhead = head + 1;
+#if PKT_STAMP
+                if ((ch == PKT_SYNC) && (rxlast == PKT_PREAMBLE))
+                {
+                    rxsync_idx = head;
+                    rxsync_ms = tmr_ms();
+                    rxsync_us = tmr_us();
+                    rxsync_set = true;
+                }
+#endif
+            }
+            // ring is full so the byte is lost. the packet it belongs to
+            // will fail the crc check
+            else
+            {
+                stats_inc(STATS_RX_OVERFLOW);
+            }
+#if PKT_STAMP
+            rxlast = ch;
+#endif
+#endif
+        }
     }
 }
 
@@ -191,17 +327,25 @@ ISR(USART0_DRE_vect)
     // get uart status
     uint8_t flags = USART0.STATUS;
 
-    // check for data in buffer to send
-    if (BUF_NOTEMPTY())
+    // advance to the next descriptor that has data, if needed
+    while ((txlen == 0) && (txdesc_idx < txdesc_cnt))
+    {
+        txp = txdesc[txdesc_idx].buf;
+        txlen = txdesc[txdesc_idx].len;
+        ++txdesc_idx;
+    }
+
+    // check for data to send
+    if (txlen)
     {
         // make sure uart tx buffer is free (this should always be true)
         if (flags & USART_DREIF_bm)
         {
-            // read byte from buffer and write to uart TX
+            // write next byte to uart TX
             // clear TXC0 so that it can be used to detect tx complete
             USART0.STATUS |= USART_TXCIF_bm;
-            USART0.TXDATAL = txbuf[tailp++];
-            tailp &= 0x1F;
+            USART0.TXDATAL = *txp++;
+            --txlen;
         }
     }
     // there was no data to send so turn off the TX interrupt
@@ -218,9 +362,9 @@ ISR(USART0_TXC_vect)
 {
     // on entry here, the last byte should have been shifted out and
     // there is no more data to send.
-    // To be sure, double check the TX buffer and make sure there is not
+    // To be sure, double check the TX descriptors and make sure there is not
     // any other data to send before shutting down the UART TX
-    if (BUF_NOTEMPTY())
+    if (TX_PENDING())
     {
         // re-enable the TX int and the handler will be invoked
         TXINT_ENABLE();
@@ -237,6 +381,9 @@ ISR(USART0_TXC_vect)
         // disable UART TX, and enable UART RX
         USART0.CTRLB &= ~USART_TXEN_bm;
         USART0.CTRLB |= USART_RXEN_bm;
+
+        // let packet module start the next packet, if any
+        pkt_tx_done();
     }
 }
 
@@ -247,9 +394,16 @@ ISR(USART0_TXC_vect)
 #ifdef UNIT_TEST
 struct serinternals
 {
-    uint8_t *pheadp;
-    uint8_t *ptailp;
-    uint8_t *ptxbuf;
-    uint8_t bufsize;
-} serial_internals = { &headp, &tailp, txbuf, 32 };
+    ser_desc_t *ptxdesc;
+    uint8_t *ptxdesc_cnt;
+    uint8_t *ptxdesc_idx;
+    uint8_t *ptxlen;
+#if !SER_RX_ISR_PARSE
+    volatile uint8_t *prxhead;
+    volatile uint8_t *prxtail;
+} serial_internals = { txdesc, &txdesc_cnt, &txdesc_idx, &txlen,
+                       &rxhead, &rxtail };
+#else
+} serial_internals = { txdesc, &txdesc_cnt, &txdesc_idx, &txlen };
+#endif
 #endif
@@ -30,27 +30,103 @@
  * @{
  */
 
+/**
+ * Maximum number of descriptors for one serial write.
+ */
+#define SER_DESC_MAX 4
+
+/**
+ * Parse received bytes in the RX interrupt.
+ *
+ * When this is 0 (default), the RX interrupt only stores received bytes in a
+ * ring buffer, and the packet parser is run from the main loop by
+ * ser_rx_run(). This keeps the interrupt short so it does not delay other
+ * interrupts such as the system tick. When this is 1, the packet parser is
+ * called directly from the RX interrupt and there is no ring buffer.
+ */
+#ifndef SER_RX_ISR_PARSE
+#define SER_RX_ISR_PARSE 0
+#endif
+
+/**
+ * Size of the RX byte ring buffer.
+ *
+ * This is how many received bytes can wait for ser_rx_run(). It must be a
+ * power of 2, no more than 128. It is not used if \ref SER_RX_ISR_PARSE is 1.
+ */
+#ifndef SER_RX_RING_LEN
+#define SER_RX_RING_LEN 64
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /**
- * Write data to the serial transmit buffer.
+ * Serial transmit descriptor.
+ *
+ * Describes one block of data to be transmitted. A transmission is made of
+ * a list of descriptors that are sent in order, without copying the data.
+ */
+typedef struct
+{
+    const uint8_t *buf; ///< data to transmit (RAM or flash)
+    uint8_t len;        ///< count of bytes in buf (can be 0)
+} ser_desc_t;
+
+/**
+ * Write data to the serial port from a list of descriptors.
+ *
+ * @param desc array of descriptors for the data to write
+ * @param cnt number of descriptors, up to \ref SER_DESC_MAX
+ *
+ * The data is transmitted from the buffers in the descriptors, in order,
+ * by the transmit interrupt. The data is not copied so the buffers must not
+ * be changed until the transmission is complete (see ser_tx_busy()). The
+ * descriptor array itself is copied and can be reused right away.
+ *
+ * This is all or nothing. If a transmission is already in progress then
+ * nothing is written.
+ *
+ * @return `true` if the transmission was started, `false` if the
+ * transmitter is busy or the descriptor count is not valid.
+ */
+extern bool ser_write_desc(const ser_desc_t *desc, uint8_t cnt);
+
+/**
+ * Write a single buffer to the serial port.
  *
  * @param buf buffer holding data to write
  * @param len count of bytes to write
  *
- * Copies data bytes from _buf_ to the serial transmit buffer. If there are
- * more bytes that will fit in the TX buffer then the return value will
- * indicate the number that were actually copied. Once this function is called,
- * any bytes in the buffer will be transmitted on the serial port.
+ * Same as ser_write_desc() with a single descriptor. The buffer must not be
+ * changed until the transmission is complete.
  *
- * @return the number of bytes that were copied to the transmit buffer.
+ * @return the number of bytes that will be transmitted, which is either
+ * _len_ or 0 if the transmitter is busy.
  */
 extern uint8_t ser_write(uint8_t *buf, uint8_t len);
 
 /**
- * Flush the serial transmit buffer. Resets the internal state.
+ * Determine if a serial transmission is in progress.
+ *
+ * @return `true` from the time a write is started until the last byte has
+ * been shifted out.
+ */
+extern bool ser_tx_busy(void);
+
+/**
+ * Pass received bytes to the packet parser.
+ *
+ * This should be called from the main loop. It removes all of the bytes that
+ * are waiting in the RX ring buffer and passes each one to pkt_parser(). It
+ * does nothing if \ref SER_RX_ISR_PARSE is 1. Bytes that are lost because
+ * the ring is full are counted in \ref STATS_RX_OVERFLOW.
+ */
+extern void ser_rx_run(void);
+
+/**
+ * Flush the serial transmit data. Resets the internal state.
  */
 extern void ser_flush(void);
 
@@ -60,7 +136,8 @@ extern void ser_flush(void);
  * Checks internal state of the serial hardware to see if the serial module is
  * active (if active the MCU should not sleep). This function checks the
  * hardware to see if there is any ongoing transmit or receive activity, or if
- * there is any data in a serial buffer.
+ * there is any data in a serial buffer, including received bytes that have
+ * not been passed to the packet parser yet.
  *
  * @return `true` if the serail module is active at the moment (TX or RX is
  * in progress)
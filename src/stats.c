@@ -0,0 +1,80 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdint.h>
+
+#include <util/atomic.h>
+
+#include "stats.h"
+
+// counters are 16 bits, so they are updated in a critical section because
+// they are used from interrupts and the main loop
+static uint16_t counters[STATS_NUM];
+
+//////////
+//
+// See header file for public function API descriptions.
+//
+//////////
+
+// increment a counter, saturating
+void stats_inc(enum stats_id id)
+{
+    if (id < STATS_NUM)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            if (counters[id] != 0xFFFF)
+            {
+                ++counters[id];
+            }
+        }
+    }
+}
+
+// read a counter
+uint16_t stats_get(enum stats_id id)
+{
+    uint16_t val = 0;
+    if (id < STATS_NUM)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            val = counters[id];
+        }
+    }
+    return val;
+}
+
+// clear all counters
+void stats_clear(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for (uint8_t idx = 0; idx < STATS_NUM; ++idx)
+        {
+            counters[idx] = 0;
+        }
+    }
+}
@@ -0,0 +1,84 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/** @addtogroup stats Statistics
+ *
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Bus and protocol statistics counters.
+ */
+enum stats_id
+{
+    STATS_RX_PKT = 0,   ///< valid packets received for this node
+    STATS_TX_PKT,       ///< reply packets sent
+    STATS_CRC_ERR,      ///< packets dropped for a bad CRC
+    STATS_LEN_ERR,      ///< packets dropped for a length over the MTU
+    STATS_NOBUF,        ///< packets dropped because no RX buffer was free
+    STATS_FRAME_ERR,    ///< bytes received with a USART framing error
+    STATS_OVERRUN,      ///< USART receive buffer overruns
+    STATS_RX_OVERFLOW,  ///< bytes dropped because the RX ring was full
+    STATS_PKT_TIMEOUT,  ///< packets abandoned by the idle or 5 second timeout
+    STATS_NUM           ///< count of statistics counters
+};
+
+/**
+ * Increment a statistics counter.
+ *
+ * @param id the counter to increment
+ *
+ * The counters saturate at 65535 and do not wrap. This can be called from
+ * an interrupt.
+ */
+extern void stats_inc(enum stats_id id);
+
+/**
+ * Get the value of a statistics counter.
+ *
+ * @param id the counter to read
+ *
+ * @return the counter value, or 0 if _id_ is not valid
+ */
+extern uint16_t stats_get(enum stats_id id);
+
+/**
+ * Clear all of the statistics counters.
+ */
+extern void stats_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/** @} */
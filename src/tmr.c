@@ -73,6 +73,33 @@ void tmr_init(void)
     tmrlist.p_next = NULL;
 }
 
+// get the system tick count
+uint16_t tmr_ms(void)
+{
+    return tmr_get_ticks();
+}
+
+// get a microsecond timestamp
+// the tick timer counts at 10 MHz from 0 to CCMP. if it has wrapped and the
+// interrupt is still pending, then the tick count is one behind, and the
+// timer count is read again in case it wrapped after the first read
+uint16_t tmr_us(void)
+{
+    uint16_t ticks;
+    uint16_t cnt;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        ticks = systick;
+        cnt = TCB0.CNT;
+        if (TCB0.INTFLAGS & TCB_CAPT_bm)
+        {
+            cnt = TCB0.CNT;
+            ++ticks;
+        }
+    }
+    return (ticks * 1000U) + (cnt / 10U);
+}
+
 // set a timer. max millisec is 32767
 uint16_t tmr_set(uint16_t millisec)
 {
@@ -71,6 +71,25 @@ extern uint16_t tmr_set(uint16_t duration);
  */
 extern bool tmr_expired(uint16_t tmrset);
 
+/**
+ * Get the system tick count.
+ *
+ * @return the number of milliseconds since tmr_init(), which wraps around
+ *         at 16 bits
+ */
+extern uint16_t tmr_ms(void);
+
+/**
+ * Get a timestamp with microsecond resolution.
+ *
+ * The value is the system tick count in microseconds, plus the count of the
+ * tick timer. It wraps around every 65.536 ms, so it is only useful for
+ * measuring short times as the difference between two timestamps.
+ *
+ * @return the microsecond timestamp
+ */
+extern uint16_t tmr_us(void);
+
 /**
  * Schedule a timer for processing.
  *
@@ -10,6 +10,8 @@ extern uint8_t eeprom_read_byte(const uint8_t *);
 extern uint32_t eeprom_read_dword(const uint32_t *);
 extern void eeprom_read_block(void *, const void *, size_t);
 extern void eeprom_update_block(const void *, void *, size_t);
+extern void eeprom_update_byte(uint8_t *, uint8_t);
+extern int eeprom_is_ready(void);
 
 #ifdef __cplusplus
 }
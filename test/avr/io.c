@@ -11,10 +11,12 @@ PORT_t PORTB;
 USART_t USART0;
 RSTCTRL_t RSTCTRL;
 TCB_t TCB0;
+TCB_t TCB1;
 TCA_t TCA0;
 ADC_t ADC0;
 ADC_t ADC1;
 VREF_t VREF;
+EVSYS_t EVSYS;
 
 /*volatile uint8_t MCUSR = 0;
 volatile uint8_t PRR = 0;
@@ -2205,7 +2205,8 @@ extern VREF_t VREF;
 #define CPUINT             (*(CPUINT_t *) 0x0110) /* Interrupt Controller */
 #define CRCSCAN           (*(CRCSCAN_t *) 0x0120) /* CRCSCAN */
 #define RTC                   (*(RTC_t *) 0x0140) /* Real-Time Counter */
-#define EVSYS               (*(EVSYS_t *) 0x0180) /* Event System */
+//#define EVSYS               (*(EVSYS_t *) 0x0180) /* Event System */
+extern EVSYS_t EVSYS;
 #define CCL                   (*(CCL_t *) 0x01C0) /* Configurable Custom Logic */
 #define PORTMUX           (*(PORTMUX_t *) 0x0200) /* Port Multiplexer */
 // #define PORTA                (*(PORT_t *) 0x0400) /* I/O Ports */
@@ -2230,7 +2231,8 @@ extern USART_t USART0;
 extern TCA_t TCA0;
 //#define TCB0                  (*(TCB_t *) 0x0A40) /* 16-bit Timer Type B */
 extern TCB_t TCB0;
-#define TCB1                  (*(TCB_t *) 0x0A50) /* 16-bit Timer Type B */
+//#define TCB1                  (*(TCB_t *) 0x0A50) /* 16-bit Timer Type B */
+extern TCB_t TCB1;
 #define TCD0                  (*(TCD_t *) 0x0A80) /* Timer Counter D */
 #define SYSCFG             (*(SYSCFG_t *) 0x0F00) /* System Configuration Registers */
 #define NVMCTRL           (*(NVMCTRL_t *) 0x1000) /* Non-volatile Memory Controller */
@@ -5264,7 +5266,7 @@ extern TCB_t TCB0;
 
 /* TCB1 interrupt vectors */
 #define TCB1_INT_vect_num  14
-#define TCB1_INT_vect      _VECTOR(14)  /*  */
+//#define TCB1_INT_vect      _VECTOR(14)  /*  */
 
 /* TCD0 interrupt vectors */
 #define TCD0_OVF_vect_num  15
@@ -48,12 +48,20 @@ extern "C" {
 
 FAKE_VALUE_FUNC(bool, cfg_load);
 FAKE_VALUE_FUNC(uint8_t, cfg_board_type);
+FAKE_VALUE_FUNC(bool, cfg_is_dirty);
+FAKE_VOID_FUNC(cfg_store);
+FAKE_VOID_FUNC(cfg_run);
+FAKE_VALUE_FUNC(bool, cfg_is_active);
 FAKE_VALUE_FUNC(bool, cmd_process);
 FAKE_VALUE_FUNC(uint8_t, cmd_get_last);
+FAKE_VALUE_FUNC(bool, cmd_is_active);
+FAKE_VOID_FUNC(baud_init, uint16_t);
+FAKE_VOID_FUNC(baud_recheck);
 FAKE_VALUE_FUNC(bool, pkt_is_active);
 FAKE_VOID_FUNC(pkt_reset);
 FAKE_VOID_FUNC(pkt_rx_free, packet_t *);
 FAKE_VOID_FUNC(ser_flush);
+FAKE_VOID_FUNC(ser_rx_run);
 FAKE_VALUE_FUNC(bool, ser_is_active);
 FAKE_VOID_FUNC(set_sleep_mode);
 FAKE_VOID_FUNC(sleep_mode);
@@ -0,0 +1,332 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <avr/io.h>
+
+#include "catch.hpp"
+#include "baud.h"
+
+extern "C" void TCB1_INT_vect(void);
+
+// simulate a captured period in the timer
+// there is no interrupt if the measurement is stopped
+static void capture(uint16_t period)
+{
+    TCB1.CCMP = period;
+    if ((TCB1.CTRLA & TCB_ENABLE_bm) && (TCB1.INTCTRL & TCB_CAPT_bm))
+    {
+        TCB1_INT_vect();
+    }
+}
+
+// feed a preamble with the specified average period, in units of 1/8
+// timer count, so that the captures have realistic jitter
+static void preamble(uint32_t period8, unsigned int count)
+{
+    uint32_t edge = 0;
+    uint16_t last = 0;
+    for (unsigned int idx = 0; idx < count; ++idx)
+    {
+        edge += period8;
+        uint16_t now = (edge + 4) / 8;
+        capture(now - last);
+        last = now;
+    }
+}
+
+TEST_CASE("baud init")
+{
+    USART0.BAUD = 0;
+    EVSYS.ASYNCCH0 = 0;
+    EVSYS.ASYNCUSER11 = 0;
+    TCB1.CTRLA = 0;
+    TCB1.CTRLB = 0;
+    TCB1.EVCTRL = 0;
+    TCB1.INTCTRL = 0;
+
+    baud_init(4167);
+    CHECK(USART0.BAUD == 4167);
+    CHECK(EVSYS.ASYNCCH0 == EVSYS_ASYNCCH0_PORTA_PIN1_gc);
+    CHECK(EVSYS.ASYNCUSER11 == EVSYS_ASYNCUSER11_ASYNCCH0_gc);
+    CHECK(TCB1.CTRLB == TCB_CNTMODE_FRQ_gc);
+    CHECK(TCB1.EVCTRL == (TCB_CAPTEI_bm | TCB_EDGE_bm | TCB_FILTER_bm));
+    CHECK(TCB1.INTCTRL == TCB_CAPT_bm);
+    CHECK(TCB1.CTRLA == TCB_ENABLE_bm);
+    CHECK_FALSE(baud_is_locked());
+}
+
+TEST_CASE("baud lock")
+{
+    baud_init(4167);
+    REQUIRE_FALSE(baud_is_locked());
+
+    SECTION("9600")
+    {
+        // 10 MHz / 9600 * 2 = 2083.3 counts
+        preamble(16667, BAUD_LOCK_CNT - 1);
+        CHECK_FALSE(baud_is_locked());
+        CHECK(USART0.BAUD == 4167); // unchanged until locked
+        preamble(16667, 1);
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD >= 4166);
+        CHECK(USART0.BAUD <= 4167);
+        // timer is stopped
+        CHECK(TCB1.CTRLA == 0);
+        CHECK(TCB1.INTCTRL == 0);
+    }
+
+    SECTION("57600")
+    {
+        // 10 MHz / 57600 * 2 = 347.2 counts
+        preamble(2778, BAUD_LOCK_CNT);
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD >= 694);
+        CHECK(USART0.BAUD <= 695);
+    }
+
+    SECTION("115200")
+    {
+        // 10 MHz / 115200 * 2 = 173.6 counts
+        preamble(1389, BAUD_LOCK_CNT);
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD >= 347);
+        CHECK(USART0.BAUD <= 348);
+    }
+
+    SECTION("bogus first capture")
+    {
+        // first capture after timer enabled is a partial period
+        capture(100);
+        preamble(2778, BAUD_LOCK_CNT);
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD >= 694);
+        CHECK(USART0.BAUD <= 695);
+    }
+
+    SECTION("inconsistent period restarts")
+    {
+        preamble(2778, BAUD_LOCK_CNT - 1);
+        // double period, like the start of the sync byte
+        capture(694);
+        CHECK_FALSE(baud_is_locked());
+        // the double period started a new run, which does not match
+        preamble(2778, 1);
+        CHECK_FALSE(baud_is_locked());
+        preamble(2778, BAUD_LOCK_CNT);
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD >= 694);
+        CHECK(USART0.BAUD <= 695);
+    }
+
+    SECTION("out of range periods")
+    {
+        for (unsigned int idx = 0; idx < (2 * BAUD_LOCK_CNT); ++idx)
+        {
+            capture(10);
+        }
+        CHECK_FALSE(baud_is_locked());
+        for (unsigned int idx = 0; idx < (2 * BAUD_LOCK_CNT); ++idx)
+        {
+            capture(60000);
+        }
+        CHECK_FALSE(baud_is_locked());
+        CHECK(USART0.BAUD == 4167);
+    }
+
+    SECTION("search again")
+    {
+        preamble(1389, BAUD_LOCK_CNT);
+        REQUIRE(baud_is_locked());
+        baud_search();
+        CHECK_FALSE(baud_is_locked());
+        CHECK(TCB1.INTCTRL == TCB_CAPT_bm);
+        CHECK(TCB1.CTRLA == TCB_ENABLE_bm);
+        // rate is kept until next lock
+        CHECK(USART0.BAUD >= 347);
+        CHECK(USART0.BAUD <= 348);
+        preamble(16667, BAUD_LOCK_CNT);
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD >= 4166);
+        CHECK(USART0.BAUD <= 4167);
+    }
+}
+
+TEST_CASE("baud recheck")
+{
+    baud_init(4167);
+    REQUIRE_FALSE(baud_is_locked());
+
+    SECTION("not locked yet")
+    {
+        // same as a search if there is no data rate yet
+        baud_recheck();
+        CHECK_FALSE(baud_is_locked());
+        CHECK(TCB1.CTRLA == TCB_ENABLE_bm);
+    }
+
+    SECTION("stays locked while measuring")
+    {
+        preamble(2778, BAUD_LOCK_CNT);
+        REQUIRE(baud_is_locked());
+        baud_recheck();
+        CHECK(baud_is_locked());
+        CHECK(TCB1.INTCTRL == TCB_CAPT_bm);
+        CHECK(TCB1.CTRLA == TCB_ENABLE_bm);
+        CHECK(USART0.BAUD >= 694);
+        CHECK(USART0.BAUD <= 695);
+
+        // new rate is programmed when measured
+        preamble(16667, BAUD_LOCK_CNT);
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD >= 4166);
+        CHECK(USART0.BAUD <= 4167);
+        CHECK(TCB1.CTRLA == 0);
+    }
+
+    SECTION("after set")
+    {
+        CHECK(baud_set(57600));
+        baud_recheck();
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD == 694);
+    }
+}
+
+TEST_CASE("baud rx events")
+{
+    baud_init(4167);
+    preamble(2778, BAUD_LOCK_CNT);
+    REQUIRE(baud_is_locked());
+
+    SECTION("sync stops a recheck")
+    {
+        baud_recheck();
+        REQUIRE(TCB1.CTRLA == TCB_ENABLE_bm);
+        baud_rx_sync();
+        CHECK(baud_is_locked());
+        CHECK(TCB1.CTRLA == 0);
+        CHECK(TCB1.INTCTRL == 0);
+
+        // packet bytes that look like a preamble do not change the rate
+        preamble(16667, BAUD_LOCK_CNT);
+        CHECK(USART0.BAUD >= 694);
+        CHECK(USART0.BAUD <= 695);
+    }
+
+    SECTION("sync does not stop a search")
+    {
+        baud_search();
+        baud_rx_sync();
+        CHECK(TCB1.CTRLA == TCB_ENABLE_bm);
+    }
+
+    SECTION("errors in a row start a search")
+    {
+        for (int i = 1; i < BAUD_ERR_CNT; ++i)
+        {
+            baud_rx_error();
+        }
+        CHECK(baud_is_locked());
+        baud_rx_error();
+        CHECK_FALSE(baud_is_locked());
+        CHECK(TCB1.CTRLA == TCB_ENABLE_bm);
+        CHECK(TCB1.INTCTRL == TCB_CAPT_bm);
+
+        // not counted while searching, the search is not restarted
+        preamble(16667, BAUD_LOCK_CNT / 2);
+        for (int i = 0; i < BAUD_ERR_CNT; ++i)
+        {
+            baud_rx_error();
+        }
+        preamble(16667, BAUD_LOCK_CNT / 2 + 1);
+        CHECK(baud_is_locked());
+        CHECK(USART0.BAUD >= 4166);
+        CHECK(USART0.BAUD <= 4167);
+    }
+
+    SECTION("good packet clears the errors")
+    {
+        for (int i = 1; i < BAUD_ERR_CNT; ++i)
+        {
+            baud_rx_error();
+        }
+        baud_rx_good();
+        for (int i = 1; i < BAUD_ERR_CNT; ++i)
+        {
+            baud_rx_error();
+        }
+        CHECK(baud_is_locked());
+    }
+}
+
+TEST_CASE("baud set")
+{
+    baud_init(4167);
+    REQUIRE_FALSE(baud_is_locked());
+
+    SECTION("valid rate")
+    {
+        CHECK(baud_set(115200));
+        CHECK(USART0.BAUD == 347);
+        CHECK(baud_is_locked());
+        // search is stopped
+        CHECK(TCB1.CTRLA == 0);
+        CHECK(TCB1.INTCTRL == 0);
+    }
+
+    SECTION("out of range")
+    {
+        CHECK_FALSE(baud_set(0));
+        CHECK_FALSE(baud_set(700000)); // BAUD < 64
+        CHECK_FALSE(baud_set(600)); // BAUD > 65535
+        CHECK(USART0.BAUD == 4167);
+        CHECK_FALSE(baud_is_locked());
+    }
+
+    SECTION("restore default")
+    {
+        CHECK(baud_set(57600));
+        CHECK(USART0.BAUD == 694);
+        baud_search();
+        CHECK_FALSE(baud_is_locked());
+        baud_restore();
+        CHECK(USART0.BAUD == 4167);
+        CHECK(baud_is_locked());
+        CHECK(TCB1.CTRLA == 0);
+    }
+
+    SECTION("restore keeps the autobaud rate")
+    {
+        preamble(8 * 347 / 2, BAUD_LOCK_CNT);
+        REQUIRE(baud_is_locked());
+        REQUIRE(USART0.BAUD == 347);
+        CHECK(baud_set(57600));
+        CHECK(USART0.BAUD == 694);
+        baud_restore();
+        CHECK(USART0.BAUD == 347);
+    }
+}
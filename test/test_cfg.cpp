@@ -42,7 +42,8 @@ extern "C" {
 // mock functions for eeprom operations
 FAKE_VALUE_FUNC(uint8_t, eeprom_read_byte, const uint8_t *);
 FAKE_VALUE_FUNC(uint32_t, eeprom_read_dword, const uint32_t *);
-FAKE_VOID_FUNC(eeprom_update_block, const void *, void *, size_t);
+FAKE_VOID_FUNC(eeprom_update_byte, uint8_t *, uint8_t);
+FAKE_VALUE_FUNC(int, eeprom_is_ready);
 FAKE_VOID_FUNC(eeprom_read_block, void *, const void *, size_t);
 
 // fake eeprom locations defined in cfg.c for unit testing
@@ -54,7 +55,7 @@ extern uint8_t fake_type;
 // reading eeprom. And this test used the fff to fake out the eeprom
 // read functions. But with the '1614, it can read the eeprom as memory
 // mapped so eeprom read functions are no longer needed.
-// eeprom_update_block is still used though, for writing
+// eeprom_update_byte is still used though, for writing
 
 }
 
@@ -95,17 +96,12 @@ static void eeprom_read_block_custom_fake(void *dst, const void *src, size_t cnt
     }
 }
 
-static void eeprom_update_block_custom_fake(const void *src, void *dst, size_t cnt)
+static void eeprom_update_byte_custom_fake(uint8_t *dst, uint8_t val)
 {
     // dst is really address within eeprom
     size_t eeaddr = (size_t)dst;
-    CHECK((cnt + eeaddr) < sizeof(eeprom_data));
-    uint8_t *pto = &eeprom_data[eeaddr];
-    uint8_t *pfrom = (uint8_t *)src;
-    for (size_t i = 0; i < cnt; ++i)
-    {
-        pto[i] = pfrom[i];
-    }
+    CHECK(eeaddr < sizeof(eeprom_data));
+    eeprom_data[eeaddr] = val;
 }
 
 // nominal config struct
@@ -114,13 +110,13 @@ static void eeprom_update_block_custom_fake(const void *src, void *dst, size_t c
 // len, type, addr,
 // vscale, voffset, tscale, toffset, xscale, xoffset, 
 // shunton, shuntoff, shunttime, temphi, templo, tempadj,
-// crc
+// groups, crc
 static config_t testcfg =
 {
-    26, 2, 99,
+    28, 3, 99,
     1234, 5678, 4321, 7865, 5555, -9000,
     32767, 32768, 65535, 120, -100, 10000,
-    0x9A
+    0x0005, 0x76
 };
 
 // TODO update tests to check all the new field values
@@ -142,10 +138,39 @@ TEST_CASE("Load cfg")
         CHECK(eeprom_read_block_fake.arg1_val == 0);
         CHECK(eeprom_read_block_fake.arg2_val == sizeof(config_t));
         CHECK(g_cfg_parms.len == sizeof(config_t));
-        CHECK(g_cfg_parms.type == 2);
+        CHECK(g_cfg_parms.type == 3);
         CHECK(g_cfg_parms.addr == 99);
-        CHECK(g_cfg_parms.crc == 0x9A);
+        CHECK(g_cfg_parms.crc == 0x76);
         CHECK(g_cfg_parms.vscale == 1234);
+        CHECK(g_cfg_parms.groups == 5);
+        CHECK_FALSE(cfg_is_dirty());
+    }
+
+    SECTION("v2 block is upgraded")
+    {
+        // v2 block is the same without groups, crc is where groups is now
+        eecfg->len = sizeof(config_t) - 2;
+        eecfg->type = 2;
+        eeprom_data[eecfg->len - 1] = 0x9A;
+        eeprom_data[eecfg->len] = 0xFF; // whatever is after the block
+        bool ret = cfg_load();
+        CHECK(ret);
+        CHECK(g_cfg_parms.addr == 99);
+        CHECK(g_cfg_parms.tempadj == 10000);
+        CHECK(g_cfg_parms.groups == 0);
+        // stored as v3 next time
+        CHECK(cfg_is_dirty());
+    }
+
+    SECTION("v2 block with bad crc")
+    {
+        eecfg->len = sizeof(config_t) - 2;
+        eecfg->type = 2;
+        eeprom_data[eecfg->len - 1] = 0x9B;
+        bool ret = cfg_load();
+        CHECK_FALSE(ret);
+        CHECK(g_cfg_parms.addr == 0);
+        CHECK(g_cfg_parms.groups == 0);
     }
 
     SECTION("bad length")
@@ -181,7 +206,7 @@ TEST_CASE("Load cfg")
 
     SECTION("bad crc")
     {
-        eecfg->type = 2; // restore correct value
+        eecfg->type = 3; // restore correct value
         eecfg->crc++;
         bool ret = cfg_load();
         CHECK_FALSE(ret);
@@ -200,8 +225,9 @@ TEST_CASE("Store cfg")
     // copy test config data into cfg global config, which will be stored
     memcpy(&g_cfg_parms, &testcfg, sizeof(config_t));
 
-    RESET_FAKE(eeprom_update_block);
-    eeprom_update_block_fake.custom_fake = eeprom_update_block_custom_fake;
+    RESET_FAKE(eeprom_update_byte);
+    RESET_FAKE(eeprom_is_ready);
+    eeprom_update_byte_fake.custom_fake = eeprom_update_byte_custom_fake;
     // clear out the eeprom store
     memset(eeprom_data, 0xFF, sizeof(config_t));
     config_t *eecfg = (config_t *)eeprom_data;  // map config over eeprom data
@@ -209,20 +235,98 @@ TEST_CASE("Store cfg")
     // mess up stored crc to verify it was updated
     g_cfg_parms.crc = 0;
 
+    // store does not write, only starts the writer
+    eeprom_is_ready_fake.return_val = 1;
     cfg_store();
-    CHECK(eeprom_update_block_fake.call_count == 1);
-    CHECK(eeprom_update_block_fake.arg0_val == &g_cfg_parms);
-    CHECK(eeprom_update_block_fake.arg1_val == 0);
-    CHECK(eeprom_update_block_fake.arg2_val == sizeof(config_t));
-    CHECK(eecfg->len == sizeof(config_t));
-    CHECK(eecfg->type == 2);
-    CHECK(eecfg->addr == 99);
-    CHECK(eecfg->crc == 0x9A);
+    CHECK(eeprom_update_byte_fake.call_count == 0);
+    CHECK(cfg_is_active());
+
+    SECTION("one byte per pass")
+    {
+        cfg_run();
+        CHECK(eeprom_update_byte_fake.call_count == 1);
+        CHECK(eeprom_update_byte_fake.arg0_val == 0); // cfg at eeprom 0
+        CHECK(eeprom_update_byte_fake.arg1_val == sizeof(config_t));
+
+        // nothing written while eeprom is busy
+        eeprom_is_ready_fake.return_val = 0;
+        cfg_run();
+        cfg_run();
+        CHECK(eeprom_update_byte_fake.call_count == 1);
+        CHECK(cfg_is_active());
+        eeprom_is_ready_fake.return_val = 1;
+
+        for (unsigned i = 1; i < sizeof(config_t); ++i)
+        {
+            CHECK(cfg_is_active());
+            cfg_run();
+        }
+        CHECK(eeprom_update_byte_fake.call_count == sizeof(config_t));
+        CHECK(eecfg->len == sizeof(config_t));
+        CHECK(eecfg->type == 3);
+        CHECK(eecfg->addr == 99);
+        CHECK(eecfg->crc == 0x76);
+
+        // done when last byte is finished in the eeprom
+        eeprom_is_ready_fake.return_val = 0;
+        CHECK(cfg_is_active());
+        eeprom_is_ready_fake.return_val = 1;
+        CHECK_FALSE(cfg_is_active());
+
+        // no more writes
+        cfg_run();
+        CHECK(eeprom_update_byte_fake.call_count == sizeof(config_t));
+    }
+
+    SECTION("changes during the write are not mixed in")
+    {
+        cfg_run();
+        g_cfg_parms.addr = 42; // change after store
+        while (cfg_is_active())
+        {
+            cfg_run();
+        }
+        CHECK(eecfg->addr == 99);
+        CHECK(eecfg->crc == 0x76);
+    }
+
+    SECTION("store again restarts the write")
+    {
+        for (unsigned i = 0; i < 10; ++i)
+        {
+            cfg_run();
+        }
+        g_cfg_parms.addr = 42;
+        cfg_store();
+        while (cfg_is_active())
+        {
+            cfg_run();
+        }
+        CHECK(eeprom_update_byte_fake.call_count == 10 + sizeof(config_t));
+        CHECK(eecfg->addr == 42);
+    }
+
+    SECTION("reset")
+    {
+        cfg_reset();
+        // defaults are used right away
+        CHECK(g_cfg_parms.addr == 0);
+        CHECK(g_cfg_parms.vscale == 4400);
+        while (cfg_is_active())
+        {
+            cfg_run();
+        }
+        // stored block has bad crc so defaults will load
+        CHECK(eecfg->addr == 99);
+        CHECK(eecfg->crc == (uint8_t)~0x76);
+    }
 }
 
 TEST_CASE("Set cfg items")
 {
-    RESET_FAKE(eeprom_update_block);
+    // store to start with no changes pending
+    cfg_store();
+    RESET_FAKE(eeprom_update_byte);
     // clear the global config so we can verify items are set
     memset(&g_cfg_parms, 0, sizeof(g_cfg_parms));
 
@@ -238,7 +342,11 @@ TEST_CASE("Set cfg items")
         bool ret = cfg_set(sizeof(pld), pld);
         CHECK(ret);
         CHECK(g_cfg_parms.vscale == 4660);
-        CHECK(eeprom_update_block_fake.call_count == 1);
+        // only RAM config is changed until stored
+        CHECK(eeprom_update_byte_fake.call_count == 0);
+        CHECK(cfg_is_dirty());
+        cfg_store();
+        CHECK_FALSE(cfg_is_dirty());
     }
 
     SECTION("set temphi nominal")
@@ -247,7 +355,16 @@ TEST_CASE("Set cfg items")
         bool ret = cfg_set(sizeof(pld), pld);
         CHECK(ret);
         CHECK(g_cfg_parms.temphi == 104);
-        CHECK(eeprom_update_block_fake.call_count == 1);
+        CHECK(eeprom_update_byte_fake.call_count == 0);
+        CHECK(cfg_is_dirty());
+    }
+
+    SECTION("set groups")
+    {
+        uint8_t pld[] = { 14, 0x01, 0x20 }; // groups 240 and 253
+        bool ret = cfg_set(sizeof(pld), pld);
+        CHECK(ret);
+        CHECK(g_cfg_parms.groups == 0x2001);
     }
 
     SECTION("bad cfg id 0")
@@ -255,7 +372,7 @@ TEST_CASE("Set cfg items")
         uint8_t pld[] = { 0, 1, 2 };
         bool ret = cfg_set(sizeof(pld), pld);
         CHECK_FALSE(ret);
-        CHECK(eeprom_update_block_fake.call_count == 0);
+        CHECK(eeprom_update_byte_fake.call_count == 0);
     }
 
     SECTION("bad cfg id big")
@@ -263,7 +380,7 @@ TEST_CASE("Set cfg items")
         uint8_t pld[] = { 100, 1, 2 };
         bool ret = cfg_set(sizeof(pld), pld);
         CHECK_FALSE(ret);
-        CHECK(eeprom_update_block_fake.call_count == 0);
+        CHECK(eeprom_update_byte_fake.call_count == 0);
     }
 
     SECTION("parm size mismatch")
@@ -271,7 +388,7 @@ TEST_CASE("Set cfg items")
         uint8_t pld[] = { 2, 0x34 };
         bool ret = cfg_set(sizeof(pld), pld);
         CHECK_FALSE(ret);
-        CHECK(eeprom_update_block_fake.call_count == 0);
+        CHECK(eeprom_update_byte_fake.call_count == 0);
     }
 }
 
@@ -322,3 +439,141 @@ TEST_CASE("Get cfg items")
         CHECK(ret == 0);
     }
 }
+
+TEST_CASE("Set cfg range")
+{
+    cfg_store();
+    RESET_FAKE(eeprom_update_byte);
+    memset(&g_cfg_parms, 0, sizeof(g_cfg_parms));
+
+    // range payload is [ first id, count, values... ]
+
+    SECTION("set 2 to 4")
+    {
+        uint8_t pld[] = { 2, 3, 0x34, 0x12, 0xFE, 0xFF, 0x78, 0x56 };
+        bool ret = cfg_set_range(sizeof(pld), pld);
+        CHECK(ret);
+        CHECK(g_cfg_parms.vscale == 0x1234);
+        CHECK(g_cfg_parms.voffset == -2);
+        CHECK(g_cfg_parms.tscale == 0x5678);
+        CHECK(eeprom_update_byte_fake.call_count == 0);
+        CHECK(cfg_is_dirty());
+    }
+
+    SECTION("mixed size parms")
+    {
+        uint8_t pld[] = { 10, 3, 0x2C, 0x01, 60, 45 };
+        bool ret = cfg_set_range(sizeof(pld), pld);
+        CHECK(ret);
+        CHECK(g_cfg_parms.shunttime == 300);
+        CHECK(g_cfg_parms.temphi == 60);
+        CHECK(g_cfg_parms.templo == 45);
+    }
+
+    SECTION("length mismatch changes nothing")
+    {
+        uint8_t pld[] = { 2, 3, 0x34, 0x12, 0xFE, 0xFF, 0x78 };
+        bool ret = cfg_set_range(sizeof(pld), pld);
+        CHECK_FALSE(ret);
+        CHECK(g_cfg_parms.vscale == 0);
+        CHECK_FALSE(cfg_is_dirty());
+    }
+
+    SECTION("bad ranges")
+    {
+        uint8_t pld0[] = { 0, 1, 1 };
+        CHECK_FALSE(cfg_set_range(sizeof(pld0), pld0));
+        uint8_t pld1[] = { 14, 2, 1, 2, 3, 4, 5 }; // past the last id
+        CHECK_FALSE(cfg_set_range(sizeof(pld1), pld1));
+        uint8_t pld2[] = { 2, 0 };
+        CHECK_FALSE(cfg_set_range(sizeof(pld2), pld2));
+        uint8_t pld3[] = { 2 };
+        CHECK_FALSE(cfg_set_range(sizeof(pld3), pld3));
+        CHECK(eeprom_update_byte_fake.call_count == 0);
+    }
+}
+
+TEST_CASE("Get cfg range")
+{
+    memcpy(&g_cfg_parms, &testcfg, sizeof(config_t));
+
+    uint8_t pld[32];
+
+    SECTION("whole config")
+    {
+        pld[0] = 1;
+        pld[1] = 13;
+        uint8_t ret = cfg_get_range(sizeof(pld), pld);
+        CHECK(ret == 25); // 2 + 23 value bytes
+        CHECK(pld[1] == 13);
+        CHECK(pld[2] == testcfg.addr);
+        CHECK(pld[3] == (testcfg.vscale & 0xFF));
+        CHECK(pld[4] == (testcfg.vscale >> 8));
+        CHECK(pld[21] == 120); // temphi
+        CHECK(pld[24] == (testcfg.tempadj >> 8));
+    }
+
+    SECTION("buffer holds part of range")
+    {
+        pld[0] = 2;
+        pld[1] = 5;
+        uint8_t ret = cfg_get_range(9, pld); // room for 3 parms
+        CHECK(ret == 8);
+        CHECK(pld[1] == 3);
+        CHECK(pld[6] == (testcfg.tscale & 0xFF));
+        CHECK(pld[7] == (testcfg.tscale >> 8));
+    }
+
+    SECTION("buffer too small")
+    {
+        pld[0] = 2;
+        pld[1] = 1;
+        CHECK(cfg_get_range(3, pld) == 0);
+    }
+
+    SECTION("bad ranges")
+    {
+        pld[0] = 0;
+        pld[1] = 2;
+        CHECK(cfg_get_range(sizeof(pld), pld) == 0);
+        pld[0] = 13;
+        pld[1] = 3;
+        CHECK(cfg_get_range(sizeof(pld), pld) == 0);
+        pld[0] = 1;
+        pld[1] = 0;
+        CHECK(cfg_get_range(sizeof(pld), pld) == 0);
+    }
+}
+
+TEST_CASE("Config crc")
+{
+    memcpy(&g_cfg_parms, &testcfg, sizeof(config_t));
+
+    // crc of the parameter values from GETPARMS, without ADDR and GROUPS
+    uint8_t pld[32] = { 2, 12 };
+    uint8_t len = cfg_get_range(sizeof(pld), pld);
+    REQUIRE(len == 24); // 2 + 22 value bytes
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 2; i < len; ++i)
+    {
+        crc = _crc_ccitt_update(crc, pld[i]);
+    }
+    CHECK(cfg_crc() == crc);
+
+    SECTION("address and groups do not change it")
+    {
+        g_cfg_parms.addr = 42;
+        CHECK(cfg_crc() == crc);
+        g_cfg_parms.groups = 0x1234;
+        CHECK(cfg_crc() == crc);
+    }
+
+    SECTION("parameters change it")
+    {
+        g_cfg_parms.shuntmax = 4150;
+        CHECK(cfg_crc() != crc);
+        g_cfg_parms.shuntmax = testcfg.shuntmax;
+        g_cfg_parms.tempadj = 0;
+        CHECK(cfg_crc() != crc);
+    }
+}
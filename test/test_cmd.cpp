@@ -32,6 +32,7 @@
 #include "catch.hpp"
 #include "pkt.h"
 #include "cmd.h"
+#include "stats.h"
 #include "cfg.h"
 #include "ver.h"
 #include "util/crc16.h"
@@ -52,6 +53,10 @@ FAKE_VOID_FUNC(pkt_rx_free, packet_t *);
 FAKE_VALUE_FUNC(bool, pkt_send, uint8_t, uint8_t, uint8_t, uint8_t *, uint8_t);
 FAKE_VALUE_FUNC(bool, pkt_is_active);
 FAKE_VOID_FUNC(pkt_reset);
+FAKE_VALUE_FUNC(bool, pkt_resend);
+FAKE_VALUE_FUNC(uint8_t, pkt_rx_count);
+FAKE_VALUE_FUNC(bool, pkt_rx_abort);
+FAKE_VALUE_FUNC(uint8_t, pkt_tx_hwm);
 
 FAKE_VALUE_FUNC(uint16_t, tmr_set, uint16_t);
 FAKE_VALUE_FUNC(bool, tmr_expired, uint16_t);
@@ -62,6 +67,12 @@ FAKE_VOID_FUNC(cfg_store);
 FAKE_VOID_FUNC(cfg_reset);
 FAKE_VALUE_FUNC(bool, cfg_set,  uint8_t, uint8_t *);
 FAKE_VALUE_FUNC(uint8_t, cfg_get, uint8_t, uint8_t *);
+FAKE_VALUE_FUNC(bool, cfg_set_range,  uint8_t, uint8_t *);
+FAKE_VALUE_FUNC(uint8_t, cfg_get_range, uint8_t, uint8_t *);
+FAKE_VALUE_FUNC(bool, cfg_is_dirty);
+FAKE_VALUE_FUNC(uint16_t, cfg_crc);
+FAKE_VOID_FUNC(cfg_run);
+FAKE_VALUE_FUNC(bool, cfg_is_active);
 
 FAKE_VALUE_FUNC(uint16_t*, adc_get_raw);
 FAKE_VALUE_FUNC(uint16_t, adc_get_cellmv);
@@ -73,9 +84,21 @@ FAKE_VALUE_FUNC(uint8_t, shunt_get_pwm);
 FAKE_VOID_FUNC(testmode_off);
 FAKE_VOID_FUNC(testmode_on, testmode_status_t, uint8_t, uint8_t);
 
+FAKE_VALUE_FUNC(bool, baud_set, uint32_t);
+FAKE_VOID_FUNC(baud_restore);
+
 // this normally exists in the cfg module. fake it here
 config_t g_cfg_parms;
 
+// outgoing payload buffer normally provided by packet module
+// set test_txq_full to act like the TX queue is full
+static uint8_t test_txbuf[PKT_PAYLOAD_LEN];
+static bool test_txq_full = false;
+uint8_t *pkt_tx_buf(void)
+{
+    return test_txq_full ? NULL : test_txbuf;
+}
+
 }
 
 // NOTE about packets returned by pkt_ready(). We do not need test cases
@@ -476,6 +499,17 @@ TEST_CASE("ADDR command")
         CHECK(pkt_send_payload[2] == 0x56);
         CHECK(pkt_send_payload[3] == 0xab);
     }
+
+    SECTION("group address is not a node address")
+    {
+        packet_t pkt = { 0, PKT_ADDR_GROUP, CMD_ADDR, 4, { 0x12, 0x34, 0x56, 0xAB } };
+        pkt_ready_fake.return_val = &pkt;
+        cfg_uid_fake.return_val = 0xab563412;
+        bool ret = cmd_process();
+        CHECK_FALSE(ret);
+        CHECK_FALSE(cfg_set_fake.call_count);
+        CHECK_FALSE(pkt_send_fake.call_count);
+    }
 }
 
 TEST_CASE("STATUS command")
@@ -614,6 +648,41 @@ TEST_CASE("STATUS command")
         CHECK(pkt_send_payload[8] == 0xE7);
         CHECK(pkt_send_payload[9] == 0xFF);
     }
+
+    SECTION("field mask")
+    {
+        adc_get_cellmv_fake.return_val = 3456;
+        int16_t temp_rets[3] = { 31, 32, 33 };
+        SET_RETURN_SEQ(adc_get_tempC, temp_rets, 3);
+        RESET_FAKE(shunt_get_pwm);
+        shunt_get_pwm_fake.return_val = 77;
+
+        // only cell voltage
+        pkt.len = 1;
+        pkt.payload[0] = STATUS_MV;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg2_val == CMD_STATUS);
+        CHECK(pkt_send_payload_len == 2);
+        CHECK(pkt_send_payload[0] == 0x80);
+        CHECK(pkt_send_payload[1] == 0x0D);
+
+        // pwm and mcu temp, in STATUS order
+        SET_RETURN_SEQ(adc_get_tempC, temp_rets, 3);
+        pkt.payload[0] = STATUS_TMCU | STATUS_PWM;
+        ret = cmd_process();
+        CHECK(ret);
+        CHECK(pkt_send_payload_len == 3);
+        CHECK(pkt_send_payload[0] == 77);
+        CHECK(pkt_send_payload[1] == 0x21);
+        CHECK(pkt_send_payload[2] == 0);
+
+        // mask 0 is all fields
+        pkt.payload[0] = 0;
+        ret = cmd_process();
+        CHECK(pkt_send_payload_len == 10);
+    }
 }
 
 TEST_CASE("ADCRAW command")
@@ -673,7 +742,7 @@ TEST_CASE("ADCRAW command")
     }
 }
 
-TEST_CASE("DFU command")
+TEST_CASE("MTU command")
 {
     g_cfg_parms = { 0, 0, 0, 0 };
 
@@ -681,8 +750,6 @@ TEST_CASE("DFU command")
     RESET_FAKE(pkt_send);
     RESET_FAKE(pkt_rx_free);
 
-    RSTCTRL.SWRR = 0;   // software reset register
-
     // reset the payload capture from pkt_send
     memset(pkt_send_payload, 0, 64);
     pkt_send_payload_len = 0;
@@ -691,20 +758,1660 @@ TEST_CASE("DFU command")
 
     g_cfg_parms.addr = 1; // device addr 1
 
-    packet_t pkt = { 0, 1, CMD_DFU, 0 };
+    packet_t pkt = { 0, 1, CMD_MTU, 0 };
     pkt_ready_fake.return_val = &pkt;
     pkt_send_fake.return_val = true;
 
-    SECTION("DFU to this node")
+    SECTION("mtu and buffer depths")
     {
-        // send the command packet
         bool ret = cmd_process();
-        CHECK(pkt_ready_fake.call_count == 1);
-        CHECK_FALSE(ret); // DFU command returns false no matter what
+        CHECK(ret);
 
-        // should have called swreset()
-        CHECK(RSTCTRL.SWRR == 1);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg0_val == PKT_FLAG_REPLY);
+        CHECK(pkt_send_fake.arg1_val == 1); // pkt addr
+        CHECK(pkt_send_fake.arg2_val == CMD_MTU);
+        CHECK(pkt_send_fake.arg4_val == 3);
 
-        // TODO: check all the register?? probably not necessary
+        CHECK(pkt_send_payload_len == 3);
+        CHECK(pkt_send_payload[0] == PKT_PAYLOAD_LEN);
+        CHECK(pkt_send_payload[1] == PKT_RX_POOL_DEPTH);
+        CHECK(pkt_send_payload[2] == PKT_TX_QUEUE_DEPTH);
+    }
+
+    SECTION("no reply when TX queue is full")
+    {
+        test_txq_full = true;
+        bool ret = cmd_process();
+        test_txq_full = false;
+        CHECK_FALSE(ret);
+        CHECK(pkt_send_fake.call_count == 0);
+        CHECK(pkt_rx_free_fake.call_count == 1);
+    }
+}
+
+TEST_CASE("GETSTATS command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+
+    // reset the payload capture from pkt_send
+    memset(pkt_send_payload, 0, 64);
+    pkt_send_payload_len = 0;
+
+    pkt_send_fake.custom_fake = pkt_send_custom_fake;
+    pkt_send_fake.return_val = true;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    // put some counts in the statistics
+    stats_clear();
+    for (int i = 0; i < 300; ++i)
+    {
+        stats_inc(STATS_RX_PKT);
+        stats_inc(STATS_CRC_ERR);
+    }
+    stats_inc(STATS_TX_PKT);
+    stats_inc(STATS_LEN_ERR);
+    stats_inc(STATS_NOBUF);
+    stats_inc(STATS_NOBUF);
+    stats_inc(STATS_FRAME_ERR);
+    stats_inc(STATS_OVERRUN);
+    stats_inc(STATS_RX_OVERFLOW);
+    stats_inc(STATS_PKT_TIMEOUT);
+
+    SECTION("read counters")
+    {
+        packet_t pkt = { 0, 1, CMD_GETSTATS, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg0_val == PKT_FLAG_REPLY);
+        CHECK(pkt_send_fake.arg1_val == 1);
+        CHECK(pkt_send_fake.arg2_val == CMD_GETSTATS);
+        CHECK(pkt_send_payload_len == 12);
+        CHECK(pkt_send_payload[0] == 0x2C); // 300 little endian
+        CHECK(pkt_send_payload[1] == 0x01);
+        CHECK(pkt_send_payload[2] == 1);
+        CHECK(pkt_send_payload[3] == 0);
+        CHECK(pkt_send_payload[4] == 255); // saturated
+        CHECK(pkt_send_payload[5] == 1);
+        CHECK(pkt_send_payload[6] == 2);
+        CHECK(pkt_send_payload[7] == 1);
+        CHECK(pkt_send_payload[8] == 1);
+        CHECK(pkt_send_payload[9] == 1);
+        CHECK(pkt_send_payload[10] == 1);
+        CHECK(pkt_send_payload[11] == 0); // config not dirty
+
+        // not cleared
+        CHECK(stats_get(STATS_CRC_ERR) == 300);
+    }
+
+    SECTION("config dirty flag")
+    {
+        RESET_FAKE(cfg_is_dirty);
+        cfg_is_dirty_fake.return_val = true;
+        packet_t pkt = { 0, 1, CMD_GETSTATS, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_payload[11] == 1);
+        cfg_is_dirty_fake.return_val = false;
+    }
+
+    SECTION("TX queue high-water mark")
+    {
+        RESET_FAKE(pkt_tx_hwm);
+        pkt_tx_hwm_fake.return_val = 3;
+        packet_t pkt = { 0, 1, CMD_GETSTATS, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_payload[11] == 0x30);
+
+        // saturated to 4 bits
+        pkt_tx_hwm_fake.return_val = 20;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 2);
+        CHECK(pkt_send_payload[11] == 0xF0);
+        pkt_tx_hwm_fake.return_val = 0;
+    }
+
+    SECTION("read and clear")
+    {
+        packet_t pkt = { 0, 1, CMD_GETSTATS, 1, { 1 } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        // reply has the values from before the clear
+        CHECK(pkt_send_payload[4] == 255);
+        CHECK(stats_get(STATS_CRC_ERR) == 0);
+        CHECK(stats_get(STATS_RX_PKT) == 0);
+    }
+
+    SECTION("packet timeout counted")
+    {
+        RESET_FAKE(pkt_is_active);
+        RESET_FAKE(pkt_reset);
+        RESET_FAKE(tmr_expired);
+        pkt_ready_fake.return_val = NULL;
+
+        // packet processor is busy, so timeout is started
+        pkt_is_active_fake.return_val = true;
+        cmd_process();
+        CHECK(stats_get(STATS_PKT_TIMEOUT) == 1);
+
+        // timeout expires without a packet
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        CHECK(pkt_reset_fake.call_count == 1);
+        CHECK(stats_get(STATS_PKT_TIMEOUT) == 2);
+        pkt_is_active_fake.return_val = false;
+        tmr_expired_fake.return_val = false;
+    }
+
+    SECTION("idle line abandons a packet")
+    {
+        RESET_FAKE(pkt_rx_count);
+        RESET_FAKE(pkt_rx_abort);
+        RESET_FAKE(tmr_expired);
+        RESET_FAKE(tmr_set);
+        pkt_ready_fake.return_val = NULL;
+        pkt_rx_abort_fake.return_val = true;
+
+        // bytes are arriving, so the idle timeout is restarted
+        pkt_rx_count_fake.return_val = 20;
+        cmd_process();
+        CHECK(tmr_set_fake.call_count == 1);
+        CHECK(tmr_set_fake.arg0_val == PKT_IDLE_MS);
+        CHECK(pkt_rx_abort_fake.call_count == 0);
+
+        // no new bytes, but not timed out yet
+        cmd_process();
+        CHECK(pkt_rx_abort_fake.call_count == 0);
+
+        // a new byte restarts the timeout even if it had expired
+        tmr_expired_fake.return_val = true;
+        pkt_rx_count_fake.return_val = 21;
+        cmd_process();
+        CHECK(tmr_set_fake.call_count == 2);
+        CHECK(pkt_rx_abort_fake.call_count == 0);
+
+        // line is idle after the timeout, packet is abandoned
+        cmd_process();
+        CHECK(pkt_rx_abort_fake.call_count == 1);
+        CHECK(stats_get(STATS_PKT_TIMEOUT) == 2);
+
+        // nothing more to abandon, nothing counted
+        pkt_rx_abort_fake.return_val = false;
+        cmd_process();
+        CHECK(stats_get(STATS_PKT_TIMEOUT) == 2);
+        tmr_expired_fake.return_val = false;
+    }
+}
+
+// capture each reply packet payload for commands that send more than one
+static uint8_t batch_payload_len[4];
+static uint8_t batch_payload[4][64];
+
+static bool pkt_send_batch_fake(uint8_t flags, uint8_t nodeid, uint8_t cmd, uint8_t *ppld, uint8_t len)
+{
+    unsigned idx = pkt_send_fake.call_count - 1;
+    if (idx < 4)
+    {
+        memcpy(batch_payload[idx], ppld, len);
+        batch_payload_len[idx] = len;
+    }
+    return pkt_send_fake.return_val;
+}
+
+// parameter value is the parameter id + 100, param 9 is invalid
+static uint8_t cfg_get_batch_fake(uint8_t len, uint8_t *buf)
+{
+    if (buf[0] == 9)
+    {
+        return 0;
+    }
+    buf[1] = buf[0] + 100;
+    return 2;
+}
+
+TEST_CASE("BATCH command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(cfg_get);
+    RESET_FAKE(adc_get_cellmv);
+    RESET_FAKE(adc_get_tempC);
+    RESET_FAKE(adc_get_raw);
+
+    memset(batch_payload, 0, sizeof(batch_payload));
+    memset(batch_payload_len, 0, sizeof(batch_payload_len));
+
+    pkt_send_fake.custom_fake = pkt_send_batch_fake;
+    pkt_send_fake.return_val = true;
+    cfg_get_fake.custom_fake = cfg_get_batch_fake;
+
+    adc_get_cellmv_fake.return_val = 3456;
+    adc_get_tempC_fake.return_val = 25;
+    uint16_t adcdata[4] = { 0x0102, 0x0304, 0x0506, 0x0708 };
+    adc_get_raw_fake.return_val = adcdata;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    SECTION("records packed into packets")
+    {
+        packet_t pkt = { 0, 1, CMD_BATCH, 5, { CMD_GETPARM, 1, CMD_GETPARM, 9, CMD_ADCRAW } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+
+        // 4 + 3 + 10 bytes does not fit, so 2 packets
+        REQUIRE(pkt_send_fake.call_count == 2);
+        CHECK(pkt_send_fake.arg0_history[0] == PKT_FLAG_REPLY);
+        CHECK(pkt_send_fake.arg1_history[0] == 1);
+        CHECK(pkt_send_fake.arg2_history[0] == CMD_BATCH);
+        CHECK(pkt_send_fake.arg2_history[1] == CMD_BATCH);
+
+        REQUIRE(batch_payload_len[0] == 7);
+        uint8_t rec1[7] = { CMD_GETPARM, 2, 1, 101, CMD_GETPARM, 1, 9 };
+        CHECK(memcmp(batch_payload[0], rec1, 7) == 0);
+
+        REQUIRE(batch_payload_len[1] == 10);
+        uint8_t rec2[10] = { CMD_ADCRAW, 8, 2, 1, 4, 3, 6, 5, 8, 7 };
+        CHECK(memcmp(batch_payload[1], rec2, 10) == 0);
+    }
+
+    SECTION("split across packets")
+    {
+        packet_t pkt = { 0, 1, CMD_BATCH, 3, { CMD_STATUS, CMD_GETPARM, 2 } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+
+        // status record fills the first packet
+        REQUIRE(pkt_send_fake.call_count == 2);
+        REQUIRE(batch_payload_len[0] == 12);
+        CHECK(batch_payload[0][0] == CMD_STATUS);
+        CHECK(batch_payload[0][1] == 10);
+        CHECK(batch_payload[0][2] == 0x80); // 3456 mV
+        CHECK(batch_payload[0][3] == 0x0D);
+        REQUIRE(batch_payload_len[1] == 4);
+        uint8_t rec[4] = { CMD_GETPARM, 2, 2, 102 };
+        CHECK(memcmp(batch_payload[1], rec, 4) == 0);
+    }
+
+    SECTION("unknown sub-command")
+    {
+        packet_t pkt = { 0, 1, CMD_BATCH, 4, { CMD_GETPARM, 3, 99, CMD_STATUS } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+
+        // batch stops at the unknown command
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(adc_get_cellmv_fake.call_count == 0);
+        REQUIRE(batch_payload_len[0] == 6);
+        uint8_t rec[6] = { CMD_GETPARM, 2, 3, 103, 99, 0 };
+        CHECK(memcmp(batch_payload[0], rec, 6) == 0);
+    }
+
+    SECTION("missing parameter id")
+    {
+        packet_t pkt = { 0, 1, CMD_BATCH, 1, { CMD_GETPARM } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        REQUIRE(batch_payload_len[0] == 2);
+        CHECK(batch_payload[0][0] == CMD_GETPARM);
+        CHECK(batch_payload[0][1] == 0);
+        CHECK(cfg_get_fake.call_count == 0);
+    }
+
+    SECTION("empty batch")
+    {
+        packet_t pkt = { 0, 1, CMD_BATCH, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg4_val == 0);
+    }
+
+    SECTION("TX queue full")
+    {
+        test_txq_full = true;
+        packet_t pkt = { 0, 1, CMD_BATCH, 1, { CMD_STATUS } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK_FALSE(ret);
+        CHECK(pkt_send_fake.call_count == 0);
+        test_txq_full = false;
+    }
+
+    cfg_get_fake.custom_fake = NULL;
+}
+
+// fake a config of 13 parms that are each 2 bytes, value is id + 100
+static uint8_t cfg_get_range_fake_parms(uint8_t len, uint8_t *buf)
+{
+    uint8_t first = buf[0];
+    uint8_t count = buf[1];
+    if ((first < 1) || (count == 0) || ((first + count - 1) > 13))
+    {
+        return 0;
+    }
+    uint8_t n = 0;
+    while ((n < count) && ((2 + (n * 2) + 2) <= len))
+    {
+        buf[2 + (n * 2)] = first + n + 100;
+        buf[3 + (n * 2)] = 0;
+        ++n;
+    }
+    buf[1] = n;
+    return 2 + (n * 2);
+}
+
+TEST_CASE("GETPARMS command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(cfg_get_range);
+
+    memset(batch_payload, 0, sizeof(batch_payload));
+    memset(batch_payload_len, 0, sizeof(batch_payload_len));
+
+    pkt_send_fake.custom_fake = pkt_send_batch_fake;
+    pkt_send_fake.return_val = true;
+    cfg_get_range_fake.custom_fake = cfg_get_range_fake_parms;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    SECTION("range in one packet")
+    {
+        packet_t pkt = { 0, 1, CMD_GETPARMS, 2, { 3, 2 } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg2_val == CMD_GETPARMS);
+        REQUIRE(batch_payload_len[0] == 6);
+        uint8_t rep[6] = { 3, 2, 103, 0, 104, 0 };
+        CHECK(memcmp(batch_payload[0], rep, 6) == 0);
+    }
+
+    SECTION("range split over packets")
+    {
+        // MTU of 12 holds 5 parms per reply
+        packet_t pkt = { 0, 1, CMD_GETPARMS, 2, { 1, 13 } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 3);
+        CHECK(batch_payload_len[0] == 12);
+        CHECK(batch_payload[0][0] == 1);
+        CHECK(batch_payload[0][1] == 5);
+        CHECK(batch_payload_len[1] == 12);
+        CHECK(batch_payload[1][0] == 6);
+        CHECK(batch_payload[1][1] == 5);
+        CHECK(batch_payload[1][2] == 106);
+        CHECK(batch_payload_len[2] == 8);
+        CHECK(batch_payload[2][0] == 11);
+        CHECK(batch_payload[2][1] == 3);
+        CHECK(batch_payload[2][6] == 113);
+    }
+
+    SECTION("bad range")
+    {
+        packet_t pkt = { 0, 1, CMD_GETPARMS, 2, { 12, 5 } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(batch_payload_len[0] == 1);
+        CHECK(batch_payload[0][0] == 12);
+    }
+
+    SECTION("missing count")
+    {
+        packet_t pkt = { 0, 1, CMD_GETPARMS, 1, { 1, 5 } };
+        pkt_ready_fake.return_val = &pkt;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(batch_payload_len[0] == 1);
+    }
+
+    cfg_get_range_fake.custom_fake = NULL;
+}
+
+TEST_CASE("SETPARMS command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(cfg_set_range);
+
+    memset(pkt_send_payload, 0, 64);
+    pkt_send_payload_len = 0;
+
+    pkt_send_fake.custom_fake = pkt_send_custom_fake;
+    pkt_send_fake.return_val = true;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    packet_t pkt = { 0, 1, CMD_SETPARMS, 6, { 2, 2, 1, 2, 3, 4 } };
+    pkt_ready_fake.return_val = &pkt;
+
+    SECTION("range is set")
+    {
+        cfg_set_range_fake.return_val = true;
+        bool ret = cmd_process();
+        CHECK(ret);
+        CHECK(cfg_set_range_fake.call_count == 1);
+        CHECK(cfg_set_range_fake.arg0_val == 6);
+        CHECK(cfg_set_range_fake.arg1_val == pkt.payload);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg2_val == CMD_SETPARMS);
+        CHECK(pkt_send_payload_len == 3);
+        CHECK(pkt_send_payload[0] == 2);
+        CHECK(pkt_send_payload[1] == 2);
+        CHECK(pkt_send_payload[2] == 0);
     }
+
+    SECTION("range is rejected")
+    {
+        cfg_set_range_fake.return_val = false;
+        bool ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_payload_len == 3);
+        CHECK(pkt_send_payload[2] == 1);
+    }
+}
+
+TEST_CASE("COMMIT command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(cfg_is_dirty);
+    RESET_FAKE(cfg_store);
+
+    memset(pkt_send_payload, 0, 64);
+    pkt_send_payload_len = 0;
+
+    pkt_send_fake.custom_fake = pkt_send_custom_fake;
+    pkt_send_fake.return_val = true;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    packet_t pkt = { 0, 1, CMD_COMMIT, 0 };
+    pkt_ready_fake.return_val = &pkt;
+
+    SECTION("changes are stored")
+    {
+        cfg_is_dirty_fake.return_val = true;
+        bool ret = cmd_process();
+        CHECK(ret);
+        CHECK(cfg_store_fake.call_count == 1);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg2_val == CMD_COMMIT);
+        CHECK(pkt_send_payload_len == 1);
+        CHECK(pkt_send_payload[0] == 1);
+    }
+
+    SECTION("nothing to store")
+    {
+        cfg_is_dirty_fake.return_val = false;
+        bool ret = cmd_process();
+        CHECK(ret);
+        CHECK(cfg_store_fake.call_count == 0);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_payload[0] == 0);
+    }
+
+    cfg_is_dirty_fake.return_val = false;
+}
+
+TEST_CASE("CFGCRC command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(cfg_is_dirty);
+    RESET_FAKE(cfg_crc);
+
+    memset(pkt_send_payload, 0, 64);
+    pkt_send_payload_len = 0;
+
+    pkt_send_fake.custom_fake = pkt_send_custom_fake;
+    pkt_send_fake.return_val = true;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    packet_t pkt = { 0, 1, CMD_CFGCRC, 0 };
+    pkt_ready_fake.return_val = &pkt;
+    cfg_crc_fake.return_val = 0xBEEF;
+
+    SECTION("stored config")
+    {
+        bool ret = cmd_process();
+        CHECK(ret);
+        CHECK(cfg_crc_fake.call_count == 1);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg1_val == 1);
+        CHECK(pkt_send_fake.arg2_val == CMD_CFGCRC);
+        CHECK(pkt_send_payload_len == 3);
+        CHECK(pkt_send_payload[0] == 0xEF);
+        CHECK(pkt_send_payload[1] == 0xBE);
+        CHECK(pkt_send_payload[2] == 0);
+    }
+
+    SECTION("changes not stored")
+    {
+        cfg_is_dirty_fake.return_val = true;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_payload[2] == 1);
+    }
+
+    SECTION("broadcast replies in the time slot")
+    {
+        RESET_FAKE(tmr_set);
+        RESET_FAKE(tmr_expired);
+        g_cfg_parms.addr = 3;
+        pkt.addr = PKT_ADDR_BROADCAST;
+        pkt.flags = PKT_FLAG_CRC16;
+        tmr_expired_fake.return_val = false;
+
+        CHECK_FALSE(cmd_process());
+        CHECK_FALSE(pkt_send_fake.call_count);
+        REQUIRE(tmr_set_fake.call_count == 1);
+        CHECK(tmr_set_fake.arg0_val == (2 * CMD_SLOT_MS));
+        CHECK(cmd_is_active());
+
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        CHECK(cfg_crc_fake.call_count == 1);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | PKT_FLAG_CRC16));
+        CHECK(pkt_send_fake.arg1_val == 3);
+        CHECK(pkt_send_fake.arg2_val == CMD_CFGCRC);
+        CHECK(pkt_send_payload[0] == 0xEF);
+        CHECK(pkt_send_payload[1] == 0xBE);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    cfg_is_dirty_fake.return_val = false;
+}
+
+TEST_CASE("STATUSD command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(adc_get_cellmv);
+    RESET_FAKE(adc_get_tempC);
+    RESET_FAKE(shunt_get_status);
+    RESET_FAKE(shunt_get_pwm);
+
+    memset(pkt_send_payload, 0, 64);
+    pkt_send_payload_len = 0;
+
+    pkt_send_fake.custom_fake = pkt_send_custom_fake;
+    pkt_send_fake.return_val = true;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    packet_t pkt = { 0, 1, CMD_STATUSD, 1, { 1 } };
+    pkt_ready_fake.return_val = &pkt;
+
+    adc_get_cellmv_fake.return_val = 3300;
+    adc_get_tempC_fake.return_val = 25;
+
+    // start with a forced full frame so the test does not depend on
+    // what other test cases did
+    bool ret = cmd_process();
+    CHECK(ret);
+    REQUIRE(pkt_send_fake.call_count == 1);
+    CHECK(pkt_send_fake.arg2_val == CMD_STATUSD);
+    CHECK(pkt_send_payload_len == 11);
+    CHECK(pkt_send_payload[0] == (STATUSD_FULL | STATUS_ALL));
+    CHECK(pkt_send_payload[1] == (3300 & 0xFF));
+    CHECK(pkt_send_payload[2] == (3300 >> 8));
+    pkt.len = 0;
+
+    SECTION("no change")
+    {
+        ret = cmd_process();
+        CHECK(ret);
+        CHECK(pkt_send_payload_len == 1);
+        CHECK(pkt_send_payload[0] == 0);
+    }
+
+    SECTION("small changes")
+    {
+        adc_get_cellmv_fake.return_val = 3290;
+        shunt_get_pwm_fake.return_val = 50;
+        int16_t temps[3] = { 25, 25, 27 }; // mcu temp +2
+        SET_RETURN_SEQ(adc_get_tempC, temps, 3);
+        ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_payload_len == 4);
+        CHECK(pkt_send_payload[0] == 0x29); // fields 0, 3, 5
+        CHECK(pkt_send_payload[1] == (uint8_t)-10);
+        CHECK(pkt_send_payload[2] == 50);
+        CHECK(pkt_send_payload[3] == 2);
+    }
+
+    SECTION("large change")
+    {
+        adc_get_cellmv_fake.return_val = 3000;
+        ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_payload_len == 4);
+        CHECK(pkt_send_payload[0] == 0x01);
+        CHECK(pkt_send_payload[1] == STATUSD_ESCAPE);
+        CHECK(pkt_send_payload[2] == (3000 & 0xFF));
+        CHECK(pkt_send_payload[3] == (3000 >> 8));
+
+        // next delta is from the new value
+        adc_get_cellmv_fake.return_val = 3001;
+        ret = cmd_process();
+        REQUIRE(pkt_send_payload_len == 2);
+        CHECK(pkt_send_payload[1] == 1);
+    }
+
+    SECTION("delta longer than full")
+    {
+        // all 16-bit fields have large changes
+        adc_get_cellmv_fake.return_val = 4000;
+        adc_get_tempC_fake.return_val = -200;
+        ret = cmd_process();
+        CHECK(ret);
+        CHECK(pkt_send_payload_len == 11);
+        CHECK(pkt_send_payload[0] == (STATUSD_FULL | STATUS_ALL));
+    }
+
+    SECTION("reply not sent")
+    {
+        // the change is lost with the reply, so it is sent again
+        adc_get_cellmv_fake.return_val = 3290;
+        pkt_send_fake.return_val = false;
+        ret = cmd_process();
+        CHECK_FALSE(ret);
+        CHECK(pkt_send_payload_len == 2);
+        pkt_send_fake.return_val = true;
+        ret = cmd_process();
+        CHECK(ret);
+        REQUIRE(pkt_send_payload_len == 2);
+        CHECK(pkt_send_payload[0] == 0x01);
+        CHECK(pkt_send_payload[1] == (uint8_t)-10);
+
+        // and no full frame is used up
+        for (int i = 1; i < STATUSD_FULL_INTERVAL; ++i)
+        {
+            cmd_process();
+            CHECK(pkt_send_payload_len == 1);
+        }
+        cmd_process();
+        CHECK(pkt_send_payload_len == 11);
+    }
+
+    SECTION("periodic full frame")
+    {
+        for (int i = 0; i < STATUSD_FULL_INTERVAL; ++i)
+        {
+            cmd_process();
+            CHECK(pkt_send_payload_len == 1);
+        }
+        cmd_process();
+        CHECK(pkt_send_payload_len == 11);
+        CHECK(pkt_send_payload[0] == (STATUSD_FULL | STATUS_ALL));
+    }
+}
+
+TEST_CASE("Sequenced commands")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(pkt_resend);
+    RESET_FAKE(cfg_set);
+
+    pkt_send_fake.return_val = true;
+    pkt_resend_fake.return_val = true;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    uint8_t seqflags = PKT_FLAG_SEQ | 3;
+    packet_t pkt = { seqflags, 1, CMD_SETPARM, 2, { 11, 50 } };
+    pkt_ready_fake.return_val = &pkt;
+
+    // first time the command is run and the reply has the sequence
+    cmd_process();
+    CHECK(cfg_set_fake.call_count == 1);
+    REQUIRE(pkt_send_fake.call_count == 1);
+    CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | seqflags));
+    CHECK(pkt_resend_fake.call_count == 0);
+
+    SECTION("retry is answered from the cache")
+    {
+        packet_t *ppkt = cmd_process();
+        CHECK_FALSE(ppkt);
+        CHECK(cfg_set_fake.call_count == 1);
+        CHECK(pkt_send_fake.call_count == 1);
+        CHECK(pkt_resend_fake.call_count == 1);
+        CHECK(pkt_rx_free_fake.call_count == 1);
+    }
+
+    SECTION("retry runs the command if the reply cannot be sent again")
+    {
+        pkt_resend_fake.return_val = false;
+        cmd_process();
+        CHECK(pkt_resend_fake.call_count == 1);
+        CHECK(cfg_set_fake.call_count == 2);
+        REQUIRE(pkt_send_fake.call_count == 2);
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | seqflags));
+    }
+
+    SECTION("new sequence runs the command")
+    {
+        pkt.flags = PKT_FLAG_SEQ | 4;
+        cmd_process();
+        CHECK(cfg_set_fake.call_count == 2);
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | PKT_FLAG_SEQ | 4));
+        CHECK(pkt_resend_fake.call_count == 0);
+    }
+
+    SECTION("same sequence different command")
+    {
+        pkt.cmd = CMD_MTU;
+        cmd_process();
+        CHECK(pkt_send_fake.call_count == 2);
+        CHECK(pkt_resend_fake.call_count == 0);
+    }
+
+    SECTION("no sequence always runs")
+    {
+        pkt.flags = 0;
+        cmd_process();
+        cmd_process();
+        CHECK(cfg_set_fake.call_count == 3);
+        CHECK(pkt_send_fake.arg0_val == PKT_FLAG_REPLY);
+        CHECK(pkt_resend_fake.call_count == 0);
+    }
+
+    SECTION("reply uses the crc mode of the command")
+    {
+        pkt.flags = PKT_FLAG_SEQ | PKT_FLAG_CRC16 | 6;
+        cmd_process();
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | PKT_FLAG_SEQ | PKT_FLAG_CRC16 | 6));
+        pkt.flags = PKT_FLAG_CRC16;
+        cmd_process();
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | PKT_FLAG_CRC16));
+    }
+
+    SECTION("reply has a stamp if the command asks")
+    {
+        pkt.flags = PKT_FLAG_STAMP;
+        cmd_process();
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | PKT_FLAG_STAMP));
+        pkt.flags = 0;
+        cmd_process();
+        CHECK(pkt_send_fake.arg0_val == PKT_FLAG_REPLY);
+    }
+
+    SECTION("retried unknown command is not answered from the cache")
+    {
+        pkt.flags = PKT_FLAG_SEQ | 4;
+        pkt.cmd = 0xEE;
+        CHECK_FALSE(cmd_process());
+        CHECK_FALSE(cmd_process());
+        CHECK(pkt_send_fake.call_count == 1);
+        CHECK(pkt_resend_fake.call_count == 0);
+    }
+
+    SECTION("retry after the queue was full runs the command again")
+    {
+        pkt.flags = PKT_FLAG_SEQ | 4;
+        pkt_send_fake.return_val = false;
+        cmd_process();
+        CHECK(cfg_set_fake.call_count == 2);
+        pkt_send_fake.return_val = true;
+        cmd_process();
+        CHECK(cfg_set_fake.call_count == 3);
+        CHECK(pkt_send_fake.call_count == 3);
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | PKT_FLAG_SEQ | 4));
+        CHECK(pkt_resend_fake.call_count == 0);
+    }
+
+    SECTION("group ack replaces the cached reply")
+    {
+        RESET_FAKE(tmr_set);
+        RESET_FAKE(tmr_expired);
+        tmr_expired_fake.return_val = true;
+
+        // sequenced broadcast, node 1 acks right away
+        packet_t group = { PKT_FLAG_SEQ | 3, PKT_ADDR_BROADCAST, CMD_COMMIT, 0 };
+        pkt_ready_fake.return_val = &group;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 2);
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | seqflags));
+        CHECK(pkt_send_fake.arg2_val == CMD_COMMIT);
+
+        // retry of the unicast command gets its own reply
+        pkt_ready_fake.return_val = &pkt;
+        cmd_process();
+        CHECK(pkt_resend_fake.call_count == 0);
+        CHECK(cfg_set_fake.call_count == 2);
+        REQUIRE(pkt_send_fake.call_count == 3);
+        CHECK(pkt_send_fake.arg2_val == CMD_SETPARM);
+    }
+
+    SECTION("multi reply command is not cached")
+    {
+        pkt.flags = PKT_FLAG_SEQ | 5;
+        pkt.cmd = CMD_BATCH;
+        pkt.len = 1;
+        pkt.payload[0] = CMD_ADCRAW;
+        uint16_t adcdata[4] = { 0 };
+        adc_get_raw_fake.return_val = adcdata;
+        cmd_process();
+        cmd_process();
+        CHECK(pkt_send_fake.call_count == 3);
+        CHECK(pkt_resend_fake.call_count == 0);
+    }
+
+    // forget the sequence so it does not affect other tests
+    pkt.flags = 0;
+    pkt.cmd = CMD_PING;
+    cmd_process();
+}
+
+TEST_CASE("DFU command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+
+    RSTCTRL.SWRR = 0;   // software reset register
+
+    // reset the payload capture from pkt_send
+    memset(pkt_send_payload, 0, 64);
+    pkt_send_payload_len = 0;
+
+    pkt_send_fake.custom_fake = pkt_send_custom_fake;
+
+    g_cfg_parms.addr = 1; // device addr 1
+
+    packet_t pkt = { 0, 1, CMD_DFU, 0 };
+    pkt_ready_fake.return_val = &pkt;
+    pkt_send_fake.return_val = true;
+
+    SECTION("DFU to this node")
+    {
+        // send the command packet
+        bool ret = cmd_process();
+        CHECK(pkt_ready_fake.call_count == 1);
+        CHECK_FALSE(ret); // DFU command returns false no matter what
+
+        // should have called swreset()
+        CHECK(RSTCTRL.SWRR == 1);
+
+        // TODO: check all the register?? probably not necessary
+    }
+
+    SECTION("DFU to broadcast goes to the main loop")
+    {
+        pkt.addr = PKT_ADDR_BROADCAST;
+        packet_t *ppkt = cmd_process();
+        CHECK(ppkt == &pkt);
+        CHECK_FALSE(pkt_rx_free_fake.call_count);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(RSTCTRL.SWRR == 0);
+    }
+
+    SECTION("DFU to a group goes to the main loop")
+    {
+        g_cfg_parms.groups = 0x0001;
+        pkt.addr = PKT_ADDR_GROUP;
+        packet_t *ppkt = cmd_process();
+        CHECK(ppkt == &pkt);
+        CHECK_FALSE(pkt_rx_free_fake.call_count);
+        CHECK(RSTCTRL.SWRR == 0);
+    }
+}
+
+TEST_CASE("broadcast STATUS command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(tmr_set);
+    RESET_FAKE(tmr_expired);
+
+    RESET_FAKE(adc_get_cellmv);
+    RESET_FAKE(adc_get_tempC);
+
+    // reset the payload capture from pkt_send
+    memset(pkt_send_payload, 0, 64);
+    pkt_send_payload_len = 0;
+
+    pkt_send_fake.custom_fake = pkt_send_custom_fake;
+    pkt_send_fake.return_val = true;
+
+    g_cfg_parms.addr = 3; // device addr 3, so third slot
+
+    adc_get_cellmv_fake.return_val = 3456;
+
+    SECTION("default slot width")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_set_fake.return_val = 1234;
+        tmr_expired_fake.return_val = false;
+
+        // process the broadcast, reply should be scheduled, not sent
+        packet_t *ppkt = cmd_process();
+        CHECK_FALSE(ppkt);
+        CHECK(pkt_rx_free_fake.call_count == 1);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        REQUIRE(tmr_set_fake.call_count == 1);
+        CHECK(tmr_set_fake.arg0_val == (2 * CMD_SLOT_MS));
+        CHECK(tmr_expired_fake.arg0_val == 1234);
+        CHECK(cmd_is_active());
+
+        // slot not expired yet, still no reply
+        pkt_ready_fake.return_val = NULL;
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(cmd_is_active());
+
+        // slot time arrives, reply is sent with our address
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg0_val == PKT_FLAG_REPLY);
+        CHECK(pkt_send_fake.arg1_val == 3);
+        CHECK(pkt_send_fake.arg2_val == CMD_STATUS);
+        CHECK(pkt_send_fake.arg4_val == 10);
+        CHECK(pkt_send_payload[0] == 0x80); // 0xD80 = 3456d
+        CHECK(pkt_send_payload[1] == 0x0D);
+        CHECK_FALSE(cmd_is_active());
+
+        // only one reply
+        cmd_process();
+        CHECK(pkt_send_fake.call_count == 1);
+    }
+
+    SECTION("slot width in payload")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_STATUS, 1, { 40 } };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = false;
+
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        REQUIRE(tmr_set_fake.call_count == 1);
+        CHECK(tmr_set_fake.arg0_val == 80);
+        CHECK(cmd_is_active());
+
+        // let it expire so it does not affect other tests
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        CHECK(pkt_send_fake.call_count == 1);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("field mask in payload")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_STATUS, 2, { 40, STATUS_MV } };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = false;
+
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg4_val == 2);
+        CHECK(pkt_send_payload[0] == 0x80);
+        CHECK(pkt_send_payload[1] == 0x0D);
+    }
+
+    SECTION("crc-16 command gets a crc-16 reply")
+    {
+        packet_t pkt = { PKT_FLAG_CRC16, PKT_ADDR_BROADCAST, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = false;
+
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+
+        // a unicast command in between does not change the reply crc
+        packet_t ping = { 0, 3, CMD_PING, 0 };
+        pkt_ready_fake.return_val = &ping;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg0_val == PKT_FLAG_REPLY);
+
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 2);
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | PKT_FLAG_CRC16));
+        CHECK(pkt_send_fake.arg2_val == CMD_STATUS);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("first slot replies right away")
+    {
+        g_cfg_parms.addr = 1;
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = true;
+
+        cmd_process();
+        REQUIRE(tmr_set_fake.call_count == 1);
+        CHECK(tmr_set_fake.arg0_val == 0);
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg1_val == 1);
+        CHECK(pkt_send_fake.arg2_val == CMD_STATUS);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("slot too far away")
+    {
+        g_cfg_parms.addr = 254;
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_STATUS, 1, { 200 } };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = true;
+
+        cmd_process();
+        CHECK_FALSE(tmr_set_fake.call_count);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("unaddressed node does not reply")
+    {
+        g_cfg_parms.addr = 0;
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = true;
+
+        cmd_process();
+        CHECK_FALSE(tmr_set_fake.call_count);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("other broadcast command ignored")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_PING, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = true;
+
+        packet_t *ppkt = cmd_process();
+        CHECK_FALSE(ppkt);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(pkt_rx_free_fake.call_count == 1);
+    }
+}
+
+TEST_CASE("SCAN command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(pkt_is_active);
+    RESET_FAKE(tmr_set);
+    RESET_FAKE(tmr_expired);
+
+    RESET_FAKE(adc_get_cellmv);
+    RESET_FAKE(adc_get_tempC);
+
+    pkt_send_fake.custom_fake = pkt_send_custom_fake;
+    pkt_send_fake.return_val = true;
+
+    g_cfg_parms.addr = 3; // device addr 3
+
+    // scan command starting at node 1, default timeout
+    packet_t scan = { 0, PKT_ADDR_BROADCAST, CMD_SCAN, 0 };
+
+    SECTION("first node replies right away")
+    {
+        g_cfg_parms.addr = 1;
+        pkt_ready_fake.return_val = &scan;
+        tmr_expired_fake.return_val = false;
+
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg0_val == PKT_FLAG_REPLY);
+        CHECK(pkt_send_fake.arg1_val == 1);
+        CHECK(pkt_send_fake.arg2_val == CMD_STATUS);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("crc-16 scan gets a crc-16 reply")
+    {
+        scan.flags = PKT_FLAG_CRC16;
+        pkt_ready_fake.return_val = &scan;
+        tmr_expired_fake.return_val = false;
+
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+
+        // our turn comes after the predecessor replies
+        packet_t reply2 = { PKT_FLAG_REPLY, 2, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &reply2;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg0_val == (PKT_FLAG_REPLY | PKT_FLAG_CRC16));
+        CHECK(pkt_send_fake.arg2_val == CMD_STATUS);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("first address in payload")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_SCAN, 1, { 3 } };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = false;
+
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg1_val == 3);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("reply when predecessor replies")
+    {
+        pkt_ready_fake.return_val = &scan;
+        tmr_expired_fake.return_val = false;
+
+        // after scan command, waiting for turn
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(cmd_is_active());
+        REQUIRE(tmr_set_fake.call_count == 1);
+        CHECK(tmr_set_fake.arg0_val == (2 * CMD_SCAN_MS));
+
+        // node 1 replies, still not our turn
+        packet_t reply1 = { PKT_FLAG_REPLY, 1, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &reply1;
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(tmr_set_fake.arg0_val == CMD_SCAN_MS);
+
+        // node 2 replies, now it is our turn
+        packet_t reply2 = { PKT_FLAG_REPLY, 2, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &reply2;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg1_val == 3);
+        CHECK(pkt_send_fake.arg2_val == CMD_STATUS);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("missing predecessor timeout")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_SCAN, 2, { 1, 20 } };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = false;
+
+        cmd_process();
+        REQUIRE(tmr_set_fake.call_count == 1);
+        CHECK(tmr_set_fake.arg0_val == 40);
+
+        // node 1 replies, node 2 is missing
+        packet_t reply1 = { PKT_FLAG_REPLY, 1, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &reply1;
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(tmr_set_fake.arg0_val == 20);
+
+        // bus activity holds off the timeout
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        pkt_is_active_fake.return_val = true;
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(cmd_is_active());
+
+        // bus quiet and timeout expired, take our turn
+        pkt_is_active_fake.return_val = false;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg1_val == 3);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("other replies ignored")
+    {
+        pkt_ready_fake.return_val = &scan;
+        tmr_expired_fake.return_val = false;
+        cmd_process();
+        CHECK(cmd_is_active());
+
+        // reply from a node after us, and non-STATUS reply from predecessor
+        packet_t reply5 = { PKT_FLAG_REPLY, 5, CMD_STATUS, 0 };
+        pkt_ready_fake.return_val = &reply5;
+        cmd_process();
+        packet_t ping2 = { PKT_FLAG_REPLY, 2, CMD_PING, 0 };
+        pkt_ready_fake.return_val = &ping2;
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(tmr_set_fake.call_count == 1);
+
+        // finish the scan
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        CHECK(pkt_send_fake.call_count == 1);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("node before first address does not take part")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_SCAN, 1, { 4 } };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_expired_fake.return_val = true;
+
+        cmd_process();
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("reply to our address is not a command")
+    {
+        packet_t pkt = { PKT_FLAG_REPLY, 3, CMD_PING, 0 };
+        pkt_ready_fake.return_val = &pkt;
+
+        packet_t *ppkt = cmd_process();
+        CHECK_FALSE(ppkt);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK(pkt_rx_free_fake.call_count == 1);
+    }
+}
+
+TEST_CASE("SETBAUD command")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(pkt_is_active);
+    RESET_FAKE(tmr_set);
+    RESET_FAKE(tmr_expired);
+    RESET_FAKE(baud_set);
+    RESET_FAKE(baud_restore);
+
+    baud_set_fake.return_val = true;
+    tmr_set_fake.return_val = 1234;
+    g_cfg_parms.addr = 3; // device addr 3
+
+    // 115200 bps, little-endian
+    packet_t setbaud = { 0, PKT_ADDR_BROADCAST, CMD_SETBAUD, 4,
+                         { 0x00, 0xC2, 0x01, 0x00 } };
+
+    SECTION("new rate confirmed by valid packet")
+    {
+        pkt_ready_fake.return_val = &setbaud;
+        tmr_expired_fake.return_val = false;
+        packet_t *ppkt = cmd_process();
+        CHECK_FALSE(ppkt);
+        CHECK_FALSE(pkt_send_fake.call_count); // no reply
+        REQUIRE(baud_set_fake.call_count == 1);
+        CHECK(baud_set_fake.arg0_val == 115200);
+        CHECK(tmr_set_fake.arg0_val == CMD_SETBAUD_MS);
+        CHECK(cmd_is_active());
+
+        // timeout not expired yet
+        pkt_ready_fake.return_val = NULL;
+        cmd_process();
+        CHECK(cmd_is_active());
+        CHECK_FALSE(baud_restore_fake.call_count);
+
+        // a valid packet at the new rate, for some other node
+        packet_t ping = { 0, 7, CMD_PING, 0 };
+        pkt_ready_fake.return_val = &ping;
+        cmd_process();
+        CHECK_FALSE(cmd_is_active());
+
+        // timeout has no effect now
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        CHECK_FALSE(baud_restore_fake.call_count);
+    }
+
+    SECTION("fall back when not confirmed")
+    {
+        pkt_ready_fake.return_val = &setbaud;
+        tmr_expired_fake.return_val = false;
+        cmd_process();
+        CHECK(cmd_is_active());
+
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        CHECK(baud_restore_fake.call_count == 1);
+        CHECK(tmr_expired_fake.arg0_val == 1234);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("node without address")
+    {
+        g_cfg_parms.addr = 0;
+        pkt_ready_fake.return_val = &setbaud;
+        tmr_expired_fake.return_val = false;
+        cmd_process();
+        CHECK(baud_set_fake.call_count == 1);
+
+        // finish with a valid packet
+        packet_t ping = { 0, 7, CMD_PING, 0 };
+        pkt_ready_fake.return_val = &ping;
+        cmd_process();
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("invalid rate")
+    {
+        baud_set_fake.return_val = false;
+        pkt_ready_fake.return_val = &setbaud;
+        cmd_process();
+        CHECK(baud_set_fake.call_count == 1);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("wrong length")
+    {
+        setbaud.len = 3;
+        pkt_ready_fake.return_val = &setbaud;
+        cmd_process();
+        CHECK_FALSE(baud_set_fake.call_count);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("not broadcast")
+    {
+        setbaud.addr = 3;
+        pkt_ready_fake.return_val = &setbaud;
+        cmd_process();
+        CHECK_FALSE(baud_set_fake.call_count);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK_FALSE(cmd_is_active());
+    }
+}
+
+TEST_CASE("Packet filter")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(pkt_is_active);
+    RESET_FAKE(tmr_set);
+    RESET_FAKE(tmr_expired);
+    RESET_FAKE(baud_set);
+
+    pkt_send_fake.return_val = true;
+    baud_set_fake.return_val = true;
+    g_cfg_parms.addr = 3; // device addr 3
+
+    // finish any deferred work left over from other tests
+    tmr_expired_fake.return_val = true;
+    cmd_process();
+    REQUIRE_FALSE(cmd_is_active());
+    tmr_expired_fake.return_val = false;
+
+    SECTION("commands for this node")
+    {
+        CHECK(cmd_accept(0, 3, CMD_PING));
+        CHECK(cmd_accept(0, 3, CMD_STATUS));
+        CHECK(cmd_accept(0, PKT_ADDR_BROADCAST, CMD_STATUS));
+    }
+
+    SECTION("commands for other nodes")
+    {
+        CHECK_FALSE(cmd_accept(0, 4, CMD_PING));
+        CHECK_FALSE(cmd_accept(0, 0, CMD_UID));
+        // except the ones processed for any node
+        CHECK(cmd_accept(0, 4, CMD_ADDR));
+        CHECK(cmd_accept(0, 4, CMD_DFU));
+    }
+
+    SECTION("replies from other nodes")
+    {
+        CHECK_FALSE(cmd_accept(PKT_FLAG_REPLY, 2, CMD_STATUS));
+        CHECK_FALSE(cmd_accept(PKT_FLAG_REPLY, 2, CMD_DFU));
+        CHECK_FALSE(cmd_accept(PKT_FLAG_REPLY, PKT_ADDR_BROADCAST, CMD_PING));
+    }
+
+    SECTION("node without address")
+    {
+        g_cfg_parms.addr = 0;
+        CHECK(cmd_accept(0, 0, CMD_UID));
+        CHECK_FALSE(cmd_accept(0, 0, CMD_PING));
+        CHECK_FALSE(cmd_accept(0, 3, CMD_UID));
+        CHECK(cmd_accept(0, 4, CMD_ADDR));
+        CHECK(cmd_accept(0, PKT_ADDR_BROADCAST, CMD_SETBAUD));
+    }
+
+    SECTION("replies during scan")
+    {
+        packet_t scan = { 0, PKT_ADDR_BROADCAST, CMD_SCAN, 0 };
+        pkt_ready_fake.return_val = &scan;
+        cmd_process();
+        REQUIRE(cmd_is_active());
+        CHECK(cmd_accept(PKT_FLAG_REPLY, 2, CMD_STATUS));
+        CHECK_FALSE(cmd_accept(PKT_FLAG_REPLY, 2, CMD_PING));
+
+        // let the scan finish
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        CHECK_FALSE(cmd_accept(PKT_FLAG_REPLY, 2, CMD_STATUS));
+    }
+
+    SECTION("everything while confirming data rate")
+    {
+        packet_t setbaud = { 0, PKT_ADDR_BROADCAST, CMD_SETBAUD, 4,
+                             { 0x00, 0xC2, 0x01, 0x00 } };
+        pkt_ready_fake.return_val = &setbaud;
+        cmd_process();
+        REQUIRE(cmd_is_active());
+        CHECK(cmd_accept(0, 4, CMD_PING));
+        CHECK(cmd_accept(PKT_FLAG_REPLY, 2, CMD_PING));
+
+        // a valid packet confirms the rate
+        packet_t ping = { 0, 4, CMD_PING, 0 };
+        pkt_ready_fake.return_val = &ping;
+        cmd_process();
+        CHECK_FALSE(cmd_accept(0, 4, CMD_PING));
+    }
+}
+
+TEST_CASE("Group commands")
+{
+    g_cfg_parms = { 0, 0, 0, 0 };
+
+    RESET_FAKE(pkt_ready);
+    RESET_FAKE(pkt_send);
+    RESET_FAKE(pkt_rx_free);
+    RESET_FAKE(tmr_set);
+    RESET_FAKE(tmr_expired);
+    RESET_FAKE(cfg_set);
+    RESET_FAKE(cfg_is_dirty);
+    RESET_FAKE(cfg_store);
+
+    pkt_send_fake.return_val = true;
+    cfg_set_fake.return_val = true;
+    g_cfg_parms.addr = 3; // device addr 3, so third slot
+    g_cfg_parms.groups = 0x0005; // groups 240 and 242
+
+    // finish any deferred work left over from other tests
+    tmr_expired_fake.return_val = true;
+    cmd_process();
+    REQUIRE_FALSE(cmd_is_active());
+    tmr_expired_fake.return_val = false;
+    RESET_FAKE(pkt_send);
+    pkt_send_fake.return_val = true;
+
+    SECTION("only groups this node is in")
+    {
+        CHECK(cmd_accept(0, 240, CMD_SHUNTON));
+        CHECK_FALSE(cmd_accept(0, 241, CMD_SHUNTON));
+        CHECK(cmd_accept(0, 242, CMD_SHUNTON));
+        CHECK_FALSE(cmd_accept(0, 253, CMD_SHUNTON));
+        g_cfg_parms.groups = 0x2000;
+        CHECK(cmd_accept(0, 253, CMD_SHUNTON));
+    }
+
+    SECTION("shunt on without reply")
+    {
+        packet_t pkt = { 0, 242, CMD_SHUNTON, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        packet_t *ppkt = cmd_process();
+        // packet is returned so main can start shunting
+        CHECK(ppkt == &pkt);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("broadcast shunt off")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_SHUNTOFF, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        packet_t *ppkt = cmd_process();
+        CHECK(ppkt == &pkt);
+        CHECK_FALSE(pkt_send_fake.call_count);
+    }
+
+    SECTION("not in the group")
+    {
+        packet_t pkt = { 0, 241, CMD_SHUNTON, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        CHECK_FALSE(cmd_process());
+        CHECK_FALSE(pkt_send_fake.call_count);
+    }
+
+    SECTION("set parameter")
+    {
+        packet_t pkt = { 0, 240, CMD_SETPARM, 3, { 8, 0x04, 0x10 } };
+        pkt_ready_fake.return_val = &pkt;
+        CHECK_FALSE(cmd_process());
+        REQUIRE(cfg_set_fake.call_count == 1);
+        CHECK(cfg_set_fake.arg0_val == 3);
+        CHECK_FALSE(pkt_send_fake.call_count);
+    }
+
+    SECTION("broadcast set parameter")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_SETPARM, 3, { 8, 0x04, 0x10 } };
+        pkt_ready_fake.return_val = &pkt;
+        CHECK_FALSE(cmd_process());
+        REQUIRE(cfg_set_fake.call_count == 1);
+        CHECK(cfg_set_fake.arg0_val == 3);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("broadcast cannot set the address")
+    {
+        packet_t pkt = { 0, PKT_ADDR_BROADCAST, CMD_SETPARM, 2, { 1, 9 } };
+        pkt_ready_fake.return_val = &pkt;
+        CHECK_FALSE(cmd_process());
+        CHECK_FALSE(cfg_set_fake.call_count);
+    }
+
+    SECTION("address cannot be set")
+    {
+        packet_t pkt = { PKT_FLAG_SEQ | 1, 240, CMD_SETPARM, 2, { 1, 9 } };
+        pkt_ready_fake.return_val = &pkt;
+        CHECK_FALSE(cmd_process());
+        CHECK_FALSE(cfg_set_fake.call_count);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    SECTION("commit")
+    {
+        packet_t pkt = { 0, 242, CMD_COMMIT, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        cfg_is_dirty_fake.return_val = true;
+        CHECK_FALSE(cmd_process());
+        CHECK(cfg_store_fake.call_count == 1);
+        CHECK_FALSE(pkt_send_fake.call_count);
+    }
+
+    SECTION("other commands are ignored")
+    {
+        packet_t pkt = { 0, 240, CMD_PING, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        CHECK_FALSE(cmd_process());
+        CHECK_FALSE(pkt_send_fake.call_count);
+    }
+
+    SECTION("sequenced command is acked in the time slot")
+    {
+        packet_t pkt = { PKT_FLAG_SEQ | PKT_FLAG_CRC16 | 5, 240, CMD_SHUNTON, 0 };
+        pkt_ready_fake.return_val = &pkt;
+        tmr_set_fake.return_val = 1234;
+        CHECK(cmd_process() == &pkt);
+        CHECK_FALSE(pkt_send_fake.call_count);
+        REQUIRE(tmr_set_fake.call_count == 1);
+        CHECK(tmr_set_fake.arg0_val == (2 * CMD_SLOT_MS));
+        CHECK(cmd_is_active());
+
+        // slot time arrives, ack is sent with our address
+        pkt_ready_fake.return_val = NULL;
+        tmr_expired_fake.return_val = true;
+        cmd_process();
+        REQUIRE(pkt_send_fake.call_count == 1);
+        CHECK(pkt_send_fake.arg0_val
+              == (PKT_FLAG_REPLY | PKT_FLAG_SEQ | PKT_FLAG_CRC16 | 5));
+        CHECK(pkt_send_fake.arg1_val == 3);
+        CHECK(pkt_send_fake.arg2_val == CMD_SHUNTON);
+        CHECK(pkt_send_fake.arg4_val == 0);
+        CHECK_FALSE(cmd_is_active());
+    }
+
+    cfg_is_dirty_fake.return_val = false;
+    tmr_expired_fake.return_val = false;
 }
@@ -0,0 +1,156 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "catch.hpp"
+#include "util/crc16.h"
+#include "crc8.h"
+
+// this structure is defined in the crc8 module and provides access
+// to the implementations that are not selected for the build
+extern "C" struct crc8internals
+{
+    uint8_t (*nibble)(uint8_t, uint8_t);
+    uint8_t (*table)(uint8_t, uint8_t);
+} crc8_internals;
+
+typedef uint8_t (*crcfn_t)(uint8_t, uint8_t);
+
+// compute crc over a buffer using the specified function
+static uint8_t crc_buf(crcfn_t fn, const uint8_t *buf, unsigned int len)
+{
+    uint8_t crc = 0;
+    while (len--)
+    {
+        crc = fn(crc, *buf++);
+    }
+    return crc;
+}
+
+TEST_CASE("crc8 all inputs")
+{
+    // every combination of crc and data must match reference
+    for (unsigned int crc = 0; crc < 256; ++crc)
+    {
+        for (unsigned int data = 0; data < 256; ++data)
+        {
+            uint8_t ref = _crc8_ccitt_update(crc, data);
+            REQUIRE(crc8_update(crc, data) == ref);
+            REQUIRE(crc8_internals.nibble(crc, data) == ref);
+            REQUIRE(crc8_internals.table(crc, data) == ref);
+        }
+    }
+}
+
+TEST_CASE("crc8 packet")
+{
+    // a STATUS command packet, and a reply
+    uint8_t cmd[] = { 0x00, 0x01, 0x06, 0x00 };
+    uint8_t reply[] = { 0x80, 0x01, 0x06, 0x0A,
+                        0x10, 0x0E, 0x19, 0x00, 0x01, 0x00, 0x1A, 0x00, 0x1B, 0x00 };
+
+    uint8_t ref = crc_buf(_crc8_ccitt_update, cmd, sizeof(cmd));
+    CHECK(crc_buf(crc8_update, cmd, sizeof(cmd)) == ref);
+    CHECK(crc_buf(crc8_internals.nibble, cmd, sizeof(cmd)) == ref);
+    CHECK(crc_buf(crc8_internals.table, cmd, sizeof(cmd)) == ref);
+
+    ref = crc_buf(_crc8_ccitt_update, reply, sizeof(reply));
+    CHECK(crc_buf(crc8_update, reply, sizeof(reply)) == ref);
+    CHECK(crc_buf(crc8_internals.nibble, reply, sizeof(reply)) == ref);
+    CHECK(crc_buf(crc8_internals.table, reply, sizeof(reply)) == ref);
+
+    // appending the crc gives a crc of 0
+    uint8_t crc = crc_buf(crc8_update, reply, sizeof(reply));
+    CHECK(crc8_update(crc, crc) == 0);
+}
+
+// time one implementation over a buffer, return host cycles (or ns) per byte
+static double crc_bench(crcfn_t fn, const uint8_t *buf, unsigned int len,
+                        unsigned int loops, uint8_t *pcrc)
+{
+    uint8_t crc = 0;
+#ifdef HAVE_RDTSC
+    uint64_t start = __rdtsc();
+#else
+    auto start = std::chrono::steady_clock::now();
+#endif
+    for (unsigned int loop = 0; loop < loops; ++loop)
+    {
+        for (unsigned int idx = 0; idx < len; ++idx)
+        {
+            crc = fn(crc, buf[idx]);
+        }
+    }
+#ifdef HAVE_RDTSC
+    double elapsed = (double)(__rdtsc() - start);
+#else
+    double elapsed = std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - start).count();
+#endif
+    *pcrc = crc;
+    return elapsed / ((double)len * loops);
+}
+
+// hidden benchmark, run with "make bench" or "bmstest_crc8 [bench]"
+// Host timing is only meaningful as a comparison between implementations.
+// For reference, on AVR the bitwise loop is roughly 50 cycles per byte, the
+// nibble table roughly 20, and the byte table under 10.
+TEST_CASE("crc8 benchmark", "[.][bench]")
+{
+    static uint8_t buf[1024];
+    for (unsigned int idx = 0; idx < sizeof(buf); ++idx)
+    {
+        buf[idx] = (uint8_t)(idx * 7 + 3);
+    }
+    const unsigned int loops = 10000;
+    uint8_t crc_bit, crc_nib, crc_tbl, crc_sel;
+
+    double bit = crc_bench(_crc8_ccitt_update, buf, sizeof(buf), loops, &crc_bit);
+    double nib = crc_bench(crc8_internals.nibble, buf, sizeof(buf), loops, &crc_nib);
+    double tbl = crc_bench(crc8_internals.table, buf, sizeof(buf), loops, &crc_tbl);
+    double sel = crc_bench(crc8_update, buf, sizeof(buf), loops, &crc_sel);
+
+    CHECK(crc_nib == crc_bit);
+    CHECK(crc_tbl == crc_bit);
+    CHECK(crc_sel == crc_bit);
+
+#ifdef HAVE_RDTSC
+    const char *units = "cycles/byte";
+#else
+    const char *units = "ns/byte";
+#endif
+    printf("CRC-8 host benchmark (%s)\n", units);
+    printf("  bitwise:  %6.2f\n", bit);
+    printf("  nibble:   %6.2f  (%.1fx)\n", nib, bit / nib);
+    printf("  table:    %6.2f  (%.1fx)\n", tbl, bit / tbl);
+    printf("  selected: %6.2f  (CRC8_IMPL=%d)\n", sel, CRC8_IMPL);
+}
@@ -29,6 +29,7 @@
 #include "catch.hpp"
 #include "pkt.h"
 #include "ser.h"
+#include "stats.h"
 #include "util/crc16.h"
 
 // we are using fast-faking-framework for provding fake functions called
@@ -40,9 +41,36 @@ DEFINE_FFF_GLOBALS;
 // declare C-type functions
 extern "C" {
 
-// mock function for ser_write
-FAKE_VALUE_FUNC(uint8_t, ser_write, uint8_t *, uint8_t);
+// mock functions for serial module
+FAKE_VALUE_FUNC(bool, ser_write_desc, const ser_desc_t *, uint8_t);
 
+// mock function for command processor packet filter
+FAKE_VALUE_FUNC(bool, cmd_accept, uint8_t, uint8_t, uint8_t);
+
+// mock functions for timestamps
+FAKE_VALUE_FUNC(uint16_t, tmr_ms);
+FAKE_VALUE_FUNC(uint16_t, tmr_us);
+FAKE_VOID_FUNC(baud_rx_sync);
+FAKE_VOID_FUNC(baud_rx_error);
+FAKE_VOID_FUNC(baud_rx_good);
+
+}
+
+// data that was passed to ser_write_desc(), flattened into one buffer
+static uint8_t ser_txbuf[64];
+static uint8_t ser_txlen;
+static ser_desc_t ser_txdesc[SER_DESC_MAX];
+
+static bool ser_write_desc_custom_fake(const ser_desc_t *desc, uint8_t cnt)
+{
+    ser_txlen = 0;
+    for (uint8_t idx = 0; idx < cnt; ++idx)
+    {
+        ser_txdesc[idx] = desc[idx];
+        memcpy(&ser_txbuf[ser_txlen], desc[idx].buf, desc[idx].len);
+        ser_txlen += desc[idx].len;
+    }
+    return ser_write_desc_fake.return_val;
 }
 
 // This test suite is validating the function of the packet parser. It is
@@ -141,10 +169,19 @@ TEST_CASE("Packet allocator")
         CHECK(pkt);
     }
 
-    SECTION("allocate twice fails")
+    SECTION("allocate entire pool then fails")
     {
-        pkt = pkt_rx_alloc();
-        CHECK(pkt);
+        packet_t *pool[PKT_RX_POOL_DEPTH];
+        for (int i = 0; i < PKT_RX_POOL_DEPTH; ++i)
+        {
+            pool[i] = pkt_rx_alloc();
+            REQUIRE(pool[i]);
+            // make sure it is not a duplicate
+            for (int j = 0; j < i; ++j)
+            {
+                CHECK(pool[i] != pool[j]);
+            }
+        }
         pkt = pkt_rx_alloc();
         CHECK_FALSE(pkt);
     }
@@ -157,6 +194,37 @@ TEST_CASE("Packet allocator")
         pkt = pkt_rx_alloc();
         CHECK(pkt);
     }
+
+    SECTION("free one from full pool")
+    {
+        packet_t *pool[PKT_RX_POOL_DEPTH];
+        for (int i = 0; i < PKT_RX_POOL_DEPTH; ++i)
+        {
+            pool[i] = pkt_rx_alloc();
+            REQUIRE(pool[i]);
+        }
+        // free the last one and it should be the one allocated again
+        pkt_rx_free(pool[PKT_RX_POOL_DEPTH - 1]);
+        pkt = pkt_rx_alloc();
+        CHECK(pkt == pool[PKT_RX_POOL_DEPTH - 1]);
+        pkt = pkt_rx_alloc();
+        CHECK_FALSE(pkt);
+    }
+
+    SECTION("free foreign pointer")
+    {
+        packet_t *pool[PKT_RX_POOL_DEPTH];
+        for (int i = 0; i < PKT_RX_POOL_DEPTH; ++i)
+        {
+            pool[i] = pkt_rx_alloc();
+            REQUIRE(pool[i]);
+        }
+        // freeing something not from the pool should not free anything
+        packet_t other;
+        pkt_rx_free(&other);
+        pkt = pkt_rx_alloc();
+        CHECK_FALSE(pkt);
+    }
 }
 
 TEST_CASE("Packet parser")
@@ -165,6 +233,12 @@ TEST_CASE("Packet parser")
     packet_t *pkt;
 
     pkt_reset();
+    stats_clear();
+    RESET_FAKE(cmd_accept);
+    RESET_FAKE(baud_rx_sync);
+    RESET_FAKE(baud_rx_error);
+    RESET_FAKE(baud_rx_good);
+    cmd_accept_fake.return_val = true;
 
     SECTION("no ready packet")
     {
@@ -176,14 +250,19 @@ TEST_CASE("Packet parser")
     {
         send_preambles(3);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 0);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 0);
         // no data so crc is next byte
         pkt = send_byte_get_pkt(crc);
         REQUIRE(pkt);
-        CHECK(pkt->flags == 0xEE);
+        CHECK(pkt->flags == 0xE6);
         CHECK(pkt->addr == 1);
         CHECK(pkt->cmd == 0x42);
         CHECK(pkt->len == 0);
+        CHECK(stats_get(STATS_RX_PKT) == 1);
+        // autobaud is told about the sync and the good packet
+        CHECK(baud_rx_sync_fake.call_count == 1);
+        CHECK(baud_rx_good_fake.call_count == 1);
+        CHECK(baud_rx_error_fake.call_count == 0);
         // verify pkt_ready() called again fails
         pkt = pkt_ready();
         CHECK_FALSE(pkt);
@@ -212,12 +291,12 @@ TEST_CASE("Packet parser")
 
         send_preambles(2);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 1);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 1);
         crc = get_crc(crc, buf, sizeof(buf));  // crc for payload
         send_bytes_get_null(buf, sizeof(buf)); // send the payload
         pkt = send_byte_get_pkt(crc); // send the crc
         REQUIRE(pkt);
-        CHECK(pkt->flags == 0xEE);
+        CHECK(pkt->flags == 0xE6);
         CHECK(pkt->addr == 1);
         CHECK(pkt->cmd == 0x42);
         CHECK(pkt->len == 1);
@@ -230,12 +309,12 @@ TEST_CASE("Packet parser")
 
         send_preambles(4);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, sizeof(buf));
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, sizeof(buf));
         crc = get_crc(crc, buf, sizeof(buf));  // crc for payload
         send_bytes_get_null(buf, sizeof(buf)); // send the payload
         pkt = send_byte_get_pkt(crc); // send the crc
         REQUIRE(pkt);
-        CHECK(pkt->flags == 0xEE);
+        CHECK(pkt->flags == 0xE6);
         CHECK(pkt->addr == 1);
         CHECK(pkt->cmd == 0x42);
         CHECK(pkt->len == sizeof(buf));
@@ -248,12 +327,12 @@ TEST_CASE("Packet parser")
 
         send_preambles(1);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, sizeof(buf));
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, sizeof(buf));
         crc = get_crc(crc, buf, sizeof(buf));  // crc for payload
         send_bytes_get_null(buf, sizeof(buf)); // send the payload
         pkt = send_byte_get_pkt(crc); // send the crc
         REQUIRE(pkt);
-        CHECK(pkt->flags == 0xEE);
+        CHECK(pkt->flags == 0xE6);
         CHECK(pkt->addr == 1);
         CHECK(pkt->cmd == 0x42);
         CHECK(pkt->len == sizeof(buf));
@@ -265,7 +344,7 @@ TEST_CASE("Packet parser")
         send_preambles(3);  // normal preambles
         send_byte_get_null(0); // insert a 0
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 0);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 0);
         // no data so crc is next byte
         send_byte_get_null(crc); // should get no packet
         SUCCEED("no packet as expected");
@@ -275,7 +354,7 @@ TEST_CASE("Packet parser")
     {
         send_preambles(3); // normal preambles
         // missing sync byte
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 0);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 0);
         // no data so crc is next byte
         send_byte_get_null(crc); // should get no packet
         SUCCEED("no packet as expected");
@@ -285,11 +364,14 @@ TEST_CASE("Packet parser")
     {
         send_preambles(3);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 0);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 0);
         // no data so crc is next byte
         ++crc; // mess up the crc
         send_byte_get_null(crc); // should get no packet
-        SUCCEED("no packet as expected");
+        CHECK(stats_get(STATS_CRC_ERR) == 1);
+        CHECK(stats_get(STATS_RX_PKT) == 0);
+        CHECK(baud_rx_error_fake.call_count == 1);
+        CHECK(baud_rx_good_fake.call_count == 0);
     }
 
     SECTION("bad length +1")
@@ -298,7 +380,7 @@ TEST_CASE("Packet parser")
 
         send_preambles(4);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, sizeof(buf)+1);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, sizeof(buf)+1);
         crc = get_crc(crc, buf, sizeof(buf));  // crc for payload
         send_bytes_get_null(buf, sizeof(buf)); // send the payload
         send_byte_get_null(crc); // should get no packet
@@ -311,19 +393,100 @@ TEST_CASE("Packet parser")
 
         send_preambles(4);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, sizeof(buf)-1);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, sizeof(buf)-1);
         crc = get_crc(crc, buf, sizeof(buf));  // crc for payload
         send_bytes_get_null(buf, sizeof(buf)); // send the payload
         send_byte_get_null(crc); // should get no packet
         SUCCEED("no packet as expected");
     }
 
+    SECTION("length over MTU")
+    {
+        // header with a length that is too big is abandoned right away
+        send_preambles(1);
+        send_sync();
+        send_hdr_get_crc(0xE6, 1, 0x42, PKT_PAYLOAD_LEN + 1);
+        CHECK_FALSE(pkt_is_active());
+        CHECK(stats_get(STATS_LEN_ERR) == 1);
+
+        // next packet is received normally
+        send_preambles(1);
+        send_sync();
+        crc = send_hdr_get_crc(0, 1, 1, 0);
+        pkt = send_byte_get_pkt(crc);
+        REQUIRE(pkt);
+        CHECK(pkt->cmd == 1);
+    }
+
+    SECTION("header passed to filter")
+    {
+        send_preambles(1);
+        send_sync();
+        send_hdr_get_crc(0x80, 7, 0x42, 2);
+        REQUIRE(cmd_accept_fake.call_count == 1);
+        CHECK(cmd_accept_fake.arg0_val == 0x80);
+        CHECK(cmd_accept_fake.arg1_val == 7);
+        CHECK(cmd_accept_fake.arg2_val == 0x42);
+    }
+
+    SECTION("packet not wanted is skipped")
+    {
+        // payload has preamble and sync bytes that must not be parsed
+        uint8_t buf[4] = { 0x55, 0x55, 0xF0, 0x00 };
+        cmd_accept_fake.return_val = false;
+
+        send_preambles(1);
+        send_sync();
+        crc = send_hdr_get_crc(0x80, 7, 0x42, sizeof(buf));
+        crc = get_crc(crc, buf, sizeof(buf));
+        send_bytes_get_null(buf, sizeof(buf));
+
+        // still receiving, but no buffer is used
+        CHECK(pkt_is_active());
+        packet_t *pool[PKT_RX_POOL_DEPTH];
+        for (int i = 0; i < PKT_RX_POOL_DEPTH; ++i)
+        {
+            pool[i] = pkt_rx_alloc();
+            CHECK(pool[i]);
+        }
+        for (int i = 0; i < PKT_RX_POOL_DEPTH; ++i)
+        {
+            pkt_rx_free(pool[i]);
+        }
+
+        // crc ends the packet, no packet is delivered
+        send_byte_get_null(crc);
+        CHECK_FALSE(pkt_is_active());
+        CHECK(stats_get(STATS_NOBUF) == 0);
+        CHECK(stats_get(STATS_CRC_ERR) == 0);
+
+        // next packet is received normally
+        cmd_accept_fake.return_val = true;
+        send_preambles(1);
+        send_sync();
+        crc = send_hdr_get_crc(0, 1, 1, 0);
+        pkt = send_byte_get_pkt(crc);
+        REQUIRE(pkt);
+        CHECK(pkt->cmd == 1);
+    }
+
+    SECTION("packet not wanted with no payload")
+    {
+        cmd_accept_fake.return_val = false;
+        send_preambles(1);
+        send_sync();
+        crc = send_hdr_get_crc(0x80, 7, 0x42, 0);
+        CHECK(pkt_is_active());
+        send_byte_get_null(crc);
+        CHECK_FALSE(pkt_is_active());
+    }
+
     SECTION("preamble recovery")
     {
         // start a packet with max len
         send_preambles(3);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 12);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 12);
 
         // it should now be expecting 12 bytes plus crc
         // send 13 preambles to reset
@@ -332,11 +495,11 @@ TEST_CASE("Packet parser")
         // now proceed with normal packet and verify it worked
         send_preambles(1); // still need at least 1 preamble to start next sync
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 0);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 0);
         // no data so crc is next byte
         pkt = send_byte_get_pkt(crc);
         REQUIRE(pkt);
-        CHECK(pkt->flags == 0xEE);
+        CHECK(pkt->flags == 0xE6);
         CHECK(pkt->addr == 1);
         CHECK(pkt->cmd == 0x42);
         CHECK(pkt->len == 0);
@@ -349,11 +512,11 @@ TEST_CASE("Packet parser")
 
         send_preambles(2000);
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 0);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 0);
         // no data so crc is next byte
         pkt = send_byte_get_pkt(crc);
         REQUIRE(pkt);
-        CHECK(pkt->flags == 0xEE);
+        CHECK(pkt->flags == 0xE6);
         CHECK(pkt->addr == 1);
         CHECK(pkt->cmd == 0x42);
         CHECK(pkt->len == 0);
@@ -371,17 +534,119 @@ TEST_CASE("Packet parser")
         // now proceed with normal packet and verify it worked
         send_preambles(13); // preambles to reset
         send_sync();
-        crc = send_hdr_get_crc(0xEE, 1, 0x42, 0);
+        crc = send_hdr_get_crc(0xE6, 1, 0x42, 0);
         // no data so crc is next byte
         pkt = send_byte_get_pkt(crc);
         REQUIRE(pkt);
-        CHECK(pkt->flags == 0xEE);
+        CHECK(pkt->flags == 0xE6);
         CHECK(pkt->addr == 1);
         CHECK(pkt->cmd == 0x42);
         CHECK(pkt->len == 0);
     }
 }
 
+// send a complete packet with no payload, with the given command code
+// parser is not checked for ready packet
+static void send_packet_no_check(uint8_t cmd)
+{
+    uint8_t hdrbuf[4] = { 0, 1, cmd, 0 };
+    pkt_parser(0x55);
+    pkt_parser(0xF0);
+    for (int idx = 0; idx < 4; ++idx)
+    {
+        pkt_parser(hdrbuf[idx]);
+    }
+    pkt_parser(get_crc(0, hdrbuf, 4));
+}
+
+TEST_CASE("Packet burst")
+{
+    packet_t *pkt;
+
+    pkt_reset();
+    stats_clear();
+    RESET_FAKE(cmd_accept);
+    cmd_accept_fake.return_val = true;
+
+    SECTION("burst of pool depth packets")
+    {
+        // send back to back packets without picking any up
+        for (int i = 0; i < PKT_RX_POOL_DEPTH; ++i)
+        {
+            send_packet_no_check(0x20 + i);
+        }
+
+        // all packets should be delivered, in order
+        for (int i = 0; i < PKT_RX_POOL_DEPTH; ++i)
+        {
+            pkt = pkt_ready();
+            REQUIRE(pkt);
+            CHECK(pkt->cmd == (0x20 + i));
+            pkt_rx_free(pkt);
+        }
+        pkt = pkt_ready();
+        CHECK_FALSE(pkt);
+        CHECK_FALSE(pkt_is_active());
+    }
+
+    SECTION("burst larger than pool")
+    {
+        // one more packet than there are buffers
+        for (int i = 0; i < PKT_RX_POOL_DEPTH + 1; ++i)
+        {
+            send_packet_no_check(0x20 + i);
+        }
+
+        // first pool depth packets are delivered, the extra is dropped
+        for (int i = 0; i < PKT_RX_POOL_DEPTH; ++i)
+        {
+            pkt = pkt_ready();
+            REQUIRE(pkt);
+            CHECK(pkt->cmd == (0x20 + i));
+            pkt_rx_free(pkt);
+        }
+        pkt = pkt_ready();
+        CHECK_FALSE(pkt);        CHECK(stats_get(STATS_NOBUF) == 1);
+        CHECK(stats_get(STATS_RX_PKT) == PKT_RX_POOL_DEPTH);
+    }
+
+    SECTION("continuous with pickup")
+    {
+        // run many packets through with the client always holding one
+        // packet. this makes the ready FIFO wrap around
+        packet_t *held = NULL;
+        for (int i = 0; i < 50; ++i)
+        {
+            send_packet_no_check(i);
+            send_packet_no_check(i + 100);
+            pkt = pkt_ready();
+            REQUIRE(pkt);
+            CHECK(pkt->cmd == i);
+            pkt_rx_free(pkt);
+            pkt = pkt_ready();
+            REQUIRE(pkt);
+            CHECK(pkt->cmd == (i + 100));
+            if (held)
+            {
+                pkt_rx_free(held);
+            }
+            held = pkt;
+        }
+        pkt_rx_free(held);
+        CHECK_FALSE(pkt_ready());
+        CHECK_FALSE(pkt_is_active());
+    }
+}
+
+// empty the packet TX queue, as if all packets were sent
+static void drain_txq(void)
+{
+    while (pkt_tx_depth())
+    {
+        pkt_tx_done();
+    }
+}
+
 TEST_CASE("Packet send")
 {
     // expected preamble plus sync bytes
@@ -392,7 +657,7 @@ TEST_CASE("Packet send")
 
     // header data
     // start crc computation
-    uint8_t flags = 0x88;
+    uint8_t flags = 0x84;
     uint8_t addr = 99;
     uint8_t cmd = 13;
     uint8_t len; // set in test case
@@ -400,13 +665,18 @@ TEST_CASE("Packet send")
     crc = _crc8_ccitt_update(crc, addr);
     crc = _crc8_ccitt_update(crc, cmd);
 
-    RESET_FAKE(ser_write);
+    drain_txq();
+    stats_clear();
+    RESET_FAKE(ser_write_desc);
+    ser_write_desc_fake.custom_fake = ser_write_desc_custom_fake;
+    ser_write_desc_fake.return_val = true;
 
     SECTION("len too long")
     {
-        bool ret = pkt_send(flags, addr, cmd, buf, 13);
+        bool ret = pkt_send(flags, addr, cmd, buf, PKT_PAYLOAD_LEN + 1);
         CHECK_FALSE(ret);
-        CHECK_FALSE(ser_write_fake.call_count);
+        CHECK_FALSE(ser_write_desc_fake.call_count);
+        CHECK(stats_get(STATS_TX_PKT) == 0);
     }
 
     SECTION("zero payload bytes")
@@ -414,13 +684,13 @@ TEST_CASE("Packet send")
         len = 0;
         crc = _crc8_ccitt_update(crc, len);
         uint8_t totlen = len + 10;
-        ser_write_fake.return_val = totlen;
 
         bool ret = pkt_send(flags, addr, cmd, buf, len);
         CHECK(ret);
-        REQUIRE(ser_write_fake.call_count == 1);
-        uint8_t *txbuf = ser_write_fake.arg0_val;
-        uint8_t txlen = ser_write_fake.arg1_val;
+        CHECK(stats_get(STATS_TX_PKT) == 1);
+        REQUIRE(ser_write_desc_fake.call_count == 1);
+        uint8_t *txbuf = ser_txbuf;
+        uint8_t txlen = ser_txlen;
         CHECK(txlen == totlen);
         CHECK(memcmp(sync, txbuf, 5) == 0);
         CHECK(txbuf[5] == flags);
@@ -439,13 +709,12 @@ TEST_CASE("Packet send")
             crc = _crc8_ccitt_update(crc, buf[i]);
         }
         uint8_t totlen = len + 10;
-        ser_write_fake.return_val = totlen;
 
         bool ret = pkt_send(flags, addr, cmd, buf, len);
         CHECK(ret);
-        REQUIRE(ser_write_fake.call_count == 1);
-        uint8_t *txbuf = ser_write_fake.arg0_val;
-        uint8_t txlen = ser_write_fake.arg1_val;
+        REQUIRE(ser_write_desc_fake.call_count == 1);
+        uint8_t *txbuf = ser_txbuf;
+        uint8_t txlen = ser_txlen;
         CHECK(txlen == totlen);
         CHECK(memcmp(sync, txbuf, 5) == 0);
         CHECK(txbuf[5] == flags);
@@ -465,13 +734,12 @@ TEST_CASE("Packet send")
             crc = _crc8_ccitt_update(crc, buf[i]);
         }
         uint8_t totlen = len + 10;
-        ser_write_fake.return_val = totlen;
 
         bool ret = pkt_send(flags, addr, cmd, buf, len);
         CHECK(ret);
-        REQUIRE(ser_write_fake.call_count == 1);
-        uint8_t *txbuf = ser_write_fake.arg0_val;
-        uint8_t txlen = ser_write_fake.arg1_val;
+        REQUIRE(ser_write_desc_fake.call_count == 1);
+        uint8_t *txbuf = ser_txbuf;
+        uint8_t txlen = ser_txlen;
         CHECK(txlen == totlen);
         CHECK(memcmp(sync, txbuf, 5) == 0);
         CHECK(txbuf[5] == flags);
@@ -491,13 +759,12 @@ TEST_CASE("Packet send")
             crc = _crc8_ccitt_update(crc, buf[i]);
         }
         uint8_t totlen = len + 10;
-        ser_write_fake.return_val = totlen;
 
         bool ret = pkt_send(flags, addr, cmd, buf, len);
         CHECK(ret);
-        REQUIRE(ser_write_fake.call_count == 1);
-        uint8_t *txbuf = ser_write_fake.arg0_val;
-        uint8_t txlen = ser_write_fake.arg1_val;
+        REQUIRE(ser_write_desc_fake.call_count == 1);
+        uint8_t *txbuf = ser_txbuf;
+        uint8_t txlen = ser_txlen;
         CHECK(txlen == totlen);
         CHECK(memcmp(sync, txbuf, 5) == 0);
         CHECK(txbuf[5] == flags);
@@ -508,7 +775,35 @@ TEST_CASE("Packet send")
         CHECK(txbuf[totlen - 1] == crc);
     }
 
-    SECTION("return len mismatch")
+    SECTION("payload built in place")
+    {
+        len = 5;
+        crc = _crc8_ccitt_update(crc, len);
+        for (int i = 0; i < len; i++)
+        {
+            crc = _crc8_ccitt_update(crc, buf[i]);
+        }
+        uint8_t totlen = len + 10;
+
+        uint8_t *txpld = pkt_tx_buf();
+        REQUIRE(txpld);
+        memcpy(txpld, buf, len);
+        bool ret = pkt_send(flags, addr, cmd, txpld, len);
+        CHECK(ret);
+        REQUIRE(ser_write_desc_fake.call_count == 1);
+        CHECK(ser_write_desc_fake.arg1_val == 3);
+        // payload is sent from where it was built, after the header
+        CHECK(ser_txdesc[1].buf + PKT_HEADER_LEN == txpld);
+        uint8_t *txbuf = ser_txbuf;
+        uint8_t txlen = ser_txlen;
+        CHECK(txlen == totlen);
+        CHECK(memcmp(sync, txbuf, 5) == 0);
+        CHECK(txbuf[8] == len);
+        CHECK(memcmp(&txbuf[9], buf, len) == 0);
+        CHECK(txbuf[totlen - 1] == crc);
+    }
+
+    SECTION("serial not accepted")
     {
         len = 12;
         crc = _crc8_ccitt_update(crc, len);
@@ -517,13 +812,13 @@ TEST_CASE("Packet send")
             crc = _crc8_ccitt_update(crc, buf[i]);
         }
         uint8_t totlen = len + 10;
-        ser_write_fake.return_val = totlen - 1;
+        ser_write_desc_fake.return_val = false;
 
         bool ret = pkt_send(flags, addr, cmd, buf, len);
         CHECK_FALSE(ret);
-        REQUIRE(ser_write_fake.call_count == 1);
-        uint8_t *txbuf = ser_write_fake.arg0_val;
-        uint8_t txlen = ser_write_fake.arg1_val;
+        REQUIRE(ser_write_desc_fake.call_count == 1);
+        uint8_t *txbuf = ser_txbuf;
+        uint8_t txlen = ser_txlen;
         CHECK(txlen == totlen);
         CHECK(memcmp(sync, txbuf, 5) == 0);
         CHECK(txbuf[5] == flags);
@@ -532,6 +827,462 @@ TEST_CASE("Packet send")
         CHECK(txbuf[8] == len);
         CHECK(memcmp(&txbuf[9], buf, len) == 0);
         CHECK(txbuf[totlen - 1] == crc);
+        // packet is not left in the queue
+        CHECK(pkt_tx_depth() == 0);
+    }
+}
+
+TEST_CASE("Packet idle abort")
+{
+    pkt_reset();
+    stats_clear();
+    RESET_FAKE(cmd_accept);
+    cmd_accept_fake.return_val = true;
+
+    uint8_t buf[3] = { 0x11, 0x22, 0x33 };
+
+    SECTION("bytes are counted")
+    {
+        uint8_t count = pkt_rx_count();
+        send_preambles(2);
+        send_sync();
+        CHECK((uint8_t)(pkt_rx_count() - count) == 3);
+    }
+
+    SECTION("nothing to abandon while searching")
+    {
+        CHECK_FALSE(pkt_rx_abort());
+        send_preambles(3);
+        CHECK_FALSE(pkt_rx_abort());
+    }
+
+    SECTION("header")
+    {
+        send_preambles(1);
+        send_sync();
+        send_bytes_get_null(buf, 2);
+        CHECK(pkt_is_active());
+        CHECK(pkt_rx_abort());
+        CHECK_FALSE(pkt_is_active());
+    }
+
+    SECTION("payload buffer is released")
+    {
+        send_preambles(1);
+        send_sync();
+        send_hdr_get_crc(0, 1, 1, 3);
+        send_bytes_get_null(buf, 2);
+        CHECK(pkt_rx_abort());
+        CHECK_FALSE(pkt_is_active());
+
+        // the next packet is received normally
+        send_preambles(1);
+        send_sync();
+        uint8_t crc = send_hdr_get_crc(0, 1, 1, 3);
+        send_bytes_get_null(buf, 3);
+        crc = get_crc(crc, buf, 3);
+        packet_t *pkt = send_byte_get_pkt(crc);
+        REQUIRE(pkt);
+        CHECK(pkt->payload[2] == 0x33);
+        pkt_rx_free(pkt);
+    }
+
+    SECTION("ready packet is kept")
+    {
+        send_preambles(1);
+        send_sync();
+        uint8_t crc = send_hdr_get_crc(0, 1, 1, 0);
+        // the parser is run directly from here on, because the send
+        // helpers take the ready packet
+        const uint8_t next[] = { crc, 0x55, 0xF0, 0, 1, 1, 3, 0x11 };
+        for (uint8_t idx = 0; idx < sizeof(next); ++idx)
+        {
+            pkt_parser(next[idx]);
+        }
+        CHECK(pkt_rx_abort());
+        packet_t *pkt = pkt_ready();
+        REQUIRE(pkt);
+        CHECK(pkt->len == 0);
+        pkt_rx_free(pkt);
+        CHECK_FALSE(pkt_is_active());
+    }
+}
+
+// return the crc16 for a chunk of data
+static uint16_t get_crc16(uint16_t crc, const uint8_t *buf, uint8_t len)
+{
+    for (int idx = 0; idx < len; ++idx)
+    {
+        crc = _crc_ccitt_update(crc, buf[idx]);
+    }
+    return crc;
+}
+
+TEST_CASE("CRC-16 packets")
+{
+    pkt_reset();
+    stats_clear();
+    drain_txq();
+    RESET_FAKE(cmd_accept);
+    cmd_accept_fake.return_val = true;
+    RESET_FAKE(ser_write_desc);
+    ser_write_desc_fake.custom_fake = ser_write_desc_custom_fake;
+    ser_write_desc_fake.return_val = true;
+
+    uint8_t flags = PKT_FLAG_CRC16;
+    uint8_t frame[4 + 3 + 2] = { flags, 1, 0x42, 3, 0x11, 0x22, 0x33 };
+    uint16_t crc = get_crc16(0xFFFF, frame, 7);
+    frame[7] = crc;
+    frame[8] = crc >> 8;
+
+    SECTION("check value")
+    {
+        // CRC-16/MCRF4XX of "123456789"
+        const uint8_t check[] = "123456789";
+        CHECK(get_crc16(0xFFFF, check, 9) == 0x6F91);
+        // the crc over the whole frame is 0
+        CHECK(get_crc16(0xFFFF, frame, sizeof(frame)) == 0);
+    }
+
+    SECTION("received")
+    {
+        send_preambles(1);
+        send_sync();
+        send_bytes_get_null(frame, sizeof(frame) - 1);
+        packet_t *pkt = send_byte_get_pkt(frame[8]);
+        REQUIRE(pkt);
+        CHECK(pkt->flags == flags);
+        CHECK(pkt->len == 3);
+        CHECK(pkt->payload[2] == 0x33);
+        CHECK(stats_get(STATS_RX_PKT) == 1);
+        pkt_rx_free(pkt);
+    }
+
+    SECTION("bad crc high byte")
+    {
+        frame[8] ^= 0x01;
+        send_preambles(1);
+        send_sync();
+        send_bytes_get_null(frame, sizeof(frame));
+        CHECK(stats_get(STATS_CRC_ERR) == 1);
+        CHECK_FALSE(pkt_is_active());
+    }
+
+    SECTION("CRC-8 trailer is not accepted")
+    {
+        send_preambles(1);
+        send_sync();
+        send_bytes_get_null(frame, 7);
+        send_byte_get_null(get_crc(0, frame, 7));
+        // still waiting for the second crc byte
+        CHECK(pkt_is_active());
+        send_byte_get_null(0);
+        CHECK(stats_get(STATS_CRC_ERR) == 1);
+    }
+
+    SECTION("no payload")
+    {
+        uint8_t hdr[6] = { flags, 1, 1, 0 };
+        crc = get_crc16(0xFFFF, hdr, 4);
+        hdr[4] = crc;
+        hdr[5] = crc >> 8;
+        send_preambles(1);
+        send_sync();
+        send_bytes_get_null(hdr, 5);
+        packet_t *pkt = send_byte_get_pkt(hdr[5]);
+        REQUIRE(pkt);
+        CHECK(pkt->cmd == 1);
+        pkt_rx_free(pkt);
+    }
+
+    SECTION("not wanted is skipped")
+    {
+        cmd_accept_fake.return_val = false;
+        send_preambles(1);
+        send_sync();
+        send_bytes_get_null(frame, sizeof(frame));
+        CHECK_FALSE(pkt_is_active());
+
+        // next packet is received normally
+        cmd_accept_fake.return_val = true;
+        send_preambles(1);
+        send_sync();
+        send_bytes_get_null(frame, sizeof(frame) - 1);
+        packet_t *pkt = send_byte_get_pkt(frame[8]);
+        REQUIRE(pkt);
+        pkt_rx_free(pkt);
+    }
+
+    SECTION("sent")
+    {
+        uint8_t buf[3] = { 0x11, 0x22, 0x33 };
+        REQUIRE(pkt_send(flags, 1, 0x42, buf, 3));
+        REQUIRE(ser_write_desc_fake.call_count == 1);
+        CHECK(ser_txlen == 5 + sizeof(frame));
+        CHECK(memcmp(&ser_txbuf[5], frame, sizeof(frame)) == 0);
+        CHECK(ser_txdesc[2].len == 2);
+        drain_txq();
+    }
+}
+
+TEST_CASE("Packet stamp")
+{
+    pkt_reset();
+    stats_clear();
+    drain_txq();
+    RESET_FAKE(cmd_accept);
+    cmd_accept_fake.return_val = true;
+    RESET_FAKE(ser_write_desc);
+    ser_write_desc_fake.custom_fake = ser_write_desc_custom_fake;
+    ser_write_desc_fake.return_val = true;
+    RESET_FAKE(tmr_ms);
+    RESET_FAKE(tmr_us);
+
+    // command received at 1000 ms
+    tmr_ms_fake.return_val = 1000;
+    tmr_us_fake.return_val = 40000;
+    send_preambles(1);
+    send_sync();
+    uint8_t crc = send_hdr_get_crc(PKT_FLAG_STAMP, 1, 6, 0);
+    packet_t *pkt = send_byte_get_pkt(crc);
+    REQUIRE(pkt);
+    CHECK(pkt->stamp[0] == 0xE8); // 1000
+    CHECK(pkt->stamp[1] == 0x03);
+    pkt_rx_free(pkt);
+
+    uint8_t buf[3] = { 0x11, 0x22, 0x33 };
+    uint8_t flags = PKT_FLAG_REPLY | PKT_FLAG_STAMP;
+
+    SECTION("reply has the trailer")
+    {
+        // reply is 350 us after the sync byte
+        tmr_us_fake.return_val = 40350;
+        REQUIRE(pkt_send(flags, 1, 6, buf, 3));
+        REQUIRE(ser_write_desc_fake.call_count == 1);
+        CHECK(ser_txdesc[1].len == PKT_HEADER_LEN + 3);
+        CHECK(ser_txdesc[2].len == 5);
+        CHECK(ser_txlen == 5 + PKT_HEADER_LEN + 7 + 1);
+        uint8_t *txpkt = &ser_txbuf[5];
+        CHECK(txpkt[0] == flags);
+        CHECK(txpkt[3] == 7);
+        CHECK(memcmp(&txpkt[4], buf, 3) == 0);
+        CHECK(txpkt[7] == 0xE8);
+        CHECK(txpkt[8] == 0x03);
+        CHECK(txpkt[9] == 0x5E); // 350
+        CHECK(txpkt[10] == 0x01);
+        CHECK(txpkt[11] == get_crc(0, txpkt, 11));
+        drain_txq();
+    }
+
+    SECTION("turnaround wraps")
+    {
+        tmr_ms_fake.return_val = 1026;
+        tmr_us_fake.return_val = (uint16_t)(40000 + 26000);
+        REQUIRE(pkt_send(flags, 1, 6, buf, 0));
+        uint8_t *txpkt = &ser_txbuf[5];
+        CHECK(txpkt[3] == 4);
+        CHECK(txpkt[6] == 0x90); // 26000
+        CHECK(txpkt[7] == 0x65);
+        drain_txq();
+    }
+
+    SECTION("turnaround saturates")
+    {
+        tmr_ms_fake.return_val = 1100;
+        REQUIRE(pkt_send(flags, 1, 6, buf, 0));
+        uint8_t *txpkt = &ser_txbuf[5];
+        CHECK(txpkt[6] == 0xFF);
+        CHECK(txpkt[7] == 0xFF);
+        drain_txq();
+    }
+
+    SECTION("full payload with trailer")
+    {
+        uint8_t big[PKT_PAYLOAD_LEN] = { 0 };
+        REQUIRE(pkt_send(flags | PKT_FLAG_CRC16, 1, 6, big, PKT_PAYLOAD_LEN));
+        CHECK(ser_txdesc[1].len == PKT_HEADER_LEN + PKT_PAYLOAD_LEN);
+        CHECK(ser_txdesc[2].len == 6);
+        uint8_t *txpkt = &ser_txbuf[5];
+        CHECK(txpkt[3] == PKT_PAYLOAD_LEN + 4);
+        CHECK(get_crc16(0xFFFF, txpkt, PKT_HEADER_LEN + PKT_PAYLOAD_LEN + 6) == 0);
+        drain_txq();
+    }
+
+    SECTION("no trailer without the flag")
+    {
+        REQUIRE(pkt_send(PKT_FLAG_REPLY, 1, 6, buf, 3));
+        CHECK(ser_txdesc[2].len == 1);
+        CHECK(ser_txlen == 5 + PKT_HEADER_LEN + 3 + 1);
+        drain_txq();
+    }
+
+    SECTION("long reply from another node is skipped")
+    {
+        cmd_accept_fake.return_val = false;
+        send_preambles(1);
+        send_sync();
+        send_hdr_get_crc(flags, 2, 6, PKT_PAYLOAD_LEN + 4);
+        CHECK(stats_get(STATS_LEN_ERR) == 0);
+        CHECK(pkt_is_active());
+        uint8_t data[PKT_PAYLOAD_LEN + 5] = { 0 };
+        send_bytes_get_null(data, sizeof(data));
+        CHECK_FALSE(pkt_is_active());
+    }
+
+    SECTION("too long for the trailer")
+    {
+        send_preambles(1);
+        send_sync();
+        send_hdr_get_crc(flags, 2, 6, PKT_PAYLOAD_LEN + 5);
+        CHECK(stats_get(STATS_LEN_ERR) == 1);
+    }
+
+    SECTION("command too long is not stored")
+    {
+        send_preambles(1);
+        send_sync();
+        send_hdr_get_crc(PKT_FLAG_STAMP, 1, 6, PKT_PAYLOAD_LEN + 1);
+        CHECK(cmd_accept_fake.call_count == 1);
+        uint8_t data[PKT_PAYLOAD_LEN + 2] = { 0 };
+        send_bytes_get_null(data, sizeof(data));
+        CHECK_FALSE(pkt_is_active());
+    }
+}
+
+TEST_CASE("Packet TX queue")
+{
+    uint8_t buf[12] = { 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0x70, 0x80, 0x90, 0xA0, 0xB0, 0xC0 };
+
+    drain_txq();
+    RESET_FAKE(ser_write_desc);
+    ser_write_desc_fake.custom_fake = ser_write_desc_custom_fake;
+    ser_write_desc_fake.return_val = true;
+
+    SECTION("fill the queue")
+    {
+        // only the first packet is started, the rest wait in the queue
+        for (uint8_t idx = 0; idx < PKT_TX_QUEUE_DEPTH; ++idx)
+        {
+            REQUIRE(pkt_tx_buf());
+            bool ret = pkt_send(0x80, idx, 1, buf, idx + 1);
+            CHECK(ret);
+            CHECK(pkt_tx_depth() == idx + 1);
+        }
+        CHECK(ser_write_desc_fake.call_count == 1);
+        CHECK(ser_txbuf[6] == 0);
+        CHECK(pkt_tx_hwm() == PKT_TX_QUEUE_DEPTH);
+
+        // queue is full so whole packet is rejected
+        CHECK_FALSE(pkt_tx_buf());
+        bool ret = pkt_send(0x80, 99, 1, buf, 1);
+        CHECK_FALSE(ret);
+        CHECK(pkt_tx_depth() == PKT_TX_QUEUE_DEPTH);
+        CHECK(ser_write_desc_fake.call_count == 1);
+    }
+
+    SECTION("send in order")
+    {
+        for (uint8_t idx = 0; idx < PKT_TX_QUEUE_DEPTH; ++idx)
+        {
+            REQUIRE(pkt_send(0x80, idx, 1, buf, idx + 1));
+        }
+
+        // each completion starts the next packet
+        for (uint8_t idx = 1; idx < PKT_TX_QUEUE_DEPTH; ++idx)
+        {
+            pkt_tx_done();
+            CHECK(pkt_tx_depth() == PKT_TX_QUEUE_DEPTH - idx);
+            REQUIRE(ser_write_desc_fake.call_count == (unsigned)(idx + 1));
+            CHECK(ser_txlen == idx + 1 + 10);
+            CHECK(ser_txbuf[6] == idx);
+            CHECK(ser_txbuf[8] == idx + 1);
+            CHECK(memcmp(&ser_txbuf[9], buf, idx + 1) == 0);
+        }
+
+        // last completion empties the queue, nothing more sent
+        pkt_tx_done();
+        CHECK(pkt_tx_depth() == 0);
+        CHECK(ser_write_desc_fake.call_count == (unsigned)PKT_TX_QUEUE_DEPTH);
+        CHECK(pkt_tx_hwm() == PKT_TX_QUEUE_DEPTH);
+    }
+
+    SECTION("built in place while sending")
+    {
+        REQUIRE(pkt_send(0x80, 1, 1, buf, 4));
+
+        // next buffer is a different slot than the one being sent
+        uint8_t *txpld = pkt_tx_buf();
+        REQUIRE(txpld);
+        CHECK(ser_txdesc[1].buf + PKT_HEADER_LEN != txpld);
+        txpld[0] = 0xAA;
+        txpld[1] = 0x55;
+        REQUIRE(pkt_send(0x80, 2, 1, txpld, 2));
+        CHECK(ser_write_desc_fake.call_count == 1);
+
+        pkt_tx_done();
+        REQUIRE(ser_write_desc_fake.call_count == 2);
+        CHECK(ser_txdesc[1].buf + PKT_HEADER_LEN == txpld);
+        CHECK(ser_txbuf[6] == 2);
+        CHECK(ser_txbuf[9] == 0xAA);
+        CHECK(ser_txbuf[10] == 0x55);
+    }
+
+    SECTION("done with empty queue")
+    {
+        pkt_tx_done();
+        CHECK(pkt_tx_depth() == 0);
+        CHECK(ser_write_desc_fake.call_count == 0);
+    }
+}
+
+TEST_CASE("Packet resend")
+{
+    uint8_t buf[4] = { 0x10, 0x20, 0x30, 0x40 };
+    uint8_t frame[32];
+
+    drain_txq();
+    RESET_FAKE(ser_write_desc);
+    ser_write_desc_fake.custom_fake = ser_write_desc_custom_fake;
+    ser_write_desc_fake.return_val = true;
+
+    // send a sequenced reply and save the frame that went out
+    uint8_t flags = PKT_FLAG_REPLY | PKT_FLAG_SEQ | 5;
+    REQUIRE(pkt_send(flags, 3, 9, buf, 4));
+    memcpy(frame, ser_txbuf, ser_txlen);
+    uint8_t framelen = ser_txlen;
+    pkt_tx_done();
+
+    SECTION("same frame is sent again")
+    {
+        // a reply without a sequence is not kept
+        REQUIRE(pkt_send(PKT_FLAG_REPLY, 3, 10, buf, 2));
+        pkt_tx_done();
+
+        CHECK(pkt_resend());
+        REQUIRE(ser_write_desc_fake.call_count == 3);
+        CHECK(ser_txlen == framelen);
+        CHECK(memcmp(ser_txbuf, frame, framelen) == 0);
+        pkt_tx_done();
+    }
+
+    SECTION("newer sequenced reply replaces the kept one")
+    {
+        REQUIRE(pkt_send(PKT_FLAG_REPLY | PKT_FLAG_SEQ | 6, 3, 10, buf, 2));
+        pkt_tx_done();
+        CHECK(pkt_resend());
+        CHECK(ser_txbuf[5] == (PKT_FLAG_REPLY | PKT_FLAG_SEQ | 6));
+        CHECK(ser_txbuf[7] == 10);
+        pkt_tx_done();
+    }
+
+    SECTION("queue full")
+    {
+        for (uint8_t idx = 0; idx < PKT_TX_QUEUE_DEPTH; ++idx)
+        {
+            REQUIRE(pkt_send(PKT_FLAG_REPLY, idx, 1, buf, 1));
+        }
+        CHECK_FALSE(pkt_resend());
+        drain_txq();
     }
 }
 
@@ -539,6 +1290,9 @@ TEST_CASE("is active")
 {
     // put pkt processor in known state
     pkt_reset();
+    drain_txq();
+    RESET_FAKE(cmd_accept);
+    cmd_accept_fake.return_val = true;
 
     SECTION("not active")
     {
@@ -555,6 +1309,15 @@ TEST_CASE("is active")
         CHECK(ret);
     }
 
+    SECTION("tx queued")
+    {
+        ser_write_desc_fake.return_val = true;
+        REQUIRE(pkt_send(0x80, 1, 1, NULL, 0));
+        bool ret = pkt_is_active();
+        CHECK(ret);
+        drain_txq();
+    }
+
     SECTION("pkt is ready")
     {
         // send a ping packet so that a packet will be ready
@@ -32,6 +32,7 @@
 #include "catch.hpp"
 #include "ser.h"
 #include "cfg.h"
+#include "stats.h"
 
 // we are using fast-faking-framework for provding fake functions called
 // by serial module.
@@ -43,33 +44,70 @@ DEFINE_FFF_GLOBALS;
 // to data internal to the module, for testing purposes
 extern struct serinternals
 {
-    uint8_t *pheadp;
-    uint8_t *ptailp;
-    uint8_t *ptxbuf;
-    uint8_t bufsize;
+    ser_desc_t *ptxdesc;
+    uint8_t *ptxdesc_cnt;
+    uint8_t *ptxdesc_idx;
+    uint8_t *ptxlen;
+    volatile uint8_t *prxhead;
+    volatile uint8_t *prxtail;
 } serial_internals;
 
+// reset the serial module TX internal state
+static void reset_tx(void)
+{
+    memset(serial_internals.ptxdesc, 0, SER_DESC_MAX * sizeof(ser_desc_t));
+    *serial_internals.ptxdesc_cnt = 0;
+    *serial_internals.ptxdesc_idx = 0;
+    *serial_internals.ptxlen = 0;
+}
+
 // the following stuff is from C not C++
 extern "C" {
 
 // fake function for pkt_parser(), called by serial module
 FAKE_VOID_FUNC(pkt_parser, uint8_t);
+FAKE_VALUE_FUNC(bool, baud_is_locked);
+FAKE_VOID_FUNC(baud_rx_error);
+FAKE_VOID_FUNC(pkt_tx_done);
+FAKE_VOID_FUNC(pkt_rx_time, uint16_t, uint16_t);
+FAKE_VALUE_FUNC(uint16_t, tmr_ms);
+FAKE_VALUE_FUNC(uint16_t, tmr_us);
 
 // serial module interrupt functions to be called
 void USART0_RXC_vect(void);
 void USART0_DRE_vect(void);
+void USART0_TXC_vect(void);
 
 // board type global variable
 uint8_t g_board_type = BOARD_TYPE_NONE;
 }
 
+// reset the serial module RX ring
+static void reset_rx(void)
+{
+    *serial_internals.prxhead = 0;
+    *serial_internals.prxtail = 0;
+    stats_clear();
+}
+
+// run the RX ISR for one received byte
+static void rx_byte(uint8_t ch)
+{
+    USART0.STATUS = 0x80; // RXCIF set - data available
+    USART0.RXDATAL = ch;
+    USART0_RXC_vect();
+}
+
 TEST_CASE("RX ISR")
 {
     RESET_FAKE(pkt_parser);
-    *serial_internals.pheadp = 0;
-    *serial_internals.ptailp = 0;
-    memset(serial_internals.ptxbuf, 0, serial_internals.bufsize);
+    RESET_FAKE(baud_is_locked);
+    RESET_FAKE(baud_rx_error);
+    baud_is_locked_fake.return_val = true;
+    reset_tx();
+    reset_rx();
     USART0.STATUS = 0;
+    USART0.RXDATAH = 0;
     USART0.RXDATAL = 0;
     g_board_type = BOARD_TYPE_BMSNODE;
 
@@ -78,50 +116,128 @@ TEST_CASE("RX ISR")
         USART0.STATUS = 0; // no data available
         USART0.RXDATAL = 0x55; // data value - should not get passed
         USART0_RXC_vect(); // call ISR
+        ser_rx_run();
         CHECK_FALSE(pkt_parser_fake.call_count); // should not be called
     }
 
     SECTION("isr with byte")
     {
-        USART0.STATUS = 0x80; // RXCIF set - data available
-        USART0.RXDATAL = 0x55;
-        USART0_RXC_vect();
+        rx_byte(0x55);
+        // parser is not run from the ISR
+        CHECK_FALSE(pkt_parser_fake.call_count);
+        USART0.STATUS = 0;
+        CHECK(ser_is_active());
+        // new board ISR does not send anything
+        CHECK(*serial_internals.ptxdesc_cnt == 0);
+        CHECK(*serial_internals.ptxlen == 0);
+
+        ser_rx_run();
         CHECK(pkt_parser_fake.call_count == 1);
         CHECK(pkt_parser_fake.arg0_val == 0x55);
-        CHECK(*serial_internals.pheadp == 0); // new board ISR does not stuff
-        CHECK(*serial_internals.ptailp == 0); // anything into TX buffer
-        CHECK(serial_internals.ptxbuf[0] == 0);
-        CHECK(serial_internals.ptxbuf[1] == 0);
+        CHECK_FALSE(ser_is_active());
     }
 
-    SECTION("isr and txbuf full")
+    SECTION("isr while baud not locked")
     {
-        // set headp to last position which makes buffer full
-        *serial_internals.pheadp = serial_internals.bufsize - 1;
-        USART0.STATUS = 0x80; // RXCIF set - data available
-        USART0.RXDATAL = 0x55;
-        USART0_RXC_vect();
-        CHECK(pkt_parser_fake.call_count == 1);
-        CHECK(pkt_parser_fake.arg0_val == 0x55);
-        CHECK(*serial_internals.pheadp == (serial_internals.bufsize - 1));
-        CHECK(*serial_internals.ptailp == 0);
-        CHECK(serial_internals.ptxbuf[0] == 0);
-        CHECK(serial_internals.ptxbuf[1] == 0);
+        baud_is_locked_fake.return_val = false;
+        rx_byte(0x55);
+        ser_rx_run();
+        CHECK_FALSE(pkt_parser_fake.call_count); // byte discarded
     }
 
-    SECTION("isr and txbuf full variant")
+    SECTION("sync byte time is latched in the ISR")
     {
-        // set tailp to 1, with headp=0 means buffer is full
-        *serial_internals.ptailp = 1;
-        USART0.STATUS = 0x80; // RXCIF set - data available
-        USART0.RXDATAL = 0x55;
-        USART0_RXC_vect();
-        CHECK(pkt_parser_fake.call_count == 1);
-        CHECK(pkt_parser_fake.arg0_val == 0x55);
-        CHECK(*serial_internals.pheadp == 0);
-        CHECK(*serial_internals.ptailp == 1);
-        CHECK(serial_internals.ptxbuf[0] == 0);
-        CHECK(serial_internals.ptxbuf[1] == 0);
+        RESET_FAKE(pkt_rx_time);
+        RESET_FAKE(tmr_ms);
+        RESET_FAKE(tmr_us);
+        tmr_ms_fake.return_val = 1234;
+        tmr_us_fake.return_val = 5678;
+        rx_byte(0x00);
+        rx_byte(0xF0); // not after a preamble, not a sync
+        rx_byte(0x55);
+        rx_byte(0xF0);
+        CHECK(tmr_ms_fake.call_count == 1);
+
+        // main loop runs later, the ISR time is still used
+        tmr_ms_fake.return_val = 1300;
+        FFF_RESET_HISTORY();
+        ser_rx_run();
+        CHECK(pkt_parser_fake.call_count == 4);
+        REQUIRE(pkt_rx_time_fake.call_count == 1);
+        CHECK(pkt_rx_time_fake.arg0_val == 1234);
+        CHECK(pkt_rx_time_fake.arg1_val == 5678);
+        // time is given just before the sync byte is parsed
+        CHECK(fff.call_history[3] == (void *)pkt_rx_time);
+        CHECK(fff.call_history[4] == (void *)pkt_parser);
+        CHECK(pkt_parser_fake.arg0_val == 0xF0);
+    }
+
+    SECTION("receive errors counted")
+    {
+        USART0.RXDATAH = 0x04; // FERR
+        rx_byte(0x55);
+        USART0.RXDATAH = 0x40; // BUFOVF
+        rx_byte(0x55);
+        USART0.RXDATAH = 0x44; // both
+        rx_byte(0x55);
+        USART0.RXDATAH = 0;
+        rx_byte(0x55);
+        CHECK(stats_get(STATS_FRAME_ERR) == 2);
+        CHECK(stats_get(STATS_OVERRUN) == 2);
+        // framing errors also count toward a new data rate search
+        CHECK(baud_rx_error_fake.call_count == 2);
+
+        // the bytes are still passed on
+        ser_rx_run();
+        CHECK(pkt_parser_fake.call_count == 4);
+    }
+
+    SECTION("receive errors not counted while baud not locked")
+    {
+        baud_is_locked_fake.return_val = false;
+        USART0.RXDATAH = 0x44;
+        rx_byte(0x55);
+        USART0.RXDATAH = 0;
+        CHECK(stats_get(STATS_FRAME_ERR) == 0);
+        CHECK(stats_get(STATS_OVERRUN) == 0);
+    }
+
+    SECTION("bytes passed in order across ring wrap")
+    {
+        // start near the end of the ring
+        *serial_internals.prxhead = 250;
+        *serial_internals.prxtail = 250;
+        for (int i = 0; i < 10; ++i)
+        {
+            rx_byte(0x30 + i);
+        }
+        ser_rx_run();
+        REQUIRE(pkt_parser_fake.call_count == 10);
+        for (int i = 0; i < 10; ++i)
+        {
+            CHECK(pkt_parser_fake.arg0_history[i] == 0x30 + i);
+        }
+        CHECK(stats_get(STATS_RX_OVERFLOW) == 0);
+    }
+
+    SECTION("ring overflow")
+    {
+        for (int i = 0; i < SER_RX_RING_LEN + 3; ++i)
+        {
+            rx_byte(i);
+        }
+        CHECK(stats_get(STATS_RX_OVERFLOW) == 3);
+
+        // the bytes that fit are kept, the extra ones are dropped
+        ser_rx_run();
+        CHECK(pkt_parser_fake.call_count == SER_RX_RING_LEN);
+        CHECK(pkt_parser_fake.arg0_val == SER_RX_RING_LEN - 1);
+
+        // room again after draining
+        rx_byte(0xAA);
+        ser_rx_run();
+        CHECK(pkt_parser_fake.arg0_val == 0xAA);
+        CHECK(stats_get(STATS_RX_OVERFLOW) == 3);
     }
 }
 
@@ -135,190 +251,117 @@ static uint8_t wrdata[33] =
 
 TEST_CASE("ser_write")
 {
-    *serial_internals.pheadp = 0;
-    *serial_internals.ptailp = 0;
-    memset(serial_internals.ptxbuf, 0, serial_internals.bufsize);
+    reset_tx();
     USART0.STATUS = 0;
     USART0.RXDATAL = 0;
     USART0.CTRLA = 0;   // interrupts disabled
     USART0.CTRLB = 0x80; // RX enabled TX disabled
     g_board_type = BOARD_TYPE_BMSNODE;
 
-    SECTION("basic 1 byte")
+    SECTION("single buffer")
     {
-        int ret = ser_write(wrdata, 1);
-        CHECK(ret == 1);
-        CHECK(*serial_internals.pheadp == 1);
-        CHECK(*serial_internals.ptailp == 0);
-        CHECK(serial_internals.ptxbuf[0] == 34);
-        CHECK(serial_internals.ptxbuf[1] == 0);
+        int ret = ser_write(wrdata, 9);
+        CHECK(ret == 9);
+        CHECK(*serial_internals.ptxdesc_cnt == 1);
+        CHECK(*serial_internals.ptxdesc_idx == 0);
+        CHECK(serial_internals.ptxdesc[0].buf == wrdata);
+        CHECK(serial_internals.ptxdesc[0].len == 9);
         // ser_write explicitly enabled TX and disables RX
         // TXCIE and DREIE should both be enabled
         // RX should be disabled and TX enabled
         // NOTE: RX int is actually enabled because of the way the
         // CRITICAL_RX macro works (in the embedded code)
         // The RX interrupt will be left enabled after the ser_write fn
-        // TODO: review this and make sure this is the way the embedded
-        // code should work
         CHECK(USART0.CTRLA == 0xE0);
         CHECK(USART0.CTRLB == 0x40);
-        //INFO("Review RX int handling in CRITICAL_RX");
-        //CHECK(false);
-    }
-
-    SECTION("some bytes")
-    {
-        int ret = ser_write(wrdata, 9);
-        CHECK(ret == 9);
-        CHECK(*serial_internals.pheadp == 9);
-        CHECK(*serial_internals.ptailp == 0);
-        CHECK(serial_internals.ptxbuf[0] == 34);
-        CHECK(serial_internals.ptxbuf[1] == 33);
-        CHECK(serial_internals.ptxbuf[8] == 26);
-        CHECK(serial_internals.ptxbuf[9] == 0);
-        // ser_write explicitly enabled TX and disables RX
-        // TXCIE and DREIE should both be enabled
-        // RX should be disabled and TX enabled
-        CHECK(USART0.CTRLA == 0xE0); // see notes above
-        CHECK(USART0.CTRLB == 0x40);
+        CHECK(ser_tx_busy());
     }
 
-    SECTION("max bytes")
+    SECTION("descriptors")
     {
-        int ret = ser_write(wrdata, 31);
-        CHECK(ret == 31);
-        CHECK(*serial_internals.pheadp == 31);
-        CHECK(*serial_internals.ptailp == 0);
-        CHECK(serial_internals.ptxbuf[0] == 34);
-        CHECK(serial_internals.ptxbuf[1] == 33);
-        CHECK(serial_internals.ptxbuf[8] == 26);
-        CHECK(serial_internals.ptxbuf[30] == 4);
-        CHECK(serial_internals.ptxbuf[31] == 0);
-        // ser_write explicitly enabled TX and disables RX
-        // TXCIE and DREIE should both be enabled
-        // RX should be disabled and TX enabled
+        ser_desc_t desc[3] =
+        {
+            { &wrdata[0], 5 }, { &wrdata[10], 0 }, { &wrdata[20], 3 }
+        };
+        bool ret = ser_write_desc(desc, 3);
+        CHECK(ret);
+        // descriptors are copied so caller array can be reused
+        memset(desc, 0, sizeof(desc));
+        CHECK(*serial_internals.ptxdesc_cnt == 3);
+        CHECK(serial_internals.ptxdesc[0].buf == &wrdata[0]);
+        CHECK(serial_internals.ptxdesc[0].len == 5);
+        CHECK(serial_internals.ptxdesc[1].len == 0);
+        CHECK(serial_internals.ptxdesc[2].buf == &wrdata[20]);
+        CHECK(serial_internals.ptxdesc[2].len == 3);
         CHECK(USART0.CTRLA == 0xE0); // see notes above
         CHECK(USART0.CTRLB == 0x40);
     }
 
-    SECTION("over max bytes")
+    SECTION("bad descriptor count")
     {
-        int ret = ser_write(wrdata, 33);
-        CHECK(ret == 31);
-        CHECK(*serial_internals.pheadp == 31);
-        CHECK(*serial_internals.ptailp == 0);
-        CHECK(serial_internals.ptxbuf[0] == 34);
-        CHECK(serial_internals.ptxbuf[1] == 33);
-        CHECK(serial_internals.ptxbuf[8] == 26);
-        CHECK(serial_internals.ptxbuf[30] == 4);
-        CHECK(serial_internals.ptxbuf[31] == 0);
-        // ser_write explicitly enabled TX and disables RX
-        // TXCIE and DREIE should both be enabled
-        // RX should be disabled and TX enabled
-        CHECK(USART0.CTRLA == 0xE0); // see notes above
-        CHECK(USART0.CTRLB == 0x40);
+        ser_desc_t desc[SER_DESC_MAX + 1] = {};
+        CHECK_FALSE(ser_write_desc(desc, 0));
+        CHECK_FALSE(ser_write_desc(desc, SER_DESC_MAX + 1));
+        CHECK(*serial_internals.ptxdesc_cnt == 0);
+        CHECK(USART0.CTRLA == 0);
+        CHECK(USART0.CTRLB == 0x80);
     }
 
-    SECTION("full then add more")
+    SECTION("busy")
     {
-        int ret = ser_write(wrdata, 31);
-        CHECK(ret == 31);
-        ret = ser_write(wrdata, 4);
+        int ret = ser_write(wrdata, 9);
+        CHECK(ret == 9);
+        // second write is all or nothing, and tx is busy
+        ret = ser_write(&wrdata[9], 4);
         CHECK(ret == 0);
-        CHECK(*serial_internals.pheadp == 31);
-        CHECK(*serial_internals.ptailp == 0);
-        CHECK(serial_internals.ptxbuf[0] == 34);
-        CHECK(serial_internals.ptxbuf[1] == 33);
-        CHECK(serial_internals.ptxbuf[8] == 26);
-        CHECK(serial_internals.ptxbuf[30] == 4);
-        CHECK(serial_internals.ptxbuf[31] == 0);
-        // ser_write explicitly enabled TX and disables RX
-        // TXCIE and DREIE should both be enabled
-        // RX should be disabled and TX enabled
-        CHECK(USART0.CTRLA == 0xE0); // see notes above
-        CHECK(USART0.CTRLB == 0x40);
-    }
-
-    SECTION("rollover")
-    {
-        // load up buffer with 20 first
-        int ret = ser_write(wrdata, 20);
-        CHECK(ret == 20);
-        CHECK(*serial_internals.pheadp == 20);
-        CHECK(*serial_internals.ptailp == 0);
-        CHECK(serial_internals.ptxbuf[0] == 34);
-        CHECK(serial_internals.ptxbuf[1] == 33);
-        CHECK(serial_internals.ptxbuf[19] == 15);
-        CHECK(serial_internals.ptxbuf[20] == 0);
-        // ser_write explicitly enabled TX and disables RX
-        // TXCIE and DREIE should both be enabled
-        // RX should be disabled and TX enabled
-        CHECK(USART0.CTRLA == 0xE0); // see notes above
-        CHECK(USART0.CTRLB == 0x40);
-
-        // adjust tail pointer to "remove" some data from buffer
-        *serial_internals.ptailp = 18;
-
-        // now write another 20 and verify the buffer rolled over
-        ret = ser_write(wrdata, 20);
-        CHECK(ret == 20);
-        CHECK(*serial_internals.pheadp == 8);
-        CHECK(*serial_internals.ptailp == 18);
-        CHECK(serial_internals.ptxbuf[0] == 22);
-        CHECK(serial_internals.ptxbuf[1] == 21);
-        CHECK(serial_internals.ptxbuf[7] == 15);
-        // ser_write explicitly enabled TX and disables RX
-        // TXCIE and DREIE should both be enabled
-        // RX should be disabled and TX enabled
-        CHECK(USART0.CTRLA == 0xE0); // see notes above
-        CHECK(USART0.CTRLB == 0x40);
-    }
-
-    SECTION("full check tailp in middle")
-    {
-        // set tailp in middle to make sure it indicates full
-        *serial_internals.ptailp = 5; // should allow 4 before full
-        int ret = ser_write(wrdata, 20);
-        CHECK(ret == 4);
-        CHECK(*serial_internals.pheadp == 4);
-        CHECK(*serial_internals.ptailp == 5);
-        CHECK(serial_internals.ptxbuf[0] == 34);
-        CHECK(serial_internals.ptxbuf[1] == 33);
-        CHECK(serial_internals.ptxbuf[2] == 32);
-        CHECK(serial_internals.ptxbuf[3] == 31);
-        CHECK(serial_internals.ptxbuf[4] == 0);
-        // ser_write explicitly enabled TX and disables RX
-        // TXCIE and DREIE should both be enabled
-        // RX should be disabled and TX enabled
-        CHECK(USART0.CTRLA == 0xE0); // see notes above
-        CHECK(USART0.CTRLB == 0x40);
+        CHECK(*serial_internals.ptxdesc_cnt == 1);
+        CHECK(serial_internals.ptxdesc[0].buf == wrdata);
+        CHECK(serial_internals.ptxdesc[0].len == 9);
     }
 }
 
 TEST_CASE("ser_flush")
 {
-    *serial_internals.pheadp = 10;
-    *serial_internals.ptailp = 20;
+    *serial_internals.ptxdesc_cnt = 3;
+    *serial_internals.ptxdesc_idx = 1;
+    *serial_internals.ptxlen = 2;
     // TX interrupts are enabled, RX int disabled
     USART0.CTRLA = 0x60;
     ser_flush();
-    CHECK_FALSE(*serial_internals.pheadp);
-    CHECK_FALSE(*serial_internals.ptailp);
+    CHECK_FALSE(*serial_internals.ptxdesc_cnt);
+    CHECK_FALSE(*serial_internals.ptxdesc_idx);
+    CHECK_FALSE(*serial_internals.ptxlen);
     CHECK(USART0.CTRLA == 0x80); // RX int got turned on as expected, TX off
+    CHECK_FALSE(ser_tx_busy());
+}
+
+// run the DRE isr until it stops sending, and collect the bytes
+static int run_tx_isr(uint8_t *testbuf, int maxcnt)
+{
+    int cnt = 0;
+    USART0.STATUS = 0x20; // tx dre int is signalled
+    while ((USART0.CTRLA & 0x20) && (cnt <= maxcnt))
+    {
+        USART0.TXDATAL = 0;
+        USART0_DRE_vect();
+        if (USART0.CTRLA & 0x20)
+        {
+            testbuf[cnt++] = USART0.TXDATAL;
+        }
+    }
+    return cnt;
 }
 
 TEST_CASE("TX isr")
 {
-    *serial_internals.pheadp = 0;
-    *serial_internals.ptailp = 0;
-    memset(serial_internals.ptxbuf, 0, serial_internals.bufsize);
+    reset_tx();
     USART0.CTRLA = 0x60;    // TXC and DRE interrupts enabled
     USART0.CTRLB = 0x40;    // TX enabled RX disabled
     USART0.STATUS = 0;      // nothing pending
     USART0.RXDATAL = 0;
     USART0.TXDATAL = 0;
 
-    SECTION("empty buffer")
+    SECTION("empty")
     {
         // tx int is enabled
         USART0.TXDATAL = 99;            // dummy value to check later
@@ -331,31 +374,28 @@ TEST_CASE("TX isr")
 
     SECTION("1 byte then empty")
     {
-        // put 1 byte in the buffer
+        USART0.CTRLA = 0;
         int ret = ser_write(wrdata, 1);
         CHECK(ret == 1);
 
         // verify isr processes the 1 byte
-        // tx int is already nabled
+        // tx int is already enabled
         USART0.STATUS = 0x20; // tx dre int is signalled
         USART0.TXDATAL = 99; // dummy value to check later
         USART0_DRE_vect();
         CHECK(USART0.TXDATAL == 34); // value from buffer
-        CHECK(*serial_internals.pheadp == 1);
-        CHECK(*serial_internals.ptailp == 1);
+        CHECK(*serial_internals.ptxlen == 0);
         CHECK((USART0.CTRLA & 0x20)); // tx dre int remains enabled
 
         // run isr again and verify it does not process anything
         USART0_DRE_vect();
         CHECK(USART0.TXDATAL == 34); // unchanged from last
-        CHECK(*serial_internals.pheadp == 1); // unchanged
-        CHECK(*serial_internals.ptailp == 1);
         CHECK_FALSE((USART0.CTRLA & 0x20)); // tx dre int was disabled
     }
 
     SECTION("1 byte but tx int not triggered")
     {
-        // put 1 byte in the buffer
+        USART0.CTRLA = 0;
         int ret = ser_write(wrdata, 1);
         CHECK(ret == 1);
 
@@ -367,77 +407,66 @@ TEST_CASE("TX isr")
         CHECK((USART0.CTRLA & 0x20)); // tx dre int remains enabled
     }
 
-    SECTION("full buffer")
+    SECTION("single buffer")
     {
-        uint8_t testbuf[32];
+        uint8_t testbuf[40];
+        USART0.CTRLA = 0;
+        int ret = ser_write(wrdata, 33);
+        CHECK(ret == 33);
 
-        // fill buffer
-        int ret = ser_write(wrdata, 31);
-        CHECK(ret == 31);
+        int cnt = run_tx_isr(testbuf, sizeof(testbuf));
+        CHECK(cnt == 33);
+        CHECK(memcmp(wrdata, testbuf, 33) == 0);
+        CHECK_FALSE((USART0.CTRLA & 0x20)); // tx dre int was disabled
+    }
 
-        // run the isr 31 times and save the produced bytes
-        // tx dre int is already enabled
-        USART0.STATUS = 0x20; // tx dre int is signalled
-        for (int i = 0; i < 31; ++i)
+    SECTION("multiple descriptors")
+    {
+        uint8_t testbuf[40];
+        static const uint8_t preamble[3] = { 0x55, 0x55, 0xF0 };
+        ser_desc_t desc[4] =
         {
-            USART0.TXDATAL = 0;
-            USART0_DRE_vect();
-            if (USART0.TXDATAL == 0)
-            {
-                FAIL("exected non-zero TXDATAL after tx isr");
-            }
-            testbuf[i] = USART0.TXDATAL;
-        }
-        CHECK((USART0.CTRLA & 0x20)); // tx dre int remains enabled
-        CHECK(*serial_internals.pheadp == 31);
-        CHECK(*serial_internals.ptailp == 31);
-        CHECK(memcmp(wrdata, testbuf, 31) == 0);
-
-        // run it one more time and verify TXDATAL not written and int disabled
-        USART0.TXDATAL = 99;
-        USART0_DRE_vect();
-        CHECK(USART0.TXDATAL == 99);
+            { preamble, 3 }, { &wrdata[0], 4 }, { &wrdata[10], 0 }, { &wrdata[20], 2 }
+        };
+        USART0.CTRLA = 0;
+        CHECK(ser_write_desc(desc, 4));
+
+        int cnt = run_tx_isr(testbuf, sizeof(testbuf));
+        CHECK(cnt == 9);
+        uint8_t expected[9] = { 0x55, 0x55, 0xF0, 34, 33, 32, 31, 14, 13 };
+        CHECK(memcmp(expected, testbuf, 9) == 0);
         CHECK_FALSE((USART0.CTRLA & 0x20)); // tx dre int was disabled
-        CHECK(*serial_internals.pheadp == 31);
-        CHECK(*serial_internals.ptailp == 31);
     }
 
-    SECTION("read buffer wrap")
+    SECTION("tx complete")
     {
-        uint8_t testbuf[32];
-
-        // adjust buffer pointers to mid buffer so they will wrap
-        *serial_internals.pheadp = 25;
-        *serial_internals.ptailp = 25;
-        // put some bytes in the buffer
-        int ret = ser_write(wrdata, 20);
-        CHECK(ret == 20);
-
-        // run the isr 20 times and save the produced bytes
-        // tx dre int is already enabled
-        USART0.STATUS = 0x20; // tx dre int is signalled
-        for (int i = 0; i < 20; ++i)
-        {
-            USART0.TXDATAL = 0;
-            USART0_DRE_vect();
-            if (USART0.TXDATAL == 0)
-            {
-                FAIL("exected non-zero TXDATAL after tx isr");
-            }
-            testbuf[i] = USART0.TXDATAL;
-        }
-        CHECK((USART0.CTRLA & 0x20)); // tx dre int remains enabled
-        CHECK(*serial_internals.pheadp == 13);
-        CHECK(*serial_internals.ptailp == 13);
-        CHECK(memcmp(wrdata, testbuf, 20) == 0);
+        uint8_t testbuf[40];
+        RESET_FAKE(pkt_tx_done);
+        USART0.CTRLA = 0;
+        ser_write(wrdata, 3);
+        CHECK(ser_tx_busy());
+        run_tx_isr(testbuf, sizeof(testbuf));
+
+        // last byte shifted out, so turn around to RX
+        USART0_TXC_vect();
+        CHECK_FALSE((USART0.CTRLA & 0x40)); // txc int disabled
+        CHECK(USART0.CTRLB == 0x80); // RX enabled TX disabled
+        CHECK_FALSE(ser_tx_busy());
+        // packet module told so it can send the next one
+        CHECK(pkt_tx_done_fake.call_count == 1);
+    }
 
-        // run it one more time and verify UDR not written and int disabled
-        USART0.TXDATAL = 99;
-        USART0_DRE_vect();
-        CHECK(USART0.TXDATAL == 99);
-        CHECK_FALSE((USART0.CTRLA & 0x20)); // tx dre int was disabled
-        CHECK(*serial_internals.pheadp == 13);
-        CHECK(*serial_internals.ptailp == 13);
+    SECTION("tx complete with data pending")
+    {
+        USART0.CTRLA = 0;
+        ser_write(wrdata, 3);
+        RESET_FAKE(pkt_tx_done);
+        USART0.CTRLA &= ~0x20;
+        USART0_TXC_vect();
+        CHECK((USART0.CTRLA & 0x20)); // dre int enabled again
+        CHECK((USART0.CTRLA & 0x40)); // txc still enabled
+        CHECK(ser_tx_busy());
+        CHECK(pkt_tx_done_fake.call_count == 0);
     }
 }
 
@@ -445,15 +474,16 @@ TEST_CASE("TX isr")
 // CTRLA  - RXCIE(0x80) TXCIE(0x40) DREIE(0x20)
 //
 // is_active when:
-// - data in tx buffer
+// - data waiting to send
 // - UDRE interrupt enabled
 // - TXC interrupt enabled
 // - RX not empty
+// - RX ring not empty
 
 TEST_CASE("is active")
 {
-    *serial_internals.pheadp = 0;
-    *serial_internals.ptailp = 0;
+    reset_tx();
+    reset_rx();
     USART0.STATUS = 0x60; // TXC and UDRE set in idle state
     USART0.CTRLA = 0;
 
@@ -479,10 +509,9 @@ TEST_CASE("is active")
         CHECK(ret);
     }
 
-    SECTION("buffer not empty")
+    SECTION("data waiting to send")
     {
-        // set buffer pointers so the buffer is not empty
-        *serial_internals.pheadp = 3;
+        *serial_internals.ptxdesc_cnt = 1;
         bool ret = ser_is_active();
         CHECK(ret);
     }
@@ -494,4 +523,11 @@ TEST_CASE("is active")
         bool ret = ser_is_active();
         CHECK(ret);
     }
+
+    SECTION("rx ring not empty")
+    {
+        *serial_internals.prxhead = 1;
+        bool ret = ser_is_active();
+        CHECK(ret);
+    }
 }
@@ -0,0 +1,447 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include <avr/io.h> // special test version of header
+#include <util/crc16.h>
+
+#include "catch.hpp"
+#include "ser.h"
+#include "pkt.h"
+#include "crc8.h"
+#include "stats.h"
+#include "baud.h"
+
+// This test suite runs received bytes through the real serial and packet
+// modules together. It is built twice, once with the RX ring buffer and
+// once with SER_RX_ISR_PARSE=1, so that both receive modes are checked and
+// can be compared by the benchmark. The autobaud module is also included,
+// so that waking up from sleep can be simulated.
+
+// we are using fast-faking-framework for provding fake functions called
+// by serial and packet modules.
+// https://github.com/meekrosoft/fff
+#include "fff.h"
+DEFINE_FFF_GLOBALS;
+
+extern "C" {
+
+FAKE_VALUE_FUNC(bool, cmd_accept, uint8_t, uint8_t, uint8_t);
+FAKE_VALUE_FUNC(uint16_t, tmr_ms);
+FAKE_VALUE_FUNC(uint16_t, tmr_us);
+
+// serial module RX interrupt
+void USART0_RXC_vect(void);
+
+// autobaud timer capture interrupt
+void TCB1_INT_vect(void);
+}
+
+// number of bytes in a test packet
+#define TESTPKT_LEN (5 + PKT_HEADER_LEN + 10 + 1)
+
+// build a STATUS reply sized packet with preamble, sync and crc
+static void make_packet(uint8_t *buf, uint8_t cmd)
+{
+    uint8_t idx = 0;
+    uint8_t crc = 0;
+    buf[idx++] = 0x55;
+    buf[idx++] = 0x55;
+    buf[idx++] = 0x55;
+    buf[idx++] = 0x55;
+    buf[idx++] = 0xF0;
+    buf[idx++] = 0;     // flags
+    buf[idx++] = 1;     // addr
+    buf[idx++] = cmd;
+    buf[idx++] = 10;    // len
+    for (uint8_t i = 0; i < 10; ++i)
+    {
+        buf[idx++] = i * 17;
+    }
+    for (uint8_t i = 5; i < idx; ++i)
+    {
+        crc = crc8_update(crc, buf[i]);
+    }
+    buf[idx] = crc;
+}
+
+// number of bytes in a CRC-16 test packet
+#define TESTPKT16_LEN (TESTPKT_LEN + 1)
+
+// build the same packet using the CRC-16 trailer
+static void make_packet16(uint8_t *buf, uint8_t cmd)
+{
+    make_packet(buf, cmd);
+    buf[5] = PKT_FLAG_CRC16;
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 5; i < TESTPKT_LEN - 1; ++i)
+    {
+        crc = _crc_ccitt_update(crc, buf[i]);
+    }
+    buf[TESTPKT_LEN - 1] = crc;
+    buf[TESTPKT_LEN] = crc >> 8;
+}
+
+// run the RX ISR for each byte of a buffer
+static void rx_bytes(const uint8_t *buf, unsigned int len)
+{
+    for (unsigned int idx = 0; idx < len; ++idx)
+    {
+        USART0.STATUS = 0x80; // RXCIF set - data available
+        USART0.RXDATAL = buf[idx];
+        USART0_RXC_vect();
+    }
+    USART0.STATUS = 0;
+}
+
+TEST_CASE("RX stream")
+{
+    RESET_FAKE(cmd_accept);
+    baud_init(4167);
+    baud_set(9600);
+    cmd_accept_fake.return_val = true;
+    pkt_reset();
+    stats_clear();
+
+    uint8_t buf[TESTPKT_LEN];
+
+    SECTION("packets received in order")
+    {
+        for (uint8_t cmd = 1; cmd <= 3; ++cmd)
+        {
+            make_packet(buf, cmd);
+            rx_bytes(buf, sizeof(buf));
+        }
+#if !SER_RX_ISR_PARSE
+        // no parsing until the main loop runs
+        CHECK(ser_is_active());
+        CHECK_FALSE(pkt_is_active());
+#endif
+        ser_rx_run();
+        for (uint8_t cmd = 1; cmd <= 3; ++cmd)
+        {
+            packet_t *pkt = pkt_ready();
+            REQUIRE(pkt);
+            CHECK(pkt->cmd == cmd);
+            CHECK(pkt->len == 10);
+            pkt_rx_free(pkt);
+        }
+        CHECK_FALSE(pkt_ready());
+        CHECK_FALSE(ser_is_active());
+        CHECK(stats_get(STATS_RX_OVERFLOW) == 0);
+        CHECK(stats_get(STATS_RX_PKT) == 3);
+    }
+}
+
+// Simulated bus for wake up from sleep.
+// Each byte on the bus is turned into bits, with a start and stop bit. The
+// autobaud timer captures the time between falling edges, if it is running,
+// and the USART receives the byte if it is programmed within about 3% of the
+// bus data rate. Otherwise the byte is received with a framing error.
+// Time is in timer counts (10 MHz).
+static double bus_time;     // time of the start of the next byte
+static double bus_edge;     // time of the last falling edge
+static bool bus_level;      // line level at the end of the last byte
+
+// start the bus after a long idle time
+static void bus_idle(void)
+{
+    bus_time = 1000000.0;
+    bus_edge = 0;
+    bus_level = true;
+}
+
+// send one byte on the bus, at the specified data rate
+// if lost is true, the MCU is asleep and does not see the byte at all
+static void bus_byte(uint8_t ch, uint32_t bps, bool lost)
+{
+    double bit = 10000000.0 / bps;
+    uint16_t frame = ((uint16_t)ch << 1) | 0x200; // start bit 0, stop bit 1
+    for (uint8_t idx = 0; idx < 10; ++idx)
+    {
+        bool level = (frame >> idx) & 1;
+        if (bus_level && !level)
+        {
+            double edge = bus_time + (idx * bit);
+            if (!lost && (TCB1.INTCTRL & TCB_CAPT_bm))
+            {
+                double period = edge - bus_edge;
+                TCB1.CCMP = (period > 65535.0) ? 65535 : (uint16_t)(period + 0.5);
+                TCB1_INT_vect();
+            }
+            bus_edge = edge;
+        }
+        bus_level = level;
+    }
+    bus_time += 10 * bit;
+
+    if (!lost)
+    {
+        double expect = (4.0 * 10000000.0) / bps;
+        double err = (USART0.BAUD - expect) / expect;
+        bool ok = (err > -0.03) && (err < 0.03);
+        USART0.STATUS = 0x80; // RXCIF set - data available
+        USART0.RXDATAH = ok ? 0 : USART_FERR_bm;
+        USART0.RXDATAL = ok ? ch : 0;
+        USART0_RXC_vect();
+        USART0.STATUS = 0;
+        USART0.RXDATAH = 0;
+    }
+}
+
+// wake a sleeping node with a packet that has `count` preamble bytes
+// the first preamble byte is the one that wakes the MCU. In the worst case
+// it is lost, because the oscillator is not running in time to receive it.
+// return true if the packet was received
+static bool wake_packet(unsigned int count, uint32_t bps, bool recheck)
+{
+    uint8_t buf[TESTPKT_LEN];
+    make_packet(buf, 6);
+
+    pkt_reset();
+    bus_idle();
+    if (recheck)
+    {
+        baud_recheck();
+    }
+    else
+    {
+        baud_search();
+    }
+
+    for (unsigned int idx = 0; idx < count; ++idx)
+    {
+        bus_byte(0x55, bps, idx == 0);
+    }
+    // rest of the packet, after the preamble in the test packet
+    for (unsigned int idx = 4; idx < sizeof(buf); ++idx)
+    {
+        bus_byte(buf[idx], bps, false);
+    }
+    ser_rx_run();
+
+    packet_t *pkt = pkt_ready();
+    if (pkt)
+    {
+        pkt_rx_free(pkt);
+        return true;
+    }
+    return false;
+}
+
+// least number of preamble bytes for the packet that wakes the node
+static unsigned int wake_preambles(uint32_t bps, bool recheck)
+{
+    for (unsigned int count = 1; count <= 16; ++count)
+    {
+        if (wake_packet(count, bps, recheck))
+        {
+            return count;
+        }
+    }
+    return 0;
+}
+
+TEST_CASE("Wake up")
+{
+    RESET_FAKE(cmd_accept);
+    cmd_accept_fake.return_val = true;
+    baud_init(4167);
+    baud_set(9600);
+    stats_clear();
+
+    SECTION("first packet is received")
+    {
+        // lost wake up byte, and one more preamble before the sync
+        CHECK(wake_packet(2, 9600, true));
+        CHECK(baud_is_locked());
+        CHECK(stats_get(STATS_RX_PKT) == 1);
+    }
+
+    SECTION("needed preamble, same data rate")
+    {
+        CHECK(wake_preambles(9600, true) == 2);
+        // without the recheck, bytes are dropped until the rate is measured
+        CHECK(wake_preambles(9600, false) == 3);
+    }
+
+    SECTION("data rate changed during sleep")
+    {
+        // the new rate must be measured either way
+        CHECK(wake_preambles(57600, true) == 3);
+        CHECK(USART0.BAUD >= 694);
+        CHECK(USART0.BAUD <= 695);
+    }
+}
+
+// read a timestamp, host cycles (or ns)
+static double bench_now(void)
+{
+#ifdef HAVE_RDTSC
+    return (double)__rdtsc();
+#else
+    return std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// hidden benchmark, run with "make bench" or "bmstest_serpkt [bench]"
+// This measures the time spent in the RX ISR for each byte, and the time
+// spent parsing in the main loop. With the ring buffer the ISR only stores
+// the byte, and the parser runs from the main loop. Host timing is only
+// meaningful as a comparison between the two builds.
+TEST_CASE("RX ISR benchmark", "[.][bench]")
+{
+    baud_init(4167);
+    baud_set(9600);
+    cmd_accept_fake.return_val = true;
+    pkt_reset();
+
+    uint8_t buf[TESTPKT_LEN];
+    make_packet(buf, 6);
+    const unsigned int loops = 100000;
+    double isr = 0;
+    double loop = 0;
+    unsigned int count = 0;
+
+    for (unsigned int idx = 0; idx < loops; ++idx)
+    {
+        double start = bench_now();
+        rx_bytes(buf, sizeof(buf));
+        double mid = bench_now();
+        ser_rx_run();
+        double end = bench_now();
+        isr += mid - start;
+        loop += end - mid;
+
+        packet_t *pkt = pkt_ready();
+        if (pkt)
+        {
+            ++count;
+            pkt_rx_free(pkt);
+        }
+    }
+    CHECK(count == loops);
+
+#ifdef HAVE_RDTSC
+    const char *units = "cycles/byte";
+#else
+    const char *units = "ns/byte";
+#endif
+    double bytes = (double)sizeof(buf) * loops;
+    printf("RX host benchmark, SER_RX_ISR_PARSE=%d (%s)\n", SER_RX_ISR_PARSE, units);
+    printf("  RX ISR:    %6.2f\n", isr / bytes);
+    printf("  main loop: %6.2f\n", loop / bytes);
+}
+
+// time the parser alone over a buffer, return total time
+static double bench_parser(const uint8_t *buf, unsigned int len,
+                           unsigned int loops, unsigned int *count)
+{
+    double total = 0;
+    for (unsigned int idx = 0; idx < loops; ++idx)
+    {
+        double start = bench_now();
+        for (unsigned int i = 0; i < len; ++i)
+        {
+            pkt_parser(buf[i]);
+        }
+        total += bench_now() - start;
+
+        packet_t *pkt = pkt_ready();
+        if (pkt)
+        {
+            ++*count;
+            pkt_rx_free(pkt);
+        }
+    }
+    return total;
+}
+
+// hidden benchmark, run with "make bench" or "bmstest_serpkt [bench]"
+// This compares the per byte parser cost of the CRC-8 and CRC-16 trailers.
+// Host timing is only meaningful as a comparison between the two modes.
+TEST_CASE("Parser CRC benchmark", "[.][bench]")
+{
+    cmd_accept_fake.return_val = true;
+    pkt_reset();
+
+    uint8_t buf8[TESTPKT_LEN];
+    uint8_t buf16[TESTPKT16_LEN];
+    make_packet(buf8, 6);
+    make_packet16(buf16, 6);
+    const unsigned int loops = 100000;
+    unsigned int count8 = 0;
+    unsigned int count16 = 0;
+
+    double t8 = bench_parser(buf8, sizeof(buf8), loops, &count8);
+    double t16 = bench_parser(buf16, sizeof(buf16), loops, &count16);
+    CHECK(count8 == loops);
+    CHECK(count16 == loops);
+
+#ifdef HAVE_RDTSC
+    const char *units = "cycles/byte";
+#else
+    const char *units = "ns/byte";
+#endif
+    printf("Parser host benchmark (%s)\n", units);
+    printf("  CRC-8:  %6.2f\n", t8 / ((double)sizeof(buf8) * loops));
+    printf("  CRC-16: %6.2f\n", t16 / ((double)sizeof(buf16) * loops));
+}
+
+// hidden benchmark, run with "make bench" or "bmstest_serpkt [bench]"
+// This reports the worst case time from the start of the packet that wakes
+// a node until the node is ready for the sync byte, which is the preamble
+// that the packet needs. It is measured with the simulated bus, so it does
+// not depend on the host.
+TEST_CASE("Wake latency benchmark", "[.][bench]")
+{
+    cmd_accept_fake.return_val = true;
+    const uint32_t rates[] = { 9600, 57600, 115200 };
+
+    printf("Wake up preamble, worst case (bytes, microseconds)\n");
+    for (unsigned int idx = 0; idx < (sizeof(rates) / sizeof(rates[0])); ++idx)
+    {
+        uint32_t bps = rates[idx];
+        baud_init(4167);
+        baud_set(bps);
+        unsigned int recheck = wake_preambles(bps, true);
+        baud_set(bps);
+        unsigned int search = wake_preambles(bps, false);
+        CHECK(recheck);
+        CHECK(search);
+        double bytetime = 10000000.0 / bps;
+        printf("  %6u bps: recheck %u (%5.0f), search %u (%5.0f)\n",
+               (unsigned int)bps, recheck, recheck * bytetime,
+               search, search * bytetime);
+    }
+}
@@ -0,0 +1,70 @@
+/******************************************************************************
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright 2020 Joseph Kroesche
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include <stdint.h>
+
+#include "catch.hpp"
+#include "stats.h"
+
+TEST_CASE("Statistics")
+{
+    stats_clear();
+
+    SECTION("cleared")
+    {
+        for (int id = 0; id < STATS_NUM; ++id)
+        {
+            CHECK(stats_get((enum stats_id)id) == 0);
+        }
+    }
+
+    SECTION("counters are separate")
+    {
+        stats_inc(STATS_CRC_ERR);
+        stats_inc(STATS_CRC_ERR);
+        stats_inc(STATS_RX_PKT);
+        CHECK(stats_get(STATS_CRC_ERR) == 2);
+        CHECK(stats_get(STATS_RX_PKT) == 1);
+        CHECK(stats_get(STATS_TX_PKT) == 0);
+
+        stats_clear();
+        CHECK(stats_get(STATS_CRC_ERR) == 0);
+        CHECK(stats_get(STATS_RX_PKT) == 0);
+    }
+
+    SECTION("counter saturates")
+    {
+        for (unsigned int cnt = 0; cnt < 0x10005; ++cnt)
+        {
+            stats_inc(STATS_FRAME_ERR);
+        }
+        CHECK(stats_get(STATS_FRAME_ERR) == 0xFFFF);
+    }
+
+    SECTION("invalid id")
+    {
+        stats_inc(STATS_NUM);
+        CHECK(stats_get(STATS_NUM) == 0);
+    }
+}
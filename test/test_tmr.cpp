@@ -56,6 +56,42 @@ TEST_CASE("isr advance")
     CHECK(*p_systick == 10);
 }
 
+TEST_CASE("tmr timestamps")
+{
+    *p_systick = 1234;
+    TCB0.CNT = 0;
+    TCB0.INTFLAGS = 0;
+    CHECK(tmr_ms() == 1234);
+    CHECK(tmr_us() == (uint16_t)1234000U);
+
+    SECTION("timer count")
+    {
+        TCB0.CNT = 4567;
+        CHECK(tmr_us() == (uint16_t)(1234000U + 456U));
+    }
+
+    SECTION("tick pending")
+    {
+        // timer wrapped, but the interrupt has not run yet
+        TCB0.CNT = 20;
+        TCB0.INTFLAGS = TCB_CAPT_bm;
+        CHECK(tmr_us() == (uint16_t)(1235000U + 2U));
+        CHECK(tmr_ms() == 1234);
+        TCB0.INTFLAGS = 0;
+    }
+
+    SECTION("wraps")
+    {
+        *p_systick = 65535;
+        TCB0.CNT = 9990;
+        uint16_t us = tmr_us();
+        *p_systick = 0;
+        TCB0.CNT = 10;
+        CHECK((uint16_t)(tmr_us() - us) == 2);
+    }
+    TCB0.CNT = 0;
+}
+
 TEST_CASE("tmr set")
 {
     uint16_t tmr;
@@ -28,6 +28,16 @@ uint8_t _crc8_ccitt_update(uint8_t inCrc, uint8_t inData)
     return data;
 }
 
+// provide the CCITT crc16 function from avr-libc. This is the C equivalent
+// given in the avr-libc documentation.
+uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+    data ^= (uint8_t)crc;
+    data ^= data << 4;
+    return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
+            ^ ((uint16_t)data << 3));
+}
+
 #ifdef TEST_MAIN
 
 // this can be used to generate crc for a config with test values.
@@ -45,9 +55,10 @@ uint8_t _crc8_ccitt_update(uint8_t inCrc, uint8_t inData)
 
 static config_t testcfg =
 {
-    26, 2, 99,
+    28, 3, 99,
     1234, 5678, 4321, 7865, 5555, -9000,
-    32767, 32768, 65535, 120, -100, 10000
+    32767, 32768, 65535, 120, -100, 10000,
+    0x0005
 };
 
 int main(void)
@@ -9,6 +9,7 @@ extern "C" {
 #endif
 
 extern uint8_t _crc8_ccitt_update(uint8_t, uint8_t);
+extern uint16_t _crc_ccitt_update(uint16_t, uint8_t);
 
 #ifdef __cplusplus
 }